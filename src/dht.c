@@ -31,14 +31,19 @@
 #include "dhtrouter.h"
 #include "dhtserver.h"
 #include "dhttrans.h"
+#include "dhtio.h"
 #include "dht.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
+/* 
+ * set up the router and return at once, the caller drives it with
+ * dht_process_once or dr_run
+ * */
 dht_t *
-dht_new (const char *inifile, int port, dhtio_t *io)
+dht_create (const char *inifile, int port, dhtio_t *io)
 {
   struct dht_object *cache;
   dht_t *du;
@@ -46,8 +51,8 @@ dht_new (const char *inifile, int port, dhtio_t *io)
   char buf[0x2000];
   int ret;
 
-  if (io->read == NULL
-      || io->write == NULL)
+  if (io != NULL && (io->read == NULL
+		     || io->write == NULL))
     {
       ttdht_err ("IO error.\n");
       return NULL;
@@ -60,6 +65,19 @@ dht_new (const char *inifile, int port, dhtio_t *io)
       return NULL;
     }
 
+  /* 
+   * no io given, use the built-in UDP socket
+   * */
+  if (io == NULL)
+    {
+      if (dio_open (&du->io, port) < 0)
+	{
+	  free (du);
+	  return NULL;
+	}
+      io = &du->io;
+    }
+
   cache = NULL;
   du->inifile = strdup (inifile);
   if ((du->inifile != NULL) && (fp = fopen (du->inifile, "rb")) != NULL)
@@ -68,6 +86,7 @@ dht_new (const char *inifile, int port, dhtio_t *io)
       int total;
 
       total = fread (buf, 1, sizeof buf, fp);
+      fclose (fp);
       string_set2 (&str, buf, total);
       cache = buf_to_object (&str);
     }
@@ -81,6 +100,7 @@ dht_new (const char *inifile, int port, dhtio_t *io)
   if (ret < 0)
     {
       dr_cleanup (du->router);
+      dio_close (&du->io);
       free (du);
       return NULL;
     }
@@ -94,11 +114,83 @@ dht_new (const char *inifile, int port, dhtio_t *io)
   dr_add_contact (du->router, "142.161.176.152", 44366);
   dr_add_contact (du->router, "88.193.85.9", 6881);
 
-  dr_run (du->router);
+  return du;
+}
+
+/* 
+ * create and run the router in this thread until dr_stop
+ * */
+dht_t *
+dht_new (const char *inifile, int port, dhtio_t *io)
+{
+  dht_t *du;
+
+  du = dht_create (inifile, port, io);
+  if (du != NULL)
+    dr_run (du->router);
 
   return du;
 }
 
+/* 
+ * the descriptor to watch for input, -1 if the io is not the built-in
+ * one
+ * */
+int
+dht_fd (dht_t * du)
+{
+  return du->io.fdp != NULL ? dio_fd (&du->io) : -1;
+}
+
+/* 
+ * msec until dht_process_once should be called even without input,
+ * -1 for no deadline
+ * */
+int
+dht_next_timeout_ms (dht_t * du)
+{
+  return dr_next_timeout (du->router);
+}
+
+/* 
+ * handle the ready packets, the due timers and the queued actions
+ * without blocking
+ * */
+int
+dht_process_once (dht_t * du)
+{
+  return dr_process_once (du->router, 0);
+}
+
+/* 
+ * cap outgoing traffic at bytes and packets per second, 0 for no cap
+ * */
+void
+dht_set_rate (dht_t * du, unsigned int bytes, unsigned int packets)
+{
+  dr_set_rate (du->router, bytes, packets);
+}
+
+/* 
+ * allow each remote host rate queries of type (DS_QUERY_*) per second,
+ * 0 for no limit
+ * */
+void
+dht_set_query_limit (dht_t * du, int type, unsigned int rate)
+{
+  ds_set_query_limit (du->router->m_server, type, rate);
+}
+
+/* 
+ * give the buckets of the levels levels closest to our id more room,
+ * 0 for the plain bucket size
+ * */
+void
+dht_extend_buckets (dht_t * du, int levels)
+{
+  dr_extend_buckets (du->router, levels);
+}
+
 void
 dht_delete (dht_t * du)
 {
@@ -160,6 +252,7 @@ ret:
   dr_stop (du->router);
 
   dr_cleanup (du->router);
+  dio_close (&du->io);
   free (du);
 }
 
@@ -169,15 +262,15 @@ dht_add_friend (dht_t * dht, const char *ip, unsigned short port)
   dr_add_contact (dht->router, ip, port);
 }
 
-void
+int
 dht_pub_keyword (dht_t * du, const char *key, int serv_port)
 {
-  dr_pub (du->router, key, serv_port);
+  return dr_pub (du->router, key, serv_port);
 }
 
-void
+int
 dht_get_keyword (dht_t * du, const char *key,
 		 void (*cb) (const char *, const char *, void *), void *arg)
 {
-  dr_get (du->router, key, cb, arg);
+  return dr_get (du->router, key, cb, arg);
 }
@@ -35,17 +35,36 @@ typedef struct
   struct dht_router *router;
   char *inifile;
   void *valid_timer;
+
+  /* 
+   * the built-in io, used when dht_new gets no io
+   * */
+  dhtio_t io;
 } dht_t;
 
 dht_t *dht_new (const char *, int, dhtio_t *);
 
+dht_t *dht_create (const char *, int, dhtio_t *);
+
+int dht_fd (dht_t *);
+
+int dht_next_timeout_ms (dht_t *);
+
+int dht_process_once (dht_t *);
+
+void dht_set_rate (dht_t *, unsigned int, unsigned int);
+
+void dht_set_query_limit (dht_t *, int, unsigned int);
+
+void dht_extend_buckets (dht_t *, int);
+
 void dht_delete (dht_t *);
 
 void dht_add_friend (dht_t *, const char *, unsigned short);
 
-void dht_pub_keyword (dht_t *, const char *, int);
+int dht_pub_keyword (dht_t *, const char *, int);
 
-void dht_get_keyword (dht_t *, const char *,
-		      void (*)(const char *, const char *, void *), void *);
+int dht_get_keyword (dht_t *, const char *,
+		     void (*)(const char *, const char *, void *), void *);
 
 #endif
@@ -0,0 +1,234 @@
+/*
+* This file is part of the libttdht package
+* Copyright (C) <2008>  <Alf>
+*
+* Contact: Alf <naihe2010@126.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*
+*/
+/* @CFILE dhtaddr.c
+*/
+
+#include "dhtaddr.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static const unsigned char v4mapped_prefix[12] =
+  { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+
+void
+da_init (struct dht_addr *da, int af)
+{
+  memset (da, 0, sizeof (struct dht_addr));
+  da->sa.sa_family = af;
+}
+
+/* 
+ * convert IPv4-mapped IPv6 addresses, as returned by dual stack
+ * sockets, to plain IPv4 ones
+ * return -1 if the address family is not supported
+ * */
+int
+da_normalize (struct dht_addr *da)
+{
+  struct sockaddr_in sin;
+
+  if (DA_FAMILY (da) == AF_INET)
+    return 0;
+
+  if (DA_FAMILY (da) != AF_INET6)
+    return -1;
+
+  if (memcmp (&da->sin6.sin6_addr, v4mapped_prefix,
+	      sizeof (v4mapped_prefix)) == 0)
+    {
+      memset (&sin, 0, sizeof (sin));
+      sin.sin_family = AF_INET;
+      sin.sin_port = da->sin6.sin6_port;
+      memcpy (&sin.sin_addr, (char *) &da->sin6.sin6_addr + 12, 4);
+      memset (da, 0, sizeof (struct dht_addr));
+      memcpy (&da->sin, &sin, sizeof (sin));
+    }
+
+  return 0;
+}
+
+int
+da_from_string (struct dht_addr *da, const char *host, unsigned short port)
+{
+  if (strchr (host, ':') != NULL)
+    {
+      da_init (da, AF_INET6);
+      if (inet_pton (AF_INET6, host, &da->sin6.sin6_addr) != 1)
+	return -1;
+    }
+  else
+    {
+      da_init (da, AF_INET);
+      if (inet_pton (AF_INET, host, &da->sin.sin_addr) != 1)
+	return -1;
+    }
+
+  da_set_port (da, port);
+
+  return 0;
+}
+
+void
+da_set_port (struct dht_addr *da, unsigned short port)
+{
+  if (DA_IS_V6 (da))
+    da->sin6.sin6_port = htons (port);
+  else
+    da->sin.sin_port = htons (port);
+}
+
+int
+da_same_host (const struct dht_addr *a, const struct dht_addr *b)
+{
+  if (DA_FAMILY (a) != DA_FAMILY (b))
+    return 0;
+
+  if (DA_IS_V6 (a))
+    return memcmp (&a->sin6.sin6_addr, &b->sin6.sin6_addr,
+		   sizeof (struct in6_addr)) == 0;
+
+  return a->sin.sin_addr.s_addr == b->sin.sin_addr.s_addr;
+}
+
+int
+da_equal (const struct dht_addr *a, const struct dht_addr *b)
+{
+  return da_same_host (a, b) && DA_PORT (a) == DA_PORT (b);
+}
+
+/* 
+ * whether a message may be sent to the address
+ * */
+int
+da_valid (const struct dht_addr *da)
+{
+  const unsigned char *p;
+
+  if (DA_PORT (da) == 0)
+    return 0;
+
+  if (DA_FAMILY (da) == AF_INET)
+    {
+      return da->sin.sin_addr.s_addr != 0
+	&& ntohl (da->sin.sin_addr.s_addr) < 0xEFFFFFFF;
+    }
+
+  if (DA_FAMILY (da) == AF_INET6)
+    {
+      p = (const unsigned char *) &da->sin6.sin6_addr;
+      if (p[0] == 0xFF)
+	return 0;
+
+      return memcmp (p, &in6addr_any, sizeof (struct in6_addr)) != 0;
+    }
+
+  return 0;
+}
+
+/* 
+ * raw address bytes, 4 for IPv4 or 16 for IPv6
+ * */
+const char *
+da_host (const struct dht_addr *da, int *len)
+{
+  if (DA_IS_V6 (da))
+    {
+      *len = sizeof (struct in6_addr);
+      return (const char *) &da->sin6.sin6_addr;
+    }
+
+  *len = sizeof (struct in_addr);
+  return (const char *) &da->sin.sin_addr;
+}
+
+/* 
+ * 32 bit key of the host, IPv6 addresses are folded
+ * */
+unsigned long
+da_host_key (const struct dht_addr *da)
+{
+  const unsigned int *w;
+
+  if (!DA_IS_V6 (da))
+    return da->sin.sin_addr.s_addr;
+
+  w = (const unsigned int *) &da->sin6.sin6_addr;
+  return w[0] ^ w[1] ^ w[2] ^ w[3];
+}
+
+char *
+da_store_compact (const struct dht_addr *da, char *buffer)
+{
+  const char *host;
+  int len;
+
+  host = da_host (da, &len);
+  memcpy (buffer, host, len);
+  if (DA_IS_V6 (da))
+    memcpy (buffer + len, &da->sin6.sin6_port, 2);
+  else
+    memcpy (buffer + len, &da->sin.sin_port, 2);
+
+  return buffer + len + 2;
+}
+
+int
+da_load_compact (struct dht_addr *da, int af, const char *buffer)
+{
+  da_init (da, af);
+
+  if (af == AF_INET6)
+    {
+      memcpy (&da->sin6.sin6_addr, buffer, 16);
+      memcpy (&da->sin6.sin6_port, buffer + 16, 2);
+      return da_normalize (da);
+    }
+
+  if (af == AF_INET)
+    {
+      memcpy (&da->sin.sin_addr, buffer, 4);
+      memcpy (&da->sin.sin_port, buffer + 4, 2);
+      return 0;
+    }
+
+  return -1;
+}
+
+const char *
+da_ntop (const struct dht_addr *da, char *buf, int size)
+{
+  char host[INET6_ADDRSTRLEN];
+
+  if (DA_IS_V6 (da))
+    {
+      inet_ntop (AF_INET6, &da->sin6.sin6_addr, host, sizeof host);
+      snprintf (buf, size, "[%s]:%d", host, ntohs (da->sin6.sin6_port));
+    }
+  else
+    {
+      inet_ntop (AF_INET, &da->sin.sin_addr, host, sizeof host);
+      snprintf (buf, size, "%s:%d", host, ntohs (da->sin.sin_port));
+    }
+
+  return buf;
+}
@@ -0,0 +1,90 @@
+/*
+* This file is part of the libttdht package
+* Copyright (C) <2008>  <Alf>
+*
+* Contact: Alf <naihe2010@126.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*
+*/
+/* @CFILE dhtaddr.h
+*/
+
+#ifndef _DHT_ADDR_H_
+#define _DHT_ADDR_H_
+
+#include "dhtlib.h"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#endif
+
+#define DA_COMPACT_LEN4         6
+#define DA_COMPACT_LEN6         18
+#define DA_COMPACT_LEN(af)      ((af) == AF_INET6 ? DA_COMPACT_LEN6 : DA_COMPACT_LEN4)
+#define DA_NODE_LEN(af)         (HASH_STRING_LEN + DA_COMPACT_LEN (af))
+#define DA_STRLEN               (INET6_ADDRSTRLEN + 8)
+
+#define DA_FAMILY(da)           ((da)->sa.sa_family)
+#define DA_IS_V6(da)            (DA_FAMILY (da) == AF_INET6)
+#define DA_LEN(da)              (DA_IS_V6 (da) ? sizeof ((da)->sin6) : sizeof ((da)->sin))
+#define DA_PORT(da)             (DA_IS_V6 (da) ? (da)->sin6.sin6_port : (da)->sin.sin_port)
+
+/* 
+ * an IPv4 or IPv6 socket address,
+ * port and address are kept in network byte order
+ * */
+struct dht_addr
+{
+  union
+  {
+    struct sockaddr sa;
+    struct sockaddr_in sin;
+    struct sockaddr_in6 sin6;
+  };
+};
+
+void da_init (struct dht_addr *, int);
+
+int da_normalize (struct dht_addr *);
+
+int da_from_string (struct dht_addr *, const char *, unsigned short);
+
+void da_set_port (struct dht_addr *, unsigned short);
+
+int da_same_host (const struct dht_addr *, const struct dht_addr *);
+
+int da_equal (const struct dht_addr *, const struct dht_addr *);
+
+int da_valid (const struct dht_addr *);
+
+const char *da_host (const struct dht_addr *, int *);
+
+unsigned long da_host_key (const struct dht_addr *);
+
+char *da_store_compact (const struct dht_addr *, char *);
+
+int da_load_compact (struct dht_addr *, int, const char *);
+
+const char *da_ntop (const struct dht_addr *, char *, int);
+
+#endif
@@ -35,25 +35,34 @@
 #include <time.h>
 
 struct dht_bucket *
-db_init (const char *begin, const char *end)
+db_init (const char *prefix, int depth, time_t now)
 {
   struct dht_bucket *db;
+  int i;
 
   db = (struct dht_bucket *) calloc (1, sizeof (struct dht_bucket));
   assert (db);
 
   db->m_parent = NULL;
-  db->m_child = NULL;
+  db->m_child[0] = NULL;
+  db->m_child[1] = NULL;
 
   LIST_INIT (db->m_nodes);
 
-  db->m_lastchanged = time (NULL);
+  db->m_lastchanged = now;
 
   db->m_good = 0;
   db->m_bad = 0;
+  db->m_size = 0;
+  db->m_capacity = DB_NUM_NODES;
 
-  hashsg_cpy (db->m_begin, begin);
-  hashsg_cpy (db->m_end, end);
+  db->m_depth = depth;
+  hashsg_clear (db->m_prefix, 0);
+  for (i = 0; i < depth; i++)
+    {
+      if (HASHSG_BIT (prefix, i))
+	db->m_prefix[i >> 3] |= 0x80 >> (i & 7);
+    }
 
   return db;
 }
@@ -63,21 +72,43 @@ db_cleanup (struct dht_bucket *db)
 {
   struct dht_node *dn;
 
+  if (!DB_IS_LEAF (db))
+    {
+      db_cleanup (db->m_child[0]);
+      db_cleanup (db->m_child[1]);
+    }
+
   while ((dn = LIST_FIRST (db->m_nodes)) != NULL)
     {
       LIST_REMOVE (dn, entries);
+      dn->m_bucket = NULL;
       /* dn_cleanup (dn); */
     }
 
   free (db);
 }
 
+/* 
+ * descend to the leaf covering id, at most DB_MAX_DEPTH steps
+ * */
+struct dht_bucket *
+db_find (struct dht_bucket *db, const char *id)
+{
+  while (!DB_IS_LEAF (db))
+    {
+      db = db->m_child[HASHSG_BIT (id, db->m_depth)];
+    }
+
+  return db;
+}
+
 void
-db_add_node (struct dht_bucket *db, struct dht_node *n)
+db_add_node (struct dht_bucket *db, struct dht_node *n, time_t now)
 {
   LIST_INSERT_HEAD (db->m_nodes, n, entries);
+  db->m_size++;
 
-  DB_TOUCH (db);
+  DB_TOUCH (db, now);
 
   if (DN_IS_GOOD (n))
     {
@@ -93,6 +124,7 @@ void
 db_remove_node (struct dht_bucket *db, struct dht_node *n)
 {
   LIST_REMOVE (n, entries);
+  db->m_size--;
 
   if (DN_IS_GOOD (n))
     {
@@ -144,104 +176,100 @@ db_find_replacement (struct dht_bucket *db, int onlyoldest)
   return oldest;
 }
 
+/* 
+ * keep the prefix bits and fill the rest uniformly at random
+ * */
 void
-db_get_mid_point (struct dht_bucket *db, char *middle_id)
+db_get_random_id (struct dht_bucket *db, char *rand_id)
 {
-  unsigned int i;
-
-  hashsg_cpy (middle_id, db->m_end);
+  unsigned int i, full;
+  unsigned char mask;
 
   for (i = 0; i < HASH_STRING_LEN; i++)
-    {
-      if (db->m_begin[i] != db->m_end[i])
-	{
-	  middle_id[i] =
-	    ((unsigned char) db->m_begin[i] +
-	     (unsigned char) db->m_end[i]) / 2;
-	  break;
-	}
-    }
-}
-
-void
-db_get_random_id (struct dht_bucket *db, char *rand_id)
-{
-  unsigned int i;
+    rand_id[i] = rand () & 0xFF;
+  rand_id[HASH_STRING_LEN] = '\0';
 
-  hashsg_cpy (rand_id, db->m_end);
+  full = db->m_depth >> 3;
+  memcpy (rand_id, db->m_prefix, full);
 
-  for (i = 0; i < HASH_STRING_LEN; i++)
-    rand_id[i] =
-      db->m_begin[i] + (rand () & (db->m_end[i] - db->m_begin[i]));
+  if (db->m_depth & 7)
+    {
+      mask = 0xFF << (8 - (db->m_depth & 7));
+      rand_id[full] = (db->m_prefix[full] & mask) | (rand_id[full] & ~mask);
+    }
 }
 
+/* 
+ * turn a leaf into an inner node with two leaves one bit deeper,
+ * returns the leaf covering hashsg
+ * */
 struct dht_bucket *
 db_split (struct dht_bucket *db, const char *hashsg)
 {
   struct dht_node *n;
-  struct dht_bucket *new;
-  char mid_range[HASH_STRING_LEN + 1];
-  unsigned int i, sum;
-  int carry;
+  struct dht_bucket *child;
+  int bit;
 
-  db_get_mid_point (db, mid_range);
+  assert (DB_IS_LEAF (db) && DB_CAN_SPLIT (db));
 
-  new = db_init (db->m_begin, mid_range);
+  for (bit = 0; bit < 2; bit++)
+    {
+      child = db_init (db->m_prefix, db->m_depth + 1, db->m_lastchanged);
+      if (bit)
+	child->m_prefix[db->m_depth >> 3] |= 0x80 >> (db->m_depth & 7);
+      child->m_parent = db;
+      db->m_child[bit] = child;
+    }
 
-  carry = 1;
-  for (i = HASH_STRING_LEN; i > 0; i--)
+  while ((n = LIST_FIRST (db->m_nodes)) != NULL)
     {
-      sum = (unsigned char) mid_range[i - 1] + carry;
-      db->m_begin[i - 1] = (unsigned char) sum;
-      carry = sum >> 8;
+      LIST_REMOVE (n, entries);
+
+      child = db->m_child[HASHSG_BIT (n->hashsg, db->m_depth)];
+      LIST_INSERT_HEAD (child->m_nodes, n, entries);
+      child->m_size++;
+      n->m_bucket = child;
     }
 
-  LIST_FOREACH (n, db->m_nodes, entries)
-  {
-    if (DB_IS_INRANGE (new, n->hashsg))
-      {
-	LIST_REMOVE (n, entries);
+  db->m_size = 0;
+  db->m_good = 0;
+  db->m_bad = 0;
 
-	LIST_INSERT_HEAD (new->m_nodes, n, entries);
-	n->m_bucket = new;
-      }
-  }
+  db_count (db->m_child[0]);
+  db_count (db->m_child[1]);
 
-  new->m_lastchanged = db->m_lastchanged;
+  return db->m_child[HASHSG_BIT (hashsg, db->m_depth)];
+}
 
-  db_count (new);
-  db_count (db);
+/* 
+ * db is the leaf of our own id, give the sibling leaves of the
+ * levels closest to it DB_EXTEND_FACTOR times the room
+ * */
+void
+db_extend (struct dht_bucket *db, int levels)
+{
+  struct dht_bucket *parent, *sibling;
+  int i;
 
-  if (DB_IS_INRANGE (new, hashsg))
-    {
-      db->m_child = new;
-      new->m_parent = db;
-    }
-  else
+  for (i = 1; (parent = db->m_parent) != NULL; i++, db = parent)
     {
-      if (db->m_parent != NULL)
-	{
-	  db->m_parent->m_child = new;
-	  new->m_parent = db->m_parent;
-	}
-
-      db->m_parent = new;
-      new->m_child = db;
+      sibling = parent->m_child[parent->m_child[0] == db];
+      if (DB_IS_LEAF (sibling))
+	sibling->m_capacity =
+	  i <= levels ? DB_NUM_NODES * DB_EXTEND_FACTOR : DB_NUM_NODES;
     }
-
-  return new;
 }
 
 struct db_chain *
-dbc_init (struct dht_bucket *db)
+dbc_init (struct dht_bucket *db, const char *target)
 {
   struct db_chain *dc;
 
   dc = (struct db_chain *) calloc (1, sizeof (struct db_chain));
   assert (dc);
 
-  dc->m_restart = db;
-  dc->m_cur = db;
+  hashsg_cpy (dc->m_target, target);
+  dc->m_cur = db_find (db, target);
 
   return dc;
 }
@@ -252,23 +280,30 @@ dbc_bucket (struct db_chain *dc)
   return dc->m_cur;
 }
 
+/* 
+ * climb until we leave the child on the target's side, then descend
+ * into its sibling preferring the target's bits
+ * */
 struct dht_bucket *
 dbc_next (struct db_chain *dc)
 {
-  if (dc->m_restart == NULL)
-    {
-      dc->m_cur = dc->m_cur->m_parent;
-    }
-  else
+  struct dht_bucket *db, *parent;
+  int bit;
+
+  for (db = dc->m_cur; db != NULL; db = parent)
     {
-      dc->m_cur = dc->m_cur->m_child;
+      parent = db->m_parent;
+      if (parent == NULL)
+	break;
 
-      if (dc->m_cur == NULL)
+      bit = HASHSG_BIT (dc->m_target, parent->m_depth);
+      if (parent->m_child[bit] == db)
 	{
-	  dc->m_cur = dc->m_restart->m_parent;
-	  dc->m_restart = NULL;
+	  dc->m_cur = db_find (parent->m_child[!bit], dc->m_target);
+	  return dc->m_cur;
 	}
     }
 
-  return dc->m_cur;
+  dc->m_cur = NULL;
+  return NULL;
 }
@@ -34,13 +34,21 @@
 #include <time.h>
 
 #define DB_NUM_NODES        8
+#define DB_MAX_DEPTH        (HASH_STRING_LEN * 8)
 
-#define DB_IS_INRANGE(db, id)   ((hashsg_cmp ((id), (db)->m_begin)) >= 0 && (hashsg_cmp ((id), (db)->m_end)) <= 0)
-#define DB_IS_FULL(db)          ((db)->m_size >= DB_NUM_NODES)
+/* 
+ * extended buckets close to our own id hold this many times DB_NUM_NODES
+ * */
+#define DB_EXTEND_FACTOR    4
+
+#define DB_IS_LEAF(db)          ((db)->m_child[0] == NULL)
+#define DB_IS_INRANGE(db, id)   (hashsg_prefix_len ((id), (db)->m_prefix) >= (db)->m_depth)
+#define DB_IS_FULL(db)          ((db)->m_size >= (db)->m_capacity)
 #define DB_IS_EMPTY(db)         ((db)->m_size <= 0)
 #define DB_HAS_SPACE(db)        (!DB_IS_FULL(db) || (db)->m_bad > 0)
-#define DB_AGE(db)              (time (NULL) - (db)->m_lastchanged)
-#define DB_TOUCH(db)            (db)->m_lastchanged = time (NULL)
+#define DB_CAN_SPLIT(db)        ((db)->m_depth < DB_MAX_DEPTH)
+#define DB_AGE(db, now)         ((now) - (db)->m_lastchanged)
+#define DB_TOUCH(db, now)       (db)->m_lastchanged = (now)
 #define DB_UPDATE(db)           db_count (db)
 
 #define DB_NODE_NOW_GOOD(db, was_bad) do {              \
@@ -53,49 +61,58 @@
   (db)->m_bad ++;                                       \
 } while (0)
 
+/* 
+ * a node of the binary prefix trie, only leaves hold nodes,
+ * the first m_depth bits of m_prefix are the prefix, the rest is zero
+ * */
 struct dht_bucket
 {
   struct dht_bucket *m_parent;
-  struct dht_bucket *m_child;
+  struct dht_bucket *m_child[2];
 
   time_t m_lastchanged;
 
   int m_good;
   int m_bad;
 
-  char m_begin[HASH_STRING_LEN + 1];
-  char m_end[HASH_STRING_LEN + 1];
+  char m_prefix[HASH_STRING_LEN + 1];
+  int m_depth;
 
   int m_size;
+  int m_capacity;
     LIST_HEAD (node_list, dht_node) m_nodes[1];
-
-    LIST_ENTRY (dht_bucket) entries;
 };
 
-struct dht_bucket *db_init (const char *, const char *);
+struct dht_bucket *db_init (const char *, int, time_t);
 
 void db_cleanup (struct dht_bucket *db);
 
-void db_add_node (struct dht_bucket *, struct dht_node *);
+struct dht_bucket *db_find (struct dht_bucket *, const char *);
+
+void db_add_node (struct dht_bucket *, struct dht_node *, time_t);
 
 void db_count (struct dht_bucket *);
 
 void db_remove_node (struct dht_bucket *, struct dht_node *);
 
-void db_get_mid_point (struct dht_bucket *, char *);
 void db_get_random_id (struct dht_bucket *, char *);
 
 struct dht_bucket *db_split (struct dht_bucket *, const char *);
 
+void db_extend (struct dht_bucket *, int);
+
 struct dht_node *db_find_replacement (struct dht_bucket *, int);
 
+/* 
+ * walks the leaves in order of increasing xor distance to a target
+ * */
 struct db_chain
 {
-  struct dht_bucket *m_restart;
+  char m_target[HASH_STRING_LEN + 1];
   struct dht_bucket *m_cur;
 };
 
-struct db_chain *dbc_init (struct dht_bucket *);
+struct db_chain *dbc_init (struct dht_bucket *, const char *);
 
 struct dht_bucket *dbc_bucket (struct db_chain *);
 
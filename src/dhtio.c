@@ -0,0 +1,484 @@
+/*
+* This file is part of the libttdht package
+* Copyright (C) <2008>  <Alf>
+*
+* Contact: Alf <naihe2010@126.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*
+*/
+/* @CFILE dhtio.c
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if (defined (HAVE_RECVMMSG) || defined (HAVE_SENDMMSG)) \
+  && !defined (_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "dhtio.h"
+#include "dhturing.h"
+#include "dhtlog.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <stdint.h>
+#include <sys/eventfd.h>
+#endif
+
+#ifdef WIN32
+#define close(fd)       closesocket (fd)
+#endif
+
+static void
+dio_nonblock (int fd)
+{
+#ifdef WIN32
+  u_long on = 1;
+  ioctlsocket (fd, FIONBIO, &on);
+#else
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+#endif
+}
+
+static void
+dio_drain (struct dht_io *dio)
+{
+#ifndef WIN32
+  char buf[64];
+
+  while (read (dio->wakefd[0], buf, sizeof buf) > 0)
+    ;
+#endif
+}
+
+/* 
+ * return 1 if the socket became readable within msec
+ * */
+static int
+dio_wait (struct dht_io *dio, int msec)
+{
+#if defined (HAVE_SYS_EPOLL_H)
+  struct epoll_event ev[2];
+  int i, n, readable;
+
+  n = epoll_wait (dio->epfd, ev, 2, msec);
+
+  readable = 0;
+  for (i = 0; i < n; i++)
+    {
+      if (ev[i].data.fd == dio->fd)
+	readable = 1;
+      else
+	dio_drain (dio);
+    }
+
+  return readable;
+#elif !defined (WIN32)
+  struct pollfd pfd[2];
+  int n;
+
+  pfd[0].fd = dio->fd;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = dio->wakefd[0];
+  pfd[1].events = POLLIN;
+
+  n = poll (pfd, dio->wakefd[0] >= 0 ? 2 : 1, msec);
+  if (n > 0 && (pfd[1].revents & POLLIN))
+    dio_drain (dio);
+
+  return n > 0 && (pfd[0].revents & POLLIN);
+#else
+  fd_set set[1];
+  struct timeval tv[1];
+
+  FD_ZERO (set);
+  FD_SET (dio->fd, set);
+  tv->tv_sec = msec / 1000;
+  tv->tv_usec = (msec % 1000) * 1000;
+
+  return select (dio->fd + 1, set, NULL, NULL, msec < 0 ? NULL : tv) > 0;
+#endif
+}
+
+static ssize_t
+dio_read (void *p, char *buf, size_t size, struct sockaddr *sa,
+	  socklen_t *salen, int msec)
+{
+  struct dht_io *dio;
+  socklen_t len;
+  ssize_t ret;
+
+  dio = (struct dht_io *) p;
+  len = *salen;
+
+  /* 
+   * the socket does not block, only wait when nothing is queued; a
+   * zero wait still drains pending wakeups so the epoll descriptor
+   * handed out by dio_fd does not stay readable
+   * */
+  ret = recvfrom (dio->fd, buf, size, 0, sa, salen);
+  if (ret >= 0 || !dio_wait (dio, msec))
+    return ret;
+
+  *salen = len;
+  return recvfrom (dio->fd, buf, size, 0, sa, salen);
+}
+
+#ifdef HAVE_RECVMMSG
+/* 
+ * receive what is queued on the socket with a single recvmmsg, the
+ * packets are filled in place
+ * */
+static int
+dio_recv_batch (struct dht_io *dio, struct dht_packet *pkts, int num)
+{
+  struct mmsghdr msgs[DR_NUM_READS];
+  struct iovec iov[DR_NUM_READS];
+  int i, n;
+
+  if (num > DR_NUM_READS)
+    num = DR_NUM_READS;
+
+  memset (msgs, 0, num * sizeof (struct mmsghdr));
+  for (i = 0; i < num; i++)
+    {
+      iov[i].iov_base = pkts[i].buf;
+      iov[i].iov_len = pkts[i].size;
+      msgs[i].msg_hdr.msg_name = &pkts[i].addr;
+      msgs[i].msg_hdr.msg_namelen = sizeof (struct dht_addr);
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+  n = recvmmsg (dio->fd, msgs, num, MSG_DONTWAIT, NULL);
+  for (i = 0; i < n; i++)
+    {
+      pkts[i].len = msgs[i].msg_len;
+      pkts[i].addrlen = msgs[i].msg_hdr.msg_namelen;
+    }
+
+  return n;
+}
+
+static int
+dio_read_batch (void *p, struct dht_packet *pkts, int num, int msec)
+{
+  struct dht_io *dio;
+  int n;
+
+  dio = (struct dht_io *) p;
+
+  /* 
+   * same wait rules as dio_read
+   * */
+  n = dio_recv_batch (dio, pkts, num);
+  if (n > 0 || !dio_wait (dio, msec))
+    return n;
+
+  return dio_recv_batch (dio, pkts, num);
+}
+#endif
+
+/* 
+ * IPv4 destinations go out as IPv4-mapped addresses on a dual stack
+ * socket, mapped is used when sa needs it
+ * return NULL if the socket can not reach sa
+ * */
+const struct sockaddr *
+dio_map (struct dht_io *dio, const struct sockaddr *sa, socklen_t *salen,
+	 struct sockaddr_in6 *mapped)
+{
+  if (sa->sa_family == AF_INET6 && dio->af != AF_INET6)
+    return NULL;
+
+  if (sa->sa_family == AF_INET && dio->af == AF_INET6)
+    {
+      memset (mapped, 0, sizeof (struct sockaddr_in6));
+      mapped->sin6_family = AF_INET6;
+      mapped->sin6_port = ((const struct sockaddr_in *) sa)->sin_port;
+      mapped->sin6_addr.s6_addr[10] = 0xFF;
+      mapped->sin6_addr.s6_addr[11] = 0xFF;
+      memcpy (&mapped->sin6_addr.s6_addr[12],
+	      &((const struct sockaddr_in *) sa)->sin_addr, 4);
+      *salen = sizeof (struct sockaddr_in6);
+      return (const struct sockaddr *) mapped;
+    }
+
+  return sa;
+}
+
+static ssize_t
+dio_write (void *p, const char *buf, size_t size,
+	   const struct sockaddr *sa, socklen_t salen)
+{
+  struct dht_io *dio;
+  struct sockaddr_in6 mapped[1];
+
+  dio = (struct dht_io *) p;
+
+  sa = dio_map (dio, sa, &salen, mapped);
+  if (sa == NULL)
+    {
+      errno = EAFNOSUPPORT;
+      return -1;
+    }
+
+  return sendto (dio->fd, buf, size, 0, sa, salen);
+}
+
+#ifdef HAVE_SENDMMSG
+static int
+dio_write_batch (void *p, struct dht_packet *pkts, int num)
+{
+  struct dht_io *dio;
+  struct mmsghdr msgs[DR_NUM_SENDS];
+  struct iovec iov[DR_NUM_SENDS];
+  struct sockaddr_in6 mapped[DR_NUM_SENDS];
+  const struct sockaddr *sa;
+  socklen_t salen;
+  int i;
+
+  dio = (struct dht_io *) p;
+
+  if (num > DR_NUM_SENDS)
+    num = DR_NUM_SENDS;
+
+  /* 
+   * a destination the socket can not reach ends the batch, it fails on
+   * its own at the head of the next one
+   * */
+  memset (msgs, 0, num * sizeof (struct mmsghdr));
+  for (i = 0; i < num; i++)
+    {
+      salen = pkts[i].addrlen;
+      sa = dio_map (dio, &pkts[i].addr.sa, &salen, &mapped[i]);
+      if (sa == NULL)
+	break;
+
+      iov[i].iov_base = pkts[i].buf;
+      iov[i].iov_len = pkts[i].len;
+      msgs[i].msg_hdr.msg_name = (void *) sa;
+      msgs[i].msg_hdr.msg_namelen = salen;
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+  if (i == 0)
+    {
+      errno = EAFNOSUPPORT;
+      return -1;
+    }
+
+  return sendmmsg (dio->fd, msgs, i, 0);
+}
+#endif
+
+static void
+dio_wakeup (void *p)
+{
+#ifndef WIN32
+  struct dht_io *dio;
+  ssize_t ret;
+#ifdef HAVE_SYS_EVENTFD_H
+  uint64_t one = 1;
+#else
+  char one = 0;
+#endif
+
+  dio = (struct dht_io *) p;
+
+  ret = write (dio->wakefd[1], &one, sizeof one);
+  (void) ret;
+#endif
+}
+
+static int
+dio_bind (struct dht_io *dio, int port)
+{
+  struct dht_addr addr;
+  int off = 0;
+
+  dio->af = AF_INET6;
+  dio->fd = socket (AF_INET6, SOCK_DGRAM, 0);
+  if (dio->fd >= 0)
+    {
+      setsockopt (dio->fd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &off,
+		  sizeof off);
+    }
+  else
+    {
+      dio->af = AF_INET;
+      dio->fd = socket (AF_INET, SOCK_DGRAM, 0);
+      if (dio->fd < 0)
+	return -1;
+    }
+
+  da_init (&addr, dio->af);
+  da_set_port (&addr, port);
+
+  if (bind (dio->fd, &addr.sa, DA_LEN (&addr)) < 0)
+    {
+      close (dio->fd);
+      return -1;
+    }
+
+  dio_nonblock (dio->fd);
+  return 0;
+}
+
+/* 
+ * fill io with a UDP socket bound to port on all addresses
+ * */
+int
+dio_open (dhtio_t *io, int port)
+{
+  struct dht_io *dio;
+
+  dio = (struct dht_io *) calloc (1, sizeof (struct dht_io));
+  assert (dio);
+
+  dio->epfd = -1;
+  dio->wakefd[0] = dio->wakefd[1] = -1;
+
+  if (dio_bind (dio, port) < 0)
+    {
+      ttdht_err ("Bind udp port %d error.\n", port);
+      free (dio);
+      return -1;
+    }
+
+#if defined (HAVE_SYS_EVENTFD_H)
+  dio->wakefd[0] = dio->wakefd[1] = eventfd (0, 0);
+  if (dio->wakefd[0] >= 0)
+    dio_nonblock (dio->wakefd[0]);
+#elif !defined (WIN32)
+  if (pipe (dio->wakefd) == 0)
+    {
+      dio_nonblock (dio->wakefd[0]);
+      dio_nonblock (dio->wakefd[1]);
+    }
+  else
+    dio->wakefd[0] = dio->wakefd[1] = -1;
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+  {
+    struct epoll_event ev;
+
+    dio->epfd = epoll_create (2);
+    assert (dio->epfd >= 0);
+
+    memset (&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.fd = dio->fd;
+    epoll_ctl (dio->epfd, EPOLL_CTL_ADD, dio->fd, &ev);
+
+    if (dio->wakefd[0] >= 0)
+      {
+	ev.data.fd = dio->wakefd[0];
+	epoll_ctl (dio->epfd, EPOLL_CTL_ADD, dio->wakefd[0], &ev);
+      }
+  }
+#endif
+
+  io->fdp = dio;
+  io->read = dio_read;
+  io->write = dio_write;
+  io->wakeup = dio->wakefd[1] >= 0 ? dio_wakeup : NULL;
+#ifdef HAVE_RECVMMSG
+  io->read_batch = dio_read_batch;
+#else
+  io->read_batch = NULL;
+#endif
+#ifdef HAVE_SENDMMSG
+  io->write_batch = dio_write_batch;
+#else
+  io->write_batch = NULL;
+#endif
+  io->gettime = NULL;
+
+  /* 
+   * io_uring replaces the callbacks above when the kernel has it
+   * */
+#ifdef HAVE_LIBURING
+  if (dur_open (io, dio) < 0)
+    ttdht_debug ("io_uring is not available, use the socket calls.\n");
+#endif
+
+  return 0;
+}
+
+void
+dio_close (dhtio_t *io)
+{
+  struct dht_io *dio;
+
+  dio = (struct dht_io *) io->fdp;
+  if (dio == NULL)
+    return;
+
+#ifdef HAVE_LIBURING
+  if (dio->uring != NULL)
+    dur_close (dio->uring);
+#endif
+
+  close (dio->fd);
+#ifndef WIN32
+  if (dio->epfd >= 0)
+    close (dio->epfd);
+  if (dio->wakefd[0] >= 0)
+    close (dio->wakefd[0]);
+  if (dio->wakefd[1] >= 0 && dio->wakefd[1] != dio->wakefd[0])
+    close (dio->wakefd[1]);
+#endif
+
+  free (dio);
+  io->fdp = NULL;
+}
+
+/* 
+ * one descriptor that turns readable on input or on a wakeup, the
+ * io_uring or epoll descriptor where there is one
+ * */
+int
+dio_fd (dhtio_t *io)
+{
+  struct dht_io *dio;
+
+  dio = (struct dht_io *) io->fdp;
+
+#ifdef HAVE_LIBURING
+  if (dio->uring != NULL)
+    return dur_fd (dio->uring);
+#endif
+
+  return dio->epfd >= 0 ? dio->epfd : dio->fd;
+}
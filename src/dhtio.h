@@ -0,0 +1,56 @@
+/*
+* This file is part of the libttdht package
+* Copyright (C) <2008>  <Alf>
+*
+* Contact: Alf <naihe2010@126.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*
+*/
+/* @CFILE dhtio.h
+*/
+
+#ifndef _DHT_IO_H_
+#define _DHT_IO_H_
+
+#include "dhtrouter.h"
+
+/* 
+ * built-in UDP io, one dual stack socket (IPv4 only if the system has
+ * no IPv6) waited on with epoll where available, dr_wakeup interrupts
+ * the wait through an eventfd or a self-pipe; with liburing the socket
+ * is driven through io_uring instead
+ * */
+struct dht_io
+{
+  int fd;
+  int af;
+
+  int epfd;
+  int wakefd[2];
+
+  struct dht_uring *uring;
+};
+
+int dio_open (dhtio_t *, int);
+
+void dio_close (dhtio_t *);
+
+int dio_fd (dhtio_t *);
+
+const struct sockaddr *dio_map (struct dht_io *, const struct sockaddr *,
+				socklen_t *, struct sockaddr_in6 *);
+
+#endif
@@ -87,6 +87,31 @@ hashsg_closer (const char *target, const char *s1, const char *s2)
   return 0;
 }
 
+int
+hashsg_prefix_len (const char *s1, const char *s2)
+{
+  unsigned int i;
+  unsigned char x;
+  int bits;
+
+  for (i = 0; i < HASH_STRING_LEN; i++)
+    {
+      x = (unsigned char) (s1[i] ^ s2[i]);
+      if (x != 0)
+	{
+	  bits = i * 8;
+	  while (!(x & 0x80))
+	    {
+	      x <<= 1;
+	      bits++;
+	    }
+	  return bits;
+	}
+    }
+
+  return HASH_STRING_LEN * 8;
+}
+
 struct string *
 string_init (char *data, int len)
 {
@@ -352,6 +377,417 @@ map_begin (struct map *map)
   return LIST_FIRST (map);
 }
 
+struct ring *
+ring_init (unsigned int size)
+{
+  struct ring *ring;
+  unsigned long i;
+
+  assert (size > 0 && (size & (size - 1)) == 0);
+
+  ring = (struct ring *) calloc (1, sizeof (struct ring));
+  assert (ring);
+
+  ring->cells = (struct ring_cell *) calloc (size, sizeof (struct ring_cell));
+  assert (ring->cells);
+
+  ring->mask = size - 1;
+  for (i = 0; i < size; i++)
+    ring->cells[i].seq = i;
+
+  return ring;
+}
+
+void
+ring_cleanup (struct ring *ring)
+{
+  free (ring->cells);
+  free (ring);
+}
+
+/* 
+ * a cell is free for position pos when its seq equals pos, producers
+ * claim it by advancing head and publish it by setting seq to pos + 1,
+ * return -1 when the ring is full
+ * */
+int
+ring_push (struct ring *ring, void *item)
+{
+  struct ring_cell *cell;
+  unsigned long pos;
+  long dif;
+
+  pos = DHT_ATOMIC_GET (&ring->head);
+  for (;;)
+    {
+      cell = &ring->cells[pos & ring->mask];
+      dif = (long) (DHT_ATOMIC_GET (&cell->seq) - pos);
+
+      if (dif == 0)
+	{
+	  if (DHT_ATOMIC_CAS (&ring->head, pos, pos + 1))
+	    break;
+	}
+      else if (dif < 0)
+	{
+	  return -1;
+	}
+
+      pos = DHT_ATOMIC_GET (&ring->head);
+    }
+
+  cell->item = item;
+  DHT_ATOMIC_SET (&cell->seq, pos + 1);
+
+  return 0;
+}
+
+/* 
+ * consumer side, returns NULL when empty
+ * */
+void *
+ring_pop (struct ring *ring)
+{
+  struct ring_cell *cell;
+  void *item;
+
+  cell = &ring->cells[ring->tail & ring->mask];
+  if ((long) (DHT_ATOMIC_GET (&cell->seq) - (ring->tail + 1)) < 0)
+    return NULL;
+
+  item = cell->item;
+  DHT_ATOMIC_SET (&cell->seq, ring->tail + ring->mask + 1);
+  ring->tail++;
+
+  return item;
+}
+
+int
+ring_empty (struct ring *ring)
+{
+  return (long) (DHT_ATOMIC_GET (&ring->cells[ring->tail & ring->mask].seq)
+		 - (ring->tail + 1)) < 0;
+}
+
+/* 
+ * 32 bit FNV-1a of size bytes started from seed, with a final mix so
+ * the low and the high bits can both index a table
+ * */
+unsigned int
+hash_bytes (const void *data, int size, unsigned int seed)
+{
+  const unsigned char *p;
+  unsigned int h;
+
+  p = (const unsigned char *) data;
+  h = 2166136261U ^ seed;
+  while (size-- > 0)
+    {
+      h ^= *p++;
+      h *= 16777619U;
+    }
+
+  h ^= h >> 16;
+  h *= 0x85EBCA6BU;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35U;
+  h ^= h >> 16;
+
+  return h;
+}
+
+void
+ht_init (struct htable *ht, unsigned int size)
+{
+  assert (size > 0 && (size & (size - 1)) == 0);
+
+  ht->slots = (struct hslot *) calloc (size, sizeof (struct hslot));
+  assert (ht->slots);
+
+  ht->mask = size - 1;
+  ht->count = 0;
+}
+
+void
+ht_cleanup (struct htable *ht)
+{
+  free (ht->slots);
+  ht->slots = NULL;
+  ht->count = 0;
+}
+
+/* 
+ * the item hashed to hash that eq says matches key, or NULL
+ * */
+void *
+ht_find (struct htable *ht, unsigned int hash,
+	 int (*eq) (const void *, const void *), const void *key)
+{
+  struct hslot *slot;
+  unsigned int i;
+
+  for (i = hash & ht->mask;; i = (i + 1) & ht->mask)
+    {
+      slot = &ht->slots[i];
+      if (slot->item == NULL)
+	return NULL;
+      if (slot->hash == hash && eq (slot->item, key))
+	return slot->item;
+    }
+}
+
+static void
+ht_grow (struct htable *ht)
+{
+  struct hslot *old;
+  unsigned int i, j, size;
+
+  old = ht->slots;
+  size = ht->mask + 1;
+
+  ht->slots = (struct hslot *) calloc (size * 2, sizeof (struct hslot));
+  assert (ht->slots);
+  ht->mask = size * 2 - 1;
+
+  for (i = 0; i < size; i++)
+    {
+      if (old[i].item == NULL)
+	continue;
+      for (j = old[i].hash & ht->mask; ht->slots[j].item != NULL;
+	   j = (j + 1) & ht->mask)
+	;
+      ht->slots[j] = old[i];
+    }
+
+  free (old);
+}
+
+/* 
+ * add item under hash, the caller makes sure its key is not there yet
+ * */
+void
+ht_insert (struct htable *ht, unsigned int hash, void *item)
+{
+  unsigned int i;
+
+  if ((ht->count + 1) * 2 > ht->mask + 1)
+    ht_grow (ht);
+
+  for (i = hash & ht->mask; ht->slots[i].item != NULL;
+       i = (i + 1) & ht->mask)
+    ;
+
+  ht->slots[i].hash = hash;
+  ht->slots[i].item = item;
+  ht->count++;
+}
+
+/* 
+ * take item out, moving the items probed past it back so lookups never
+ * need a tombstone; returns -1 when it is not in the table
+ * */
+int
+ht_remove (struct htable *ht, unsigned int hash, const void *item)
+{
+  unsigned int i, j, home;
+
+  for (i = hash & ht->mask; ht->slots[i].item != item;
+       i = (i + 1) & ht->mask)
+    {
+      if (ht->slots[i].item == NULL)
+	return -1;
+    }
+
+  for (j = (i + 1) & ht->mask; ht->slots[j].item != NULL;
+       j = (j + 1) & ht->mask)
+    {
+      /* 
+       * an item whose home slot is cyclically in (i, j] stays put
+       * */
+      home = ht->slots[j].hash & ht->mask;
+      if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+	continue;
+
+      ht->slots[i] = ht->slots[j];
+      i = j;
+    }
+
+  ht->slots[i].item = NULL;
+  ht->count--;
+
+  return 0;
+}
+
+void
+hs_init (struct hset *hs, unsigned int size)
+{
+  assert (size > 0 && (size & (size - 1)) == 0);
+
+  hs->keys = (unsigned int *) calloc (size, sizeof (unsigned int));
+  assert (hs->keys);
+
+  hs->mask = size - 1;
+  hs->count = 0;
+}
+
+void
+hs_cleanup (struct hset *hs)
+{
+  free (hs->keys);
+  hs->keys = NULL;
+  hs->count = 0;
+}
+
+static void
+hs_grow (struct hset *hs)
+{
+  unsigned int *old;
+  unsigned int i, j, size;
+
+  old = hs->keys;
+  size = hs->mask + 1;
+
+  hs->keys = (unsigned int *) calloc (size * 2, sizeof (unsigned int));
+  assert (hs->keys);
+  hs->mask = size * 2 - 1;
+
+  for (i = 0; i < size; i++)
+    {
+      if (old[i] == 0)
+	continue;
+      for (j = old[i] & hs->mask; hs->keys[j] != 0; j = (j + 1) & hs->mask)
+	;
+      hs->keys[j] = old[i];
+    }
+
+  free (old);
+}
+
+/* 
+ * return 1 when key is in the set, 0 otherwise
+ * */
+int
+hs_find (struct hset *hs, unsigned int key)
+{
+  unsigned int i;
+
+  if (key == 0)
+    key = 1;
+
+  for (i = key & hs->mask; hs->keys[i] != 0; i = (i + 1) & hs->mask)
+    {
+      if (hs->keys[i] == key)
+	return 1;
+    }
+
+  return 0;
+}
+
+/* 
+ * add key, return 0 when it was there already, 1 otherwise
+ * */
+int
+hs_add (struct hset *hs, unsigned int key)
+{
+  unsigned int i;
+
+  if (key == 0)
+    key = 1;
+
+  for (i = key & hs->mask; hs->keys[i] != 0; i = (i + 1) & hs->mask)
+    {
+      if (hs->keys[i] == key)
+	return 0;
+    }
+
+  if ((hs->count + 1) * 2 > hs->mask + 1)
+    {
+      hs_grow (hs);
+      for (i = key & hs->mask; hs->keys[i] != 0; i = (i + 1) & hs->mask)
+	;
+    }
+
+  hs->keys[i] = key;
+  hs->count++;
+
+  return 1;
+}
+
+/* 
+ * start full with burst tokens at msec now
+ * */
+void
+tb_init (struct tbucket *tb, unsigned int burst, unsigned int now)
+{
+  tb->tokens = burst;
+  tb->stamp = now;
+}
+
+/* 
+ * add what rate earned since the last refill
+ * return the whole tokens available
+ * */
+unsigned int
+tb_refill (struct tbucket *tb, unsigned int rate, unsigned int burst,
+	   unsigned int now)
+{
+  tb->tokens += (double) (now - tb->stamp) * rate / 1000;
+  if (tb->tokens > burst)
+    tb->tokens = burst;
+  tb->stamp = now;
+
+  return tb->tokens > 0 ? (unsigned int) tb->tokens : 0;
+}
+
+/* 
+ * return 0 and spend cost tokens if the bucket holds them, -1 otherwise
+ * */
+int
+tb_take (struct tbucket *tb, unsigned int rate, unsigned int burst,
+	 unsigned int cost, unsigned int now)
+{
+  if (tb_refill (tb, rate, burst, now) < cost)
+    return -1;
+
+  tb->tokens -= cost;
+  return 0;
+}
+
+/* 
+ * fold the rtt msec sample in, RFC 6298 smoothing with alpha = 1/8 and
+ * beta = 1/4
+ * */
+void
+rtt_update (int *srtt, int *rttvar, int rtt)
+{
+  if (rtt < 1)
+    rtt = 1;
+
+  if (*srtt <= 0)
+    {
+      *srtt = rtt;
+      *rttvar = rtt / 2;
+      return;
+    }
+
+  *rttvar += (abs (*srtt - rtt) - *rttvar) / 4;
+  *srtt += (rtt - *srtt) / 8;
+  if (*srtt < 1)
+    *srtt = 1;
+}
+
+/* 
+ * msec until cost tokens are available, counted from the last refill
+ * */
+int
+tb_wait (struct tbucket *tb, unsigned int rate, unsigned int cost)
+{
+  if (tb->tokens >= cost || rate == 0)
+    return 0;
+
+  return (int) ((cost - tb->tokens) * 1000 / rate) + 1;
+}
+
 struct map_node *
 map_end (struct map *map)
 {
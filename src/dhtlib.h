@@ -34,6 +34,35 @@
 #define LOCAL_TOKEN_LEN         4
 #define TOKEN_LEN               20
 
+/* 
+ * word sized atomics with full barriers, shared between the network
+ * thread and application threads
+ * */
+#ifdef WIN32
+#include <windows.h>
+#define DHT_ATOMIC_INC(p)           InterlockedIncrement ((volatile LONG *) (p))
+#define DHT_ATOMIC_DEC(p)           InterlockedDecrement ((volatile LONG *) (p))
+#define DHT_ATOMIC_GET(p)           InterlockedCompareExchange ((volatile LONG *) (p), 0, 0)
+#define DHT_ATOMIC_GETPTR(p)        InterlockedCompareExchangePointer ((PVOID volatile *) (p), NULL, NULL)
+#define DHT_ATOMIC_XCHGPTR(p, v)    InterlockedExchangePointer ((PVOID volatile *) (p), (v))
+#define DHT_ATOMIC_CASPTR(p, o, n)  (InterlockedCompareExchangePointer ((PVOID volatile *) (p), (n), (o)) == (o))
+#define DHT_ATOMIC_SET(p, v)        InterlockedExchange ((volatile LONG *) (p), (v))
+#define DHT_ATOMIC_XCHG(p, v)       InterlockedExchange ((volatile LONG *) (p), (v))
+#define DHT_ATOMIC_CAS(p, o, n)     (InterlockedCompareExchange ((volatile LONG *) (p), (n), (o)) == (LONG) (o))
+#else
+#define DHT_ATOMIC_INC(p)           __atomic_add_fetch ((p), 1, __ATOMIC_SEQ_CST)
+#define DHT_ATOMIC_DEC(p)           __atomic_sub_fetch ((p), 1, __ATOMIC_SEQ_CST)
+#define DHT_ATOMIC_GET(p)           __atomic_load_n ((p), __ATOMIC_SEQ_CST)
+#define DHT_ATOMIC_GETPTR(p)        __atomic_load_n ((p), __ATOMIC_SEQ_CST)
+#define DHT_ATOMIC_XCHGPTR(p, v)    __atomic_exchange_n ((p), (v), __ATOMIC_SEQ_CST)
+#define DHT_ATOMIC_CASPTR(p, o, n)  __sync_bool_compare_and_swap ((p), (o), (n))
+#define DHT_ATOMIC_SET(p, v)        __atomic_store_n ((p), (v), __ATOMIC_SEQ_CST)
+#define DHT_ATOMIC_XCHG(p, v)       __atomic_exchange_n ((p), (v), __ATOMIC_SEQ_CST)
+#define DHT_ATOMIC_CAS(p, o, n)     __sync_bool_compare_and_swap ((p), (o), (n))
+#endif
+
+#define HASHSG_BIT(h, n)        ((((unsigned char) (h)[(n) >> 3]) >> (7 - ((n) & 7))) & 1)
+
 #define string_step(b, i)       do { (b)->data += (i); (b)->len -= (i); } while (0)
 
 struct string
@@ -114,6 +143,101 @@ int map_empty (struct map *);
 struct map_node *map_begin (struct map *);
 struct map_node *map_end (struct map *);
 
+/* 
+ * bounded lock-free FIFO, any number of threads may push while a single
+ * thread pops and tests ring_empty, the size is a power of two
+ * */
+struct ring_cell
+{
+  volatile unsigned long seq;
+  void *item;
+};
+
+struct ring
+{
+  volatile unsigned long head;
+  unsigned long tail;
+  unsigned long mask;
+  struct ring_cell *cells;
+};
+
+struct ring *ring_init (unsigned int);
+void ring_cleanup (struct ring *);
+int ring_push (struct ring *, void *);
+void *ring_pop (struct ring *);
+int ring_empty (struct ring *);
+
+unsigned int hash_bytes (const void *, int, unsigned int);
+
+/* 
+ * open addressing table of items with linear probing, the caller hashes
+ * the keys and compares them; the size is a power of two that doubles
+ * when the table gets half full, a slot with a NULL item is free
+ * */
+struct hslot
+{
+  unsigned int hash;
+  void *item;
+};
+
+struct htable
+{
+  struct hslot *slots;
+  unsigned int mask;
+  unsigned int count;
+};
+
+#define HT_COUNT(ht)    ((ht)->count)
+
+void ht_init (struct htable *, unsigned int);
+void ht_cleanup (struct htable *);
+void *ht_find (struct htable *, unsigned int,
+	       int (*)(const void *, const void *), const void *);
+void ht_insert (struct htable *, unsigned int, void *);
+int ht_remove (struct htable *, unsigned int, const void *);
+
+/* 
+ * open addressing set of 32 bit keys, the caller hashes what it
+ * remembers into them; 0 marks a free slot and is stored as 1
+ * */
+struct hset
+{
+  unsigned int *keys;
+  unsigned int mask;
+  unsigned int count;
+};
+
+#define HS_COUNT(hs)    ((hs)->count)
+
+void hs_init (struct hset *, unsigned int);
+void hs_cleanup (struct hset *);
+int hs_find (struct hset *, unsigned int);
+int hs_add (struct hset *, unsigned int);
+
+/* 
+ * token bucket filled at rate tokens per second up to burst, stamp is
+ * the msec time of the last refill; rate and burst are passed in so one
+ * setting can drive many buckets
+ * */
+struct tbucket
+{
+  double tokens;
+  unsigned int stamp;
+};
+
+void tb_init (struct tbucket *, unsigned int, unsigned int);
+unsigned int tb_refill (struct tbucket *, unsigned int, unsigned int,
+			unsigned int);
+int tb_take (struct tbucket *, unsigned int, unsigned int, unsigned int,
+	     unsigned int);
+int tb_wait (struct tbucket *, unsigned int, unsigned int);
+
+/* 
+ * smoothed round trip time and mean deviation in msec, srtt is 0 until
+ * the first sample
+ * */
+void rtt_update (int *, int *, int);
+
 #define OBJ_TYPE(obj)                   ((obj)->type)
 
 #define  OBJ_AS_VALUE(obj)              (OBJ_TYPE (obj) != OBJ_TYPE_VALUE? 0: (obj)->m_value)
@@ -204,4 +328,6 @@ void hashsg_cpy (char *, const char *);
 
 int hashsg_closer (const char *, const char *, const char *);
 
+int hashsg_prefix_len (const char *, const char *);
+
 #endif
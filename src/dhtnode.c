@@ -33,7 +33,7 @@
 #include <assert.h>
 
 struct dht_node *
-dn_init (const char *id, const struct sockaddr_in *sa)
+dn_init (const char *id, const struct dht_addr *sa)
 {
   struct dht_node *dn;
 
@@ -42,20 +42,22 @@ dn_init (const char *id, const struct sockaddr_in *sa)
 
   hashsg_cpy (dn->hashsg, id);
 
-  memcpy (&dn->m_sockaddr, sa, sizeof (struct sockaddr_in));
+  memcpy (&dn->m_sockaddr, sa, sizeof (struct dht_addr));
   dn->m_lastseen = 0;
   dn->m_active = 0;
   dn->m_inactive = 0;
+  dn->m_srtt = 0;
+  dn->m_rttvar = 0;
   dn->m_bucket = NULL;
 
   return dn;
 }
 
 struct dht_node *
-dn_init_object (const char *id, struct dht_object *obj)
+dn_init_object (const char *id, struct dht_object *obj, time_t now)
 {
   struct dht_node *dn;
-  struct string str;
+  struct string str, *compact;
 
   dn = (struct dht_node *) calloc (1, sizeof (struct dht_node));
   assert (dn);
@@ -67,39 +69,67 @@ dn_init_object (const char *id, struct dht_object *obj)
   dn->m_inactive = 0;
   dn->m_bucket = NULL;
 
-  dn->m_sockaddr.sin_family = AF_INET;
+  string_set (&str, "a");
+  compact = obj_get_key_string (obj, &str);
+  if (compact != NULL && compact->len == DA_COMPACT_LEN6)
+    {
+      da_load_compact (&dn->m_sockaddr, AF_INET6, compact->data);
+    }
+  else
+    {
+      da_init (&dn->m_sockaddr, AF_INET);
 
-  string_set (&str, "i");
-  dn->m_sockaddr.sin_addr.s_addr = obj_get_key_value (obj, &str);
+      string_set (&str, "i");
+      dn->m_sockaddr.sin.sin_addr.s_addr = obj_get_key_value (obj, &str);
 
-  string_set (&str, "p");
-  dn->m_sockaddr.sin_port = (unsigned short) obj_get_key_value (obj, &str);
+      string_set (&str, "p");
+      dn->m_sockaddr.sin.sin_port =
+	(unsigned short) obj_get_key_value (obj, &str);
+    }
 
   string_set (&str, "t");
   dn->m_lastseen = obj_get_key_value (obj, &str);
 
-  DN_UPDATE (dn);
+  DN_UPDATE (dn, now);
 
   return dn;
 }
 
+void
+dn_update_rtt (struct dht_node *dn, int rtt)
+{
+  rtt_update (&dn->m_srtt, &dn->m_rttvar, rtt);
+}
+
 char *
 dn_store_compact (struct dht_node *dn, char *buffer)
 {
-  memcpy (buffer + 20, &dn->m_sockaddr, 6);
-  return buffer + 26;
+  memcpy (buffer, dn->hashsg, HASH_STRING_LEN);
+  return da_store_compact (&dn->m_sockaddr, buffer + HASH_STRING_LEN);
 }
 
 struct dht_object *
 dn_store_cache (struct dht_node *dn, struct dht_object *container)
 {
-  struct string str;
-
-  string_set (&str, "i");
-  obj_insert_key_value (container, &str, dn->m_sockaddr.sin_addr.s_addr);
-
-  string_set (&str, "p");
-  obj_insert_key_value (container, &str, dn->m_sockaddr.sin_port);
+  struct string str, str2;
+  char compact[DA_COMPACT_LEN6];
+
+  if (DA_IS_V6 (&dn->m_sockaddr))
+    {
+      da_store_compact (&dn->m_sockaddr, compact);
+      string_set (&str, "a");
+      string_set2 (&str2, compact, DA_COMPACT_LEN6);
+      obj_insert_key_string (container, &str, &str2);
+    }
+  else
+    {
+      string_set (&str, "i");
+      obj_insert_key_value (container, &str,
+			    dn->m_sockaddr.sin.sin_addr.s_addr);
+
+      string_set (&str, "p");
+      obj_insert_key_value (container, &str, dn->m_sockaddr.sin.sin_port);
+    }
 
   string_set (&str, "t");
   obj_insert_key_value (container, &str, (signed long) dn->m_lastseen);
@@ -29,32 +29,28 @@
 #define _DHT_NODE_H_
 
 #include "dhtbucket.h"
+#include "dhtaddr.h"
 
 #include "queue.h"
 
 #include <time.h>
-#ifdef _WIN32
-#include <WinSock2.h>
-#else
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h>
-#include <arpa/inet.h>
-#endif
 
 #define DN_MAX_FAILED   5
+#define DN_RTT_DEFAULT  500
 
-#define DN_AGE(dn)              (time (NULL) - (dn)->m_lastseen)
+#define DN_AGE(dn, now)         ((now) - (dn)->m_lastseen)
 #define DN_IS_GOOD(dn)          ((dn)->m_active)
 #define DN_IS_BAD(dn)           ((dn)->m_inactive >= DN_MAX_FAILED)
 #define DN_IS_QUESTIONABLE(dn)  (!(dn)->m_active)
 #define DN_IS_ACTIVE(dn)        ((dn)->m_lastseen)
-#define DN_IS_IN_RANGE(dn, b)   (db_is_inrange ((b), (dn)->hashsg))
+#define DN_IS_IN_RANGE(dn, b)   (DB_IS_INRANGE ((b), (dn)->hashsg))
+#define DN_HAS_RTT(dn)          ((dn)->m_srtt > 0)
+#define DN_RTT(dn)              (DN_HAS_RTT(dn) ? (dn)->m_srtt : DN_RTT_DEFAULT)
 
-#define DN_SET_GOOD(dn) do {                                      \
+#define DN_SET_GOOD(dn, now) do {                                 \
   if ((dn)->m_bucket != NULL && !DN_IS_GOOD(dn))                  \
     DB_NODE_NOW_GOOD((dn)->m_bucket, DN_IS_BAD(dn));              \
-  (dn)->m_lastseen = time (NULL); (dn)->m_inactive = 0; (dn)->m_active = 1;     \
+  (dn)->m_lastseen = (now); (dn)->m_inactive = 0; (dn)->m_active = 1;     \
 } while (0)
 
 #define DN_SET_BAD(dn) do {                                  \
@@ -68,15 +64,15 @@
   else (dn)->m_inactive ++;                                       \
 } while (0)
 
-#define DN_UPDATE(dn) do {                                      \
-    (dn)->m_active = DN_AGE (dn) < 15 * 60;                    \
+#define DN_UPDATE(dn, now) do {                                 \
+    (dn)->m_active = DN_AGE (dn, now) < 15 * 60;               \
 } while (0)
 
-#define DN_QUERIED(dn) do {                                     \
-    if ((dn)->m_lastseen) DN_SET_GOOD(dn);                        \
+#define DN_QUERIED(dn, now) do {                                \
+    if ((dn)->m_lastseen) DN_SET_GOOD(dn, now);                   \
 } while (0)
 
-#define DN_REPLIED(dn) DN_SET_GOOD(dn)
+#define DN_REPLIED(dn, now) DN_SET_GOOD(dn, now)
 
 #define dn_cleanup(dn)  free (dn)
 
@@ -84,20 +80,29 @@ struct dht_node
 {
   char hashsg[HASH_STRING_LEN + 1];
 
-  struct sockaddr_in m_sockaddr;
+  struct dht_addr m_sockaddr;
 
   time_t m_lastseen;
   int m_active;
   int m_inactive;
 
+  /* 
+   * smoothed round trip time and its variance in msec,
+   * m_srtt is 0 until the first reply was measured
+   * */
+  int m_srtt;
+  int m_rttvar;
+
   struct dht_bucket *m_bucket;
 
     LIST_ENTRY (dht_node) entries;
 };
 
-struct dht_node *dn_init (const char *, const struct sockaddr_in *);
+struct dht_node *dn_init (const char *, const struct dht_addr *);
+
+struct dht_node *dn_init_object (const char *, struct dht_object *, time_t);
 
-struct dht_node *dn_init_object (const char *, struct dht_object *);
+void dn_update_rtt (struct dht_node *, int);
 
 char *dn_store_compact (struct dht_node *, char *);
 
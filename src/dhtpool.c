@@ -0,0 +1,136 @@
+/*
+* This file is part of the libttdht package
+* Copyright (C) <2008>  <Alf>
+*
+* Contact: Alf <naihe2010@126.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*
+*/
+/* @CFILE dhtpool.c
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "dhtlog.h"
+#include "dhtpool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+void
+dp_init (struct dht_pool *dp, int size)
+{
+  memset (dp, 0, sizeof (struct dht_pool));
+
+  if (size < (int) sizeof (void *))
+    size = sizeof (void *);
+  dp->m_size = (size + DP_ALIGN - 1) & ~(DP_ALIGN - 1);
+  dp->m_perslab = (DP_SLAB_SIZE - DP_ALIGN) / dp->m_size;
+  assert (dp->m_perslab > 0);
+}
+
+/* 
+ * free the slabs, and with them every object still out
+ * */
+void
+dp_cleanup (struct dht_pool *dp)
+{
+  void *slab;
+
+  while ((slab = dp->m_slabs) != NULL)
+    {
+      dp->m_slabs = *(void **) slab;
+      free (slab);
+    }
+
+  dp->m_free = NULL;
+}
+
+/* 
+ * put the objects of a new slab on the free list, the first one on top
+ * so they are handed out in address order
+ * */
+static void
+dp_grow (struct dht_pool *dp)
+{
+  char *slab, *obj;
+  int i;
+
+  slab = (char *) malloc (DP_SLAB_SIZE);
+  assert (slab);
+
+  *(void **) slab = dp->m_slabs;
+  dp->m_slabs = slab;
+
+  for (i = dp->m_perslab - 1; i >= 0; i--)
+    {
+      obj = slab + DP_ALIGN + i * dp->m_size;
+      *(void **) obj = dp->m_free;
+      dp->m_free = obj;
+    }
+
+#ifdef WITH_POOL_STATS
+  dp->m_numslabs++;
+#endif
+}
+
+/* 
+ * a zeroed object
+ * */
+void *
+dp_alloc (struct dht_pool *dp)
+{
+  void *obj;
+
+  if (dp->m_free == NULL)
+    dp_grow (dp);
+
+  obj = dp->m_free;
+  dp->m_free = *(void **) obj;
+  memset (obj, 0, dp->m_size);
+
+#ifdef WITH_POOL_STATS
+  dp->m_allocs++;
+  if (++dp->m_inuse > dp->m_peak)
+    dp->m_peak = dp->m_inuse;
+#endif
+
+  return obj;
+}
+
+void
+dp_free (struct dht_pool *dp, void *obj)
+{
+  *(void **) obj = dp->m_free;
+  dp->m_free = obj;
+
+#ifdef WITH_POOL_STATS
+  dp->m_inuse--;
+#endif
+}
+
+void
+dp_report (struct dht_pool *dp, const char *name)
+{
+#ifdef WITH_POOL_STATS
+  ttdht_info ("pool %s: %lu allocs, %lu in use, peak %lu, %u slabs of %d\n",
+	      name, dp->m_allocs, dp->m_inuse, dp->m_peak, dp->m_numslabs,
+	      dp->m_perslab);
+#endif
+}
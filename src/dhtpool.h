@@ -0,0 +1,67 @@
+/*
+* This file is part of the libttdht package
+* Copyright (C) <2008>  <Alf>
+*
+* Contact: Alf <naihe2010@126.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*
+*/
+/* @CFILE dhtpool.h
+*/
+
+#ifndef _DHT_POOL_H_
+#define _DHT_POOL_H_
+
+/* 
+ * bytes of one slab and the alignment of the objects carved from it
+ * */
+#define DP_SLAB_SIZE            4096
+#define DP_ALIGN                8
+
+#define DP_IN_USE(dp)           ((dp)->m_inuse)
+
+/* 
+ * slab allocator for objects of one size, owned by a single thread;
+ * freed objects go on a free list threaded through them and slabs are
+ * only given back by dp_cleanup
+ *
+ * the counters are always there so the layout does not depend on the
+ * configuration, they are only kept with --enable-pool-stats
+ * */
+struct dht_pool
+{
+  int m_size;
+  int m_perslab;
+  void *m_free;
+  void *m_slabs;
+
+  unsigned long m_allocs;
+  unsigned long m_inuse;
+  unsigned long m_peak;
+  unsigned int m_numslabs;
+};
+
+void dp_init (struct dht_pool *, int);
+
+void dp_cleanup (struct dht_pool *);
+
+void *dp_alloc (struct dht_pool *);
+
+void dp_free (struct dht_pool *, void *);
+
+void dp_report (struct dht_pool *, const char *);
+
+#endif
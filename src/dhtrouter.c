@@ -25,6 +25,10 @@
 */
 /* @date Created: 2009/08/19 11:16:40 Alf*/
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include "dhtlog.h"
 #include "dhtbucket.h"
 #include "dhttracker.h"
@@ -37,6 +41,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
 
 #ifdef WIN32
 #include <time.h>
@@ -99,13 +104,71 @@ gettimeofday (struct timeval *tv, struct timezone *tz)
 
 #else /*  */
 #include <sys/time.h>
+#include <time.h>
+#endif
+
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+#define DR_HAVE_MONOTONIC
 #endif
 
 static int dr_receive_timeout (struct dht_router *);
+static void dr_clock_init (struct dht_router *);
 static int dr_receive_timeout_bootstrap (struct dht_router *);
+static void dr_timer_down (struct dht_router *, int);
 
 char zero_id[HASH_STRING_LEN + 1] = { 0 };
 
+static const char *dr_nodes_key[DR_NUM_TABLES] = { "nodes", "nodes6" };
+
+/* 
+ * num packets of DR_SIZE_PACKET bytes, the headers and their buffers
+ * share one block
+ * */
+static struct dht_packet *
+dr_packets_init (int num)
+{
+  struct dht_packet *pkts;
+  int i;
+
+  pkts = (struct dht_packet *)
+    calloc (num, sizeof (struct dht_packet) + DR_SIZE_PACKET);
+  assert (pkts);
+
+  for (i = 0; i < num; i++)
+    {
+      pkts[i].buf = (char *) (pkts + num) + i * DR_SIZE_PACKET;
+      pkts[i].size = DR_SIZE_PACKET;
+    }
+
+  return pkts;
+}
+
+/* 
+ * the send queues hold headers only, a queued datagram takes one of the
+ * shared buffers
+ * */
+static void
+dr_sends_init (struct dht_router *dr)
+{
+  char *bufs;
+  int i;
+
+  dr->m_sends[0] = (struct dht_packet *)
+    calloc (DR_NUM_PRIS * DR_NUM_SENDS, sizeof (struct dht_packet));
+  assert (dr->m_sends[0]);
+  for (i = 1; i < DR_NUM_PRIS; i++)
+    dr->m_sends[i] = dr->m_sends[0] + i * DR_NUM_SENDS;
+
+  dr->m_sendbufs = (char **)
+    calloc (DR_NUM_SENDS, sizeof (char *) + DR_SIZE_PACKET);
+  assert (dr->m_sendbufs);
+
+  bufs = (char *) (dr->m_sendbufs + DR_NUM_SENDS);
+  for (i = 0; i < DR_NUM_SENDS; i++)
+    dr->m_sendbufs[i] = bufs + i * DR_SIZE_PACKET;
+  dr->m_numsendbufs = DR_NUM_SENDS;
+}
+
 struct dht_router *
 dr_init (struct dht_object *cache, int port, dhtio_t *io)
 {
@@ -114,22 +177,37 @@ dr_init (struct dht_object *cache, int port, dhtio_t *io)
   struct map_node *mn;
   struct list_node *ln;
   struct dht_router *dr;
-  struct sockaddr_in addr;
-  char ones_id[HASH_STRING_LEN + 1], buffer[HASH_STRING_LEN + 1];
+  struct dht_table *tb;
+  struct dht_addr addr;
+  char buffer[HASH_STRING_LEN + 1];
   unsigned int i;
   struct string str, *temp;
 
   dr = (struct dht_router *) calloc (1, sizeof (struct dht_router));
   assert (dr);
 
-  addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = INADDR_ANY;
-  addr.sin_port = htons (port);
-  memset (&addr.sin_zero, 0, 8);
+  da_init (&addr, AF_INET);
+  da_set_port (&addr, port);
 
   dr->m_fdp = io->fdp;
   dr->read = io->read;
   dr->write = io->write;
+  dr->wakeup = io->wakeup;
+  dr->read_batch = io->read_batch;
+  dr->write_batch = io->write_batch;
+  dr->gettime = io->gettime;
+  dr_clock_init (dr);
+  dr_update_time (dr);
+
+  dr->m_packets = dr_packets_init (DR_NUM_READS);
+  dr_sends_init (dr);
+
+  dr->m_actions = ring_init (DR_NUM_ACTIONS);
+
+  dp_init (&dr->m_pools.m_trans, sizeof (struct dht_trans));
+  dp_init (&dr->m_pools.m_transrefs, sizeof (struct dht_ttype_trans_t));
+  dp_init (&dr->m_pools.m_dests, sizeof (struct dht_trans_dest));
+  dp_init (&dr->m_pools.m_candidates, sizeof (struct dht_node_search_t));
 
   dr->node = dn_init (zero_id, &addr);
   dr->m_server = ds_init (dr);
@@ -154,27 +232,38 @@ dr_init (struct dht_object *cache, int port, dhtio_t *io)
     }
 
   hashsg_clear (zero_id, 0);
-  hashsg_clear (ones_id, 0xFF);
-  dr->node->m_bucket = db_init (zero_id, ones_id);
 
-  string_set2 (&str, ones_id, HASH_STRING_LEN);
-  map_insert_head (&dr->m_buckets, &str, dr->node->m_bucket);
-
-  string_set (&str, "nodes");
-  if (cache && obj_has_key (cache, &str))
+  for (i = 0; i < DR_NUM_TABLES; i++)
     {
-      nodes = obj_get_key_map (cache, &str);
+      tb = &dr->m_tables[i];
+      tb->af = i == DR_TABLE_V6 ? AF_INET6 : AF_INET;
+      tb->m_root = db_init (zero_id, 0, dr_time (dr));
+      tb->m_bucket = tb->m_root;
+      tb->m_numbuckets = 1;
 
-      LIST_FOREACH (mn, nodes, entries)
-      {
-	struct dht_node *node;
-	node = dn_init_object (mn->key.data, (struct dht_object *) mn->value);
-	map_insert_head (&dr->m_nodes, &mn->key, node);
-	dr_add_node_to_bucket (dr, node);
-      }
+      string_set (&str, dr_nodes_key[i]);
+      if (cache && obj_has_key (cache, &str))
+	{
+	  nodes = obj_get_key_map (cache, &str);
+
+	  LIST_FOREACH (mn, nodes, entries)
+	  {
+	    struct dht_node *node;
+	    node =
+	      dn_init_object (mn->key.data, (struct dht_object *) mn->value,
+			      dr_time (dr));
+	    if (DA_FAMILY (&node->m_sockaddr) != tb->af)
+	      {
+		dn_cleanup (node);
+		continue;
+	      }
+	    map_insert_head (&tb->m_nodes, &mn->key, node);
+	    dr_add_node_to_bucket (dr, tb, node);
+	  }
+	}
     }
 
-  if (MAP_SIZE (&dr->m_nodes) < DR_NUM_BOOTSTRAP_COMPLETE)
+  if (DR_NUM_NODES (dr) < DR_NUM_BOOTSTRAP_COMPLETE)
     {
       string_set (&str, "contacts");
       if (cache && obj_has_key (cache, &str))
@@ -208,31 +297,80 @@ dr_init (struct dht_object *cache, int port, dhtio_t *io)
 	}
     }
 
+  dr->m_snapshot = dsn_init (dr);
+
   return dr;
 }
 
 void
 dr_cleanup (struct dht_router *dr)
 {
+  struct dht_snapshot *dsn;
+  struct dht_action *act;
   struct map_node *mn;
+  struct dht_table *tb;
+  int i;
 
-  db_cleanup (dr->node->m_bucket);
   dn_cleanup (dr->node);
   ds_cleanup (dr->m_server);
 
-  LIST_FOREACH (mn, &dr->m_nodes, entries)
-  {
-    dn_cleanup ((struct dht_node *) mn->value);
-  }
+  while (dr->m_numtimers > 0)
+    dr_timer_remove (dr, dr->m_timers[0]);
+  free (dr->m_timers);
+  dr->boot_timer = NULL;
 
-  map_clear (&dr->m_nodes);
+  while ((act = ring_pop (dr->m_actions)) != NULL)
+    free (act);
+  ring_cleanup (dr->m_actions);
+  free (dr->m_packets);
+  free (dr->m_sends[0]);
+  free (dr->m_sendbufs);
 
-  map_clear (&dr->m_buckets);
+  while ((dsn = dr->m_retired) != NULL)
+    {
+      dr->m_retired = dsn->m_next;
+      dsn_release (dsn);
+    }
+  if (dr->m_snapshot != NULL)
+    dsn_release (dr->m_snapshot);
+
+  for (i = 0; i < DR_NUM_TABLES; i++)
+    {
+      tb = &dr->m_tables[i];
+
+      db_cleanup (tb->m_root);
+
+      LIST_FOREACH (mn, &tb->m_nodes, entries)
+      {
+	dn_cleanup ((struct dht_node *) mn->value);
+      }
+
+      map_clear (&tb->m_nodes);
+    }
 
   map_clear (&dr->m_trackers);
 
   map_clear (&dr->m_contacts);
 
+  if (dr->m_senddrops > 0 || dr->m_senddefers > 0)
+    ttdht_info ("send queue: %u datagrams dropped, %u deferred by the pacer\n",
+		dr->m_senddrops, dr->m_senddefers);
+
+#ifdef WITH_POOL_STATS
+  dp_report (&dr->m_pools.m_trans, "transactions");
+  dp_report (&dr->m_pools.m_transrefs, "transaction refs");
+  dp_report (&dr->m_pools.m_dests, "destinations");
+  dp_report (&dr->m_pools.m_candidates, "search candidates");
+#endif
+
+  /* 
+   * after the server, whose transactions and searches live in them
+   * */
+  dp_cleanup (&dr->m_pools.m_trans);
+  dp_cleanup (&dr->m_pools.m_transrefs);
+  dp_cleanup (&dr->m_pools.m_dests);
+  dp_cleanup (&dr->m_pools.m_candidates);
+
   free (dr);
 }
 
@@ -252,84 +390,568 @@ dr_start (struct dht_router *dr, int port)
   return 0;
 }
 
+/* 
+ * pick the default clock: CLOCK_MONOTONIC, or its coarse variant when
+ * that ticks at least every msec, offset to start at the system time
+ * so ages written to the cache keep their meaning across restarts;
+ * stepping the system clock later does not move it
+ * */
+static void
+dr_clock_init (struct dht_router *dr)
+{
+#ifdef DR_HAVE_MONOTONIC
+  struct timespec ts;
+  struct timeval mono[1];
+
+  dr->m_clockid = CLOCK_MONOTONIC;
+#ifdef CLOCK_MONOTONIC_COARSE
+  if (clock_getres (CLOCK_MONOTONIC_COARSE, &ts) == 0
+      && ts.tv_sec == 0 && ts.tv_nsec <= 1000000)
+    dr->m_clockid = CLOCK_MONOTONIC_COARSE;
+#endif
+  clock_gettime (dr->m_clockid, &ts);
+  mono->tv_sec = ts.tv_sec;
+  mono->tv_usec = ts.tv_nsec / 1000;
+  gettimeofday (dr->m_clockbase, NULL);
+  timersub (dr->m_clockbase, mono, dr->m_clockbase);
+#endif
+}
+
+/* 
+ * sample the router's clock into m_now, once per loop iteration; the
+ * bookkeeping of that iteration reads the cached value
+ * */
+void
+dr_update_time (struct dht_router *dr)
+{
+#ifdef DR_HAVE_MONOTONIC
+  struct timespec ts;
+#endif
+
+  if (dr->gettime != NULL)
+    {
+      dr->gettime (dr->m_fdp, dr->m_now);
+      return;
+    }
+#ifdef DR_HAVE_MONOTONIC
+  clock_gettime (dr->m_clockid, &ts);
+  dr->m_now->tv_sec = ts.tv_sec;
+  dr->m_now->tv_usec = ts.tv_nsec / 1000;
+  timeradd (dr->m_now, dr->m_clockbase, dr->m_now);
+#else
+  gettimeofday (dr->m_now, NULL);
+#endif
+}
+
+/* 
+ * the time on the router's clock, as of the last dr_update_time
+ * */
+void
+dr_gettime (struct dht_router *dr, struct timeval *tv)
+{
+  *tv = *dr->m_now;
+}
+
+/* 
+ * seconds on the router's clock, for node, bucket, transaction and
+ * peer ages
+ * */
+time_t
+dr_time (struct dht_router *dr)
+{
+  return dr->m_now->tv_sec;
+}
+
+/* 
+ * msec on the router's clock, wrapping, for token buckets
+ * */
+unsigned int
+dr_msec (struct dht_router *dr)
+{
+  return (unsigned int) (dr->m_now->tv_sec * 1000
+			 + dr->m_now->tv_usec / 1000);
+}
+
+/* 
+ * DR_PACE_BURST msec worth of rate, at least min
+ * */
+static unsigned int
+dr_pace_burst (unsigned int rate, unsigned int min)
+{
+  rate = (unsigned int) ((double) rate * DR_PACE_BURST / 1000);
+
+  return rate < min ? min : rate;
+}
+
+/* 
+ * how many of the num packets the pacer lets out at msec now
+ * */
+static int
+dr_pace (struct dht_router *dr, struct dht_packet *pkts, int num,
+	 unsigned int now)
+{
+  unsigned int rate, avail;
+  int i;
+
+  rate = DHT_ATOMIC_GET (&dr->m_ratepackets);
+  if (rate > 0)
+    {
+      avail = tb_refill (&dr->m_pacepackets, rate, dr_pace_burst (rate, 1),
+			 now);
+      if ((unsigned int) num > avail)
+	num = avail;
+    }
+
+  rate = DHT_ATOMIC_GET (&dr->m_ratebytes);
+  if (rate > 0)
+    {
+      avail = tb_refill (&dr->m_pacebytes, rate,
+			 dr_pace_burst (rate, DR_SIZE_PACKET), now);
+      for (i = 0; i < num && (unsigned int) pkts[i].len <= avail; i++)
+	avail -= pkts[i].len;
+      num = i;
+    }
+
+  return num;
+}
+
+static void
+dr_pace_spend (struct dht_router *dr, struct dht_packet *pkts, int num)
+{
+  int i;
+
+  if (DHT_ATOMIC_GET (&dr->m_ratepackets) > 0)
+    dr->m_pacepackets.tokens -= num;
+
+  if (DHT_ATOMIC_GET (&dr->m_ratebytes) > 0)
+    {
+      for (i = 0; i < num; i++)
+	dr->m_pacebytes.tokens -= pkts[i].len;
+    }
+}
+
+/* 
+ * msec until the pacer lets the first queued datagram out
+ * */
+static int
+dr_pace_wait (struct dht_router *dr)
+{
+  struct dht_packet *pkt;
+  unsigned int now, rate, brate;
+  int i, wait, bwait;
+
+  for (i = 0; i < DR_NUM_PRIS && dr->m_numsends[i] == 0; i++)
+    ;
+  if (i == DR_NUM_PRIS)
+    return 0;
+  pkt = &dr->m_sends[i][0];
+
+  /* 
+   * the buckets filled up since the last flush, or the wait would
+   * never come down to 0
+   * */
+  now = dr_msec (dr);
+  rate = DHT_ATOMIC_GET (&dr->m_ratepackets);
+  if (rate > 0)
+    tb_refill (&dr->m_pacepackets, rate, dr_pace_burst (rate, 1), now);
+  brate = DHT_ATOMIC_GET (&dr->m_ratebytes);
+  if (brate > 0)
+    tb_refill (&dr->m_pacebytes, brate,
+	       dr_pace_burst (brate, DR_SIZE_PACKET), now);
+
+  wait = tb_wait (&dr->m_pacepackets, rate, 1);
+  bwait = tb_wait (&dr->m_pacebytes, brate, pkt->len);
+
+  return wait > bwait ? wait : bwait;
+}
+
+/* 
+ * msec until dr_process_once has work: 0 while actions are queued,
+ * at most DR_TIMEOUT_SEND while sends wait for the socket or until the
+ * pacer lets the next one out, -1 if nothing is scheduled at all
+ * */
 int
-dr_run (struct dht_router *dr)
+dr_next_timeout (struct dht_router *dr)
+{
+  struct timeval now[1];
+  int timeout, wait;
+
+  if (!ring_empty (dr->m_actions) || DHT_ATOMIC_GET (&dr->quit))
+    return 0;
+
+  dr_update_time (dr);
+  dr_gettime (dr, now);
+  timeout = dr_timer_next (dr, now);
+
+  if (DR_NUM_QUEUED (dr) > 0)
+    {
+      wait = DR_IS_PACED (dr) ? dr_pace_wait (dr) : DR_TIMEOUT_SEND;
+      if (timeout < 0 || timeout > wait)
+	timeout = wait;
+    }
+
+  return timeout;
+}
+
+/* 
+ * fill the packet buffers one read at a time for io without read_batch
+ * */
+static int
+dr_read_packets (struct dht_router *dr, int timeout)
+{
+  struct dht_packet *pkt;
+  int count;
+
+  for (count = 0; count < DR_NUM_READS; count++)
+    {
+      pkt = &dr->m_packets[count];
+      pkt->addrlen = sizeof (struct dht_addr);
+      pkt->len = dr->read (dr->m_fdp, pkt->buf, pkt->size, &pkt->addr.sa,
+			   &pkt->addrlen, count == 0 ? timeout : 0);
+      if (pkt->len < 0)
+	break;
+    }
+
+  return count;
+}
+
+/* 
+ * one loop iteration: run the due timers, wait at most timeout msec
+ * for a packet, handle up to DR_NUM_READS packets that are ready, then
+ * the queued actions, and write out what they sent
+ * return the number of packets handled
+ * */
+int
+dr_process_once (struct dht_router *dr, int timeout)
 {
   struct timeval now[1];
-  struct timer *tm1, *tm2;
-  struct sockaddr_in sa[1];
+  struct timer *tm;
+  struct dht_packet *pkt;
   struct dht_action *act;
-  char buf[1500];
-  int ret;
+  int i, count;
+
+  dr_update_time (dr);
+  dr_gettime (dr, now);
 
-  while (!dr->quit)
+  /* 
+   * run the due timers, earliest first 
+   * */
+  while (dr->m_numtimers > 0 && timercmp (now, dr->m_timers[0]->at, >))
     {
-      gettimeofday (now, NULL);
+      tm = dr->m_timers[0];
+//    ttdht_debug ("occured timer: %p\n", tm);
+      if (tm->cb (tm->arg) == 0)
+	{
+	  dr_timer_remove (dr, tm);
+	}
+      else
+	{
+	  timeradd (now, tm->interval, tm->at);
+	  dr_timer_down (dr, tm->m_index);
+	}
+    }
+
+  if (!ring_empty (dr->m_actions))
+    timeout = 0;
+
+  count = 0;
+  if (dr->m_server && dr->m_fdp)
+    {
+      if (dr->read_batch != NULL)
+	count = dr->read_batch (dr->m_fdp, dr->m_packets, DR_NUM_READS,
+				timeout);
+      else
+	count = dr_read_packets (dr, timeout);
 
       /* 
-       * check the timer list 
+       * the read may have waited, stamp the packets with the time
+       * they were handled
        * */
-      for (tm1 = LIST_FIRST (dr->timer_list); tm1 != NULL; tm1 = tm2)
+      if (timeout != 0)
+	dr_update_time (dr);
+    }
+
+  for (i = 0; i < count; i++)
+    {
+      pkt = &dr->m_packets[i];
+      if (pkt->len > 0 && da_normalize (&pkt->addr) == 0)
 	{
-	  tm2 = LIST_NEXT (tm1, entries);
+	  ds_process (dr->m_server, &pkt->addr, pkt->buf, pkt->len);
+	}
+    }
 
-	  if (timercmp (now, tm1->at, >))
-	    {
-//            ttdht_debug ("occured timer: %p\n", tm1);
-	      if (tm1->cb (tm1->arg) == 0)
-		{
-		  LIST_REMOVE (tm1, entries);
-		  free (tm1);
-		}
-	    }
+  /* 
+   * check for action, in the order they were queued; clearing the
+   * flag first makes a producer racing with us wake the next wait
+   * */
+  DHT_ATOMIC_SET (&dr->m_wakepending, 0);
+  while ((act = ring_pop (dr->m_actions)) != NULL)
+    {
+      if (act->action == DHT_ACTION_PUB)
+	{
+	  ds_announce (dr->m_server, act->actbuf, act->actport, 1, NULL,
+		       NULL);
+	}
+      else if (act->action == DHT_ACTION_SEARCH)
+	{
+	  ds_announce (dr->m_server, act->actbuf,
+		       dr->m_server->port, 0, act->actcb, act->actarg);
 	}
+      free (act);
+    }
 
-      /* 
-       * wait some data 
-       * */
-      if (dr->m_server && dr->m_fdp)
+  dr_flush (dr);
+
+  /* 
+   * transactions waiting for the pacer or the send queue go out behind
+   * what was just written
+   * */
+  if (dr->m_server && ds_admit (dr->m_server) > 0)
+    dr_flush (dr);
+
+  if (dr->m_snapdirty || dr->m_retired != NULL)
+    dr_snapshot_publish (dr);
+
+  return count;
+}
+
+
+/* 
+ * queue a datagram of send class pri for the next dr_flush, a full
+ * queue is flushed first; return -1 if it is dropped, else ds_sent is
+ * told about tag once the datagram was written or dropped
+ * */
+int
+dr_send (struct dht_router *dr, const char *buf, size_t len,
+	 const struct dht_addr *sa, int pri, void *tag)
+{
+  struct dht_packet *pkt;
+  int i;
+
+  if (len > DR_SIZE_PACKET)
+    {
+      dr->m_senddrops++;
+      return -1;
+    }
+
+  if (dr->m_numsendbufs == 0)
+    dr_flush (dr);
+
+  /* 
+   * still full, the newest datagram of a later class makes room
+   * */
+  if (dr->m_numsendbufs == 0)
+    {
+      for (i = DR_NUM_PRIS - 1; i > pri && dr->m_numsends[i] == 0; i--)
+	;
+
+      dr->m_senddrops++;
+      if (i == pri)
 	{
-	  ret = dr->read (dr->m_fdp, buf, sizeof buf, sa, 10);
-	  if (ret > 0)
-	    {
-	      ds_process (dr->m_server, sa, buf, ret);
-	    }
+	  ttdht_debug ("send queue full, drop packet.\n");
+	  return -1;
 	}
 
-      /* 
-       * check for action 
-       * */
-      while ((act = LIST_FIRST (dr->action_list)) != NULL)
+      pkt = &dr->m_sends[i][--dr->m_numsends[i]];
+      dr->m_sendbufs[dr->m_numsendbufs++] = pkt->buf;
+      if (pkt->tag != NULL)
+	ds_sent (dr->m_server, pkt->tag);
+    }
+
+  if (DR_IS_PACED (dr))
+    dr->m_senddefers++;
+
+  pkt = &dr->m_sends[pri][dr->m_numsends[pri]++];
+  pkt->buf = dr->m_sendbufs[--dr->m_numsendbufs];
+  pkt->size = DR_SIZE_PACKET;
+  memcpy (pkt->buf, buf, len);
+  pkt->len = len;
+  memcpy (&pkt->addr, sa, sizeof (struct dht_addr));
+  pkt->addrlen = DA_LEN (sa);
+  pkt->tag = tag;
+
+  return 0;
+}
+
+/* 
+ * drop the queued datagrams of tag, its transaction is gone
+ * */
+void
+dr_send_cancel (struct dht_router *dr, void *tag)
+{
+  struct dht_packet *pkts;
+  int i, j;
+
+  for (i = 0; i < DR_NUM_PRIS; i++)
+    {
+      pkts = dr->m_sends[i];
+      for (j = 0; j < dr->m_numsends[i];)
 	{
-	  if (act->action == DHT_ACTION_PUB)
+	  if (pkts[j].tag != tag)
 	    {
-	      ds_announce (dr->m_server, act->actbuf, act->actport, 1, NULL,
-			   NULL);
+	      j++;
+	      continue;
 	    }
-	  else if (act->action == DHT_ACTION_SEARCH)
+
+	  dr->m_sendbufs[dr->m_numsendbufs++] = pkts[j].buf;
+	  dr->m_numsends[i]--;
+	  memmove (&pkts[j], &pkts[j + 1],
+		   (dr->m_numsends[i] - j) * sizeof (struct dht_packet));
+	}
+    }
+}
+
+/* 
+ * write the queued datagrams of one class in order
+ * return -1 if the socket would block or the pacer holds them back
+ * */
+static int
+dr_flush_class (struct dht_router *dr, int pri, unsigned int now)
+{
+  struct dht_packet *pkts;
+  int i, n, num, sent, ret;
+
+  pkts = dr->m_sends[pri];
+
+  ret = 0;
+  sent = 0;
+  while (sent < dr->m_numsends[pri])
+    {
+      num = dr_pace (dr, &pkts[sent], dr->m_numsends[pri] - sent, now);
+      if (num == 0)
+	{
+	  dr->m_pacing = 1;
+	  ret = -1;
+	  break;
+	}
+
+      if (dr->write_batch != NULL)
+	{
+	  n = dr->write_batch (dr->m_fdp, &pkts[sent], num);
+	}
+      else
+	{
+	  for (n = 0; n < num; n++)
 	    {
-	      ds_announce (dr->m_server, act->actbuf,
-			   dr->m_server->port, 0, act->actcb,
-			   act->actarg);
+	      i = sent + n;
+	      if (dr->write (dr->m_fdp, pkts[i].buf, pkts[i].len,
+			     &pkts[i].addr.sa, pkts[i].addrlen) < 0)
+		break;
 	    }
-	  LIST_REMOVE (act, entries);
-	  free (act);
+	  if (n == 0)
+	    n = -1;
 	}
+
+      if (n > 0)
+	{
+	  dr_pace_spend (dr, &pkts[sent], n);
+	  for (i = sent; i < sent + n; i++)
+	    if (pkts[i].tag != NULL)
+	      ds_sent (dr->m_server, pkts[i].tag);
+	  sent += n;
+	  continue;
+	}
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+	{
+	  ret = -1;
+	  break;
+	}
+
+      ttdht_debug ("send error: %s, drop packet.\n", strerror (errno));
+      dr->m_senddrops++;
+      if (pkts[sent].tag != NULL)
+	ds_sent (dr->m_server, pkts[sent].tag);
+      sent++;
+    }
+
+  for (i = 0; i < sent; i++)
+    dr->m_sendbufs[dr->m_numsendbufs++] = pkts[i].buf;
+
+  dr->m_numsends[pri] -= sent;
+  memmove (pkts, &pkts[sent],
+	   dr->m_numsends[pri] * sizeof (struct dht_packet));
+
+  return ret;
+}
+
+/* 
+ * write the queued datagrams, replies first, then user lookups, then
+ * maintenance; stop when the socket would block or the pacer runs out
+ * and keep the rest for the next call, a datagram that fails otherwise
+ * is dropped
+ * return the number still queued
+ * */
+int
+dr_flush (struct dht_router *dr)
+{
+  unsigned int now;
+  int i;
+
+  now = dr_msec (dr);
+
+  dr->m_pacing = 0;
+  for (i = 0; i < DR_NUM_PRIS; i++)
+    {
+      if (dr_flush_class (dr, i, now) < 0)
+	break;
+    }
+
+  return DR_NUM_QUEUED (dr);
+}
+
+int
+dr_run (struct dht_router *dr)
+{
+  int timeout;
+
+  while (!DHT_ATOMIC_GET (&dr->quit))
+    {
+      /* 
+       * sleep until the next timer is due, a packet arrives or
+       * dr_wakeup is called, queued actions do not wait at all
+       * */
+      timeout = dr_next_timeout (dr);
+      if (!dr->wakeup && (timeout < 0 || timeout > DR_TIMEOUT_POLL))
+	timeout = DR_TIMEOUT_POLL;
+
+      dr_process_once (dr, timeout);
     }
 
   return 0;
 }
 
+
+/* 
+ * limit outgoing traffic to bytes and packets per second, 0 leaves that
+ * budget unlimited; may be called from any thread
+ * */
+void
+dr_set_rate (struct dht_router *dr, unsigned int bytes, unsigned int packets)
+{
+  DHT_ATOMIC_SET (&dr->m_ratebytes, bytes);
+  DHT_ATOMIC_SET (&dr->m_ratepackets, packets);
+}
+
+/* 
+ * may be called from any thread, dr_run returns after its current
+ * iteration
+ * */
 void
 dr_stop (struct dht_router *dr)
 {
-  if (dr->boot_timer != NULL)
-    {
-      dr_timer_remove (dr, dr->boot_timer);
-      dr->boot_timer = NULL;
-    }
+  DHT_ATOMIC_SET (&dr->quit, 1);
+  dr_wakeup (dr);
+}
 
-  dr->quit = 1;
+/* 
+ * make a sleeping dr_run look at its queues now
+ * */
+void
+dr_wakeup (struct dht_router *dr)
+{
+  if (dr->wakeup != NULL)
+    dr->wakeup (dr->m_fdp);
 }
 
 void
@@ -339,7 +961,27 @@ dr_announce (struct dht_router *dr, const char *key, void *util)
 	       NULL, util);
 }
 
-void
+/* 
+ * hand an action to the thread in dr_run, safe from any thread,
+ * wakes the loop only if no wakeup is pending yet
+ * */
+static int
+dr_queue_action (struct dht_router *dr, struct dht_action *act)
+{
+  if (ring_push (dr->m_actions, act) < 0)
+    {
+      ttdht_err ("Action queue full.\n");
+      free (act);
+      return -1;
+    }
+
+  if (DHT_ATOMIC_XCHG (&dr->m_wakepending, 1) == 0)
+    dr_wakeup (dr);
+
+  return 0;
+}
+
+int
 dr_pub (struct dht_router *dr, const char *key, unsigned short port)
 {
   struct dht_action *act;
@@ -348,17 +990,17 @@ dr_pub (struct dht_router *dr, const char *key, unsigned short port)
   if (act == NULL)
     {
       ttdht_err ("Memory error\n");
-      return;
+      return -1;
     }
 
   act->action = DHT_ACTION_PUB;
-  sprintf (act->actbuf, "%s", key);
+  snprintf (act->actbuf, sizeof act->actbuf, "%s", key);
   act->actport = port;
 
-  LIST_INSERT_HEAD (dr->action_list, act, entries);
+  return dr_queue_action (dr, act);
 }
 
-void
+int
 dr_get (struct dht_router *dr, const char *key,
 	void (*cb) (const char *, const char *, void *), void *arg)
 {
@@ -368,16 +1010,16 @@ dr_get (struct dht_router *dr, const char *key,
   if (act == NULL)
     {
       ttdht_err ("Memory error\n");
-      return;
+      return -1;
     }
 
   act->action = DHT_ACTION_SEARCH;
-  sprintf (act->actbuf, "%s", key);
+  snprintf (act->actbuf, sizeof act->actbuf, "%s", key);
   act->actport = 0;
   act->actcb = cb;
   act->actarg = arg;
 
-  LIST_INSERT_HEAD (dr->action_list, act, entries);
+  return dr_queue_action (dr, act);
 }
 
 void
@@ -414,24 +1056,23 @@ dr_get_tracker (struct dht_router *dr, const char *id, int create)
 }
 
 int
-dr_want_node (struct dht_router *dr, const char *id)
+dr_want_node (struct dht_router *dr, struct dht_table *tb, const char *id)
 {
-  struct map_node *ib;
+  struct dht_bucket *bucket;
   if ((hashsg_cmp (id, dr->node->hashsg) == 0)
       || hashsg_cmp (id, zero_id) == 0)
     return 0;
 
-  ib = dr_find_bucket (dr, id);
-  return (struct dht_bucket *) ib->value == dr->node->m_bucket
-    || DB_HAS_SPACE ((struct dht_bucket *) ib->value);
+  bucket = dr_find_bucket (dr, tb, id);
+  return bucket == tb->m_bucket || DB_HAS_SPACE (bucket);
 }
 
 struct dht_node *
-dr_get_node (struct dht_router *dr, const char *id)
+dr_get_node (struct dht_router *dr, struct dht_table *tb, const char *id)
 {
   struct map_node *in;
 
-  LIST_FOREACH (in, &dr->m_nodes, entries)
+  LIST_FOREACH (in, &tb->m_nodes, entries)
   {
     if (hashsg_cmp (in->key.data, id) == 0)
       break;
@@ -448,28 +1089,25 @@ dr_get_node (struct dht_router *dr, const char *id)
   return (struct dht_node *) in->value;
 }
 
-struct map_node *
-dr_find_bucket (struct dht_router *dr, const char *id)
+/* 
+ * give the buckets of the given number of levels next to our own id
+ * DB_EXTEND_FACTOR times the room, 0 turns it off
+ * */
+void
+dr_extend_buckets (struct dht_router *dr, int levels)
 {
-  struct map_node *ib, *bigger;
-
-  bigger = LIST_FIRST (&dr->m_buckets);
+  int i;
 
-  LIST_FOREACH (ib, &dr->m_buckets, entries)
-  {
-    if (hashsg_cmp (ib->key.data, id) == 0)
-      return ib;
+  dr->m_extend = levels;
 
-    if (hashsg_cmp (ib->key.data, id) > 0)
-      {
-	if (hashsg_cmp (ib->key.data, bigger->key.data) < 0)
-	  {
-	    bigger = ib;
-	  }
-      }
-  }
+  for (i = 0; i < DR_NUM_TABLES; i++)
+    db_extend (dr->m_tables[i].m_bucket, levels);
+}
 
-  return bigger;
+struct dht_bucket *
+dr_find_bucket (struct dht_router *dr, struct dht_table *tb, const char *id)
+{
+  return db_find (tb->m_root, id);
 }
 
 void
@@ -487,81 +1125,93 @@ dr_add_contact (struct dht_router *dr, const char *host, int port)
 }
 
 void
-dr_contact (struct dht_router *dr, struct sockaddr_in *sa, int port)
+dr_contact (struct dht_router *dr, struct dht_addr *sa, int port)
 {
   if (DR_IS_ACTIVE (dr))
     {
-      sa->sin_port = htons (port);
+      da_set_port (sa, port);
       ds_ping (dr->m_server, zero_id, sa);
     }
 }
 
 struct dht_node *
-dr_node_queried (struct dht_router *dr, const char *id,
-		 struct sockaddr_in *sa)
+dr_node_queried (struct dht_router *dr, const char *id, struct dht_addr *sa)
 {
+  struct dht_table *tb;
   struct dht_node *node;
+  time_t now;
 
-  node = dr_get_node (dr, id);
+  tb = DR_TABLE (dr, DA_FAMILY (sa));
+  node = dr_get_node (dr, tb, id);
 
   if (node == NULL)
     {
-      if (dr_want_node (dr, id))
+      if (dr_want_node (dr, tb, id))
 	{
 	  ds_ping (dr->m_server, id, sa);
 	}
       return NULL;
     }
 
-  if (node->m_sockaddr.sin_addr.s_addr != sa->sin_addr.s_addr)
+  if (node == dr->node || !da_same_host (&node->m_sockaddr, sa))
     return NULL;
 
-  DN_QUERIED (node);
+  dr->m_snapdirty |= !DN_IS_GOOD (node) && DN_IS_ACTIVE (node);
+  now = dr_time (dr);
+  DN_QUERIED (node, now);
   if (DN_IS_GOOD (node))
-    DB_TOUCH (node->m_bucket);
+    DB_TOUCH (node->m_bucket, now);
 
   return node;
 }
 
 struct dht_node *
 dr_node_replied (struct dht_router *dr, const char *id,
-		 const struct sockaddr_in *sa)
+		 const struct dht_addr *sa)
 {
+  struct dht_table *tb;
   struct dht_node *node;
   struct string str;
+  time_t now;
 
-  node = dr_get_node (dr, id);
+  tb = DR_TABLE (dr, DA_FAMILY (sa));
+  node = dr_get_node (dr, tb, id);
 
   if (node == NULL)
     {
-      if (!dr_want_node (dr, id))
+      if (!dr_want_node (dr, tb, id))
 	return NULL;
 
       node = dn_init (id, sa);
       string_set2 (&str, id, HASH_STRING_LEN);
-      map_insert_head (&dr->m_nodes, &str, node);
+      map_insert_head (&tb->m_nodes, &str, node);
 
-      if (!dr_add_node_to_bucket (dr, node))
+      if (!dr_add_node_to_bucket (dr, tb, node))
 	return NULL;
     }
 
-  if (node->m_sockaddr.sin_addr.s_addr != sa->sin_addr.s_addr)
+  if (node == dr->node || !da_same_host (&node->m_sockaddr, sa))
     return NULL;
 
-  DN_REPLIED (node);
-  DB_TOUCH (node->m_bucket);
+  dr->m_snapdirty |= !DN_IS_GOOD (node);
+  now = dr_time (dr);
+  DN_REPLIED (node, now);
+  DB_TOUCH (node->m_bucket, now);
 
   return node;
 }
 
 struct dht_node *
 dr_node_inactive (struct dht_router *dr, const char *id,
-		  const struct sockaddr_in *sa)
+		  const struct dht_addr *sa)
 {
+  struct dht_table *tb;
   struct dht_node *node;
   struct map_node *in;
 
-  LIST_FOREACH (in, &dr->m_nodes, entries)
+  tb = DR_TABLE (dr, DA_FAMILY (sa));
+
+  LIST_FOREACH (in, &tb->m_nodes, entries)
   {
     if (hashsg_cmp (in->key.data, id) == 0)
       break;
@@ -574,16 +1224,18 @@ dr_node_inactive (struct dht_router *dr, const char *id,
 
   node = (struct dht_node *) in->value;
 
-  if (in == NULL || (node->m_sockaddr.sin_addr.s_addr != sa->sin_addr.s_addr))
+  if (!da_same_host (&node->m_sockaddr, sa))
     {
       return NULL;
     }
 
   DN_INACTIVE (node);
+  dr->m_snapdirty |= DN_IS_BAD (node);
 
-  if (DN_IS_BAD (node) && (DN_AGE (node) >= DR_TIMEOUT_REMOVE_NODE))
+  if (DN_IS_BAD (node)
+      && DN_AGE (node, dr_time (dr)) >= DR_TIMEOUT_REMOVE_NODE)
     {
-      dr_delete_node (dr, in);
+      dr_delete_node (dr, tb, in);
       return NULL;
     }
 
@@ -594,55 +1246,47 @@ void
 dr_node_invalid (struct dht_router *dr, const char *id)
 {
   struct map_node *in;
-  struct dht_node *node;
-
-  node = dr_get_node (dr, id);
+  struct dht_table *tb;
+  int i;
 
-  if (node == NULL || node == dr->node)
-    return;
+  for (i = 0; i < DR_NUM_TABLES; i++)
+    {
+      tb = &dr->m_tables[i];
 
-  LIST_FOREACH (in, &dr->m_nodes, entries)
-  {
-    if (hashsg_cmp (in->key.data, id) == 0)
+      LIST_FOREACH (in, &tb->m_nodes, entries)
       {
-	dr_delete_node (dr, in);
-	break;
+	if (hashsg_cmp (in->key.data, id) == 0)
+	  {
+	    dr_delete_node (dr, tb, in);
+	    break;
+	  }
       }
-  }
-
+    }
 }
 
 char *
-dr_store_closest_nodes (struct dht_router *dr, const char *id, char *buffer,
-			char *bufferend)
+dr_store_closest_nodes (struct dht_router *dr, struct dht_table *tb,
+			const char *id, char *buffer, char *bufferend)
 {
-  struct map_node *ib;
   struct db_chain *dc;
   struct dht_node *node;
 
-  ib = dr_find_bucket (dr, id);
-  dc = dbc_init ((struct dht_bucket *) ib->value);
+  dc = dbc_init (tb->m_root, id);
 
   do
     {
       for (node = LIST_FIRST (dc->m_cur->m_nodes);
-	   node != NULL && buffer != bufferend;
+	   node != NULL && buffer + DA_NODE_LEN (tb->af) <= bufferend;
 	   node = LIST_NEXT (node, entries))
 	{
 	  if (!DN_IS_BAD (node))
 	    {
 	      buffer = dn_store_compact (node, buffer);
-
-	      if (buffer > bufferend)
-		{
-		  ttdht_err ("wrote past buffer end.");
-		  dbc_cleanup (dc);
-		  return NULL;
-		}
 	    }
 	}
     }
-  while (buffer < bufferend && dbc_next (dc) != NULL);
+  while (buffer + DA_NODE_LEN (tb->af) <= bufferend
+	 && dbc_next (dc) != NULL);
 
   dbc_cleanup (dc);
   return buffer;
@@ -653,9 +1297,9 @@ dr_receive_timeout_bootstrap (struct dht_router *dr)
 {
   dr->boot_timer = NULL;
 
-  if (MAP_SIZE (&dr->m_nodes) < DR_NUM_BOOTSTRAP_COMPLETE)
+  if (DR_NUM_NODES (dr) < DR_NUM_BOOTSTRAP_COMPLETE)
     {
-      if (!MAP_EMPTY (&dr->m_nodes) || !MAP_EMPTY (&dr->m_contacts))
+      if (DR_NUM_NODES (dr) > 0 || !MAP_EMPTY (&dr->m_contacts))
 	dr_bootstrap (dr);
 
       dr->boot_timer = dr_timer_add (dr, DR_TIMEOUT_BOOTSTRAP_RETRY * 1000,
@@ -687,39 +1331,58 @@ static int
 dr_receive_timeout (struct dht_router *dr)
 {
   struct map_node *mn;
+  struct dht_table *tb;
+  struct db_chain *dc;
+  time_t now;
+  int i;
 
   dr->boot_timer = NULL;
+  now = dr_time (dr);
 
   dr->m_prevtoken = dr->m_curtoken;
   dr->m_curtoken = rand ();
+  dr->m_snapdirty = 1;
 
-  LIST_FOREACH (mn, &dr->m_nodes, entries)
-  {
-    struct dht_node *node = (struct dht_node *) mn->value;
-    DN_UPDATE (node);
+  for (i = 0; i < DR_NUM_TABLES; i++)
+    {
+      tb = &dr->m_tables[i];
 
-    if (DN_IS_QUESTIONABLE (node)
-	&& (DN_IS_BAD (node) || DN_AGE (node) >= DR_TIMEOUT_REMOVE_NODE))
-      ds_ping (dr->m_server, node->hashsg, &node->m_sockaddr);
-  }
+      LIST_FOREACH (mn, &tb->m_nodes, entries)
+      {
+	struct dht_node *node = (struct dht_node *) mn->value;
+	DN_UPDATE (node, now);
 
-  LIST_FOREACH (mn, &dr->m_buckets, entries)
-  {
-    struct dht_bucket *bucket = (struct dht_bucket *) mn->value;
+	if (DN_IS_QUESTIONABLE (node)
+	    && (DN_IS_BAD (node)
+		|| DN_AGE (node, now) >= DR_TIMEOUT_REMOVE_NODE))
+	  ds_ping (dr->m_server, node->hashsg, &node->m_sockaddr);
+      }
 
-    DB_UPDATE (bucket);
+      if (MAP_EMPTY (&tb->m_nodes))
+	continue;
 
-    if (!DB_IS_FULL (bucket) || DB_AGE (bucket) > DR_TIMEOUT_BUCKET_BOOTSTRAP)
-      {
-	dr_bootstrap_bucket (dr, bucket);
-      }
-  }
+      dc = dbc_init (tb->m_root, dr->node->hashsg);
+      do
+	{
+	  struct dht_bucket *bucket = dbc_bucket (dc);
+
+	  DB_UPDATE (bucket);
+
+	  if (!DB_IS_FULL (bucket)
+	      || DB_AGE (bucket, now) > DR_TIMEOUT_BUCKET_BOOTSTRAP)
+	    {
+	      dr_bootstrap_bucket (dr, tb, bucket);
+	    }
+	}
+      while (dbc_next (dc) != NULL);
+      dbc_cleanup (dc);
+    }
 
   LIST_FOREACH (mn, &dr->m_trackers, entries)
   {
     struct dht_tracker *tracker = (struct dht_tracker *) mn->value;
 
-    dt_prune (tracker, DR_TIMEOUT_PEER_ANNOUNCE);
+    dt_prune (tracker, DR_TIMEOUT_PEER_ANNOUNCE, now);
 
     if (DTK_EMPTY (tracker))
       {
@@ -736,21 +1399,24 @@ dr_receive_timeout (struct dht_router *dr)
 }
 
 char *
-dr_generate_token (struct dht_router *dr, const struct sockaddr_in *sa,
+dr_generate_token (struct dht_router *dr, const struct dht_addr *sa,
 		   int token, char *buffer)
 {
   SHA_CTX ctx;
-  unsigned long key = sa->sin_addr.s_addr;
+  const char *key;
+  int len;
+
+  key = da_host (sa, &len);
 
   SHA1_Init (&ctx);
   SHA1_Update (&ctx, &token, sizeof (token));
-  SHA1_Update (&ctx, &key, sizeof (key));
+  SHA1_Update (&ctx, key, len);
   SHA1_Final ((unsigned char *) buffer, &ctx);
   return buffer;
 }
 
 char *
-dr_make_token (struct dht_router *dr, const struct sockaddr_in *sa,
+dr_make_token (struct dht_router *dr, const struct dht_addr *sa,
 	       char *buffer)
 {
   return dr_generate_token (dr, sa, dr->m_curtoken, buffer);
@@ -758,123 +1424,131 @@ dr_make_token (struct dht_router *dr, const struct sockaddr_in *sa,
 
 int
 dr_token_valid (struct dht_router *dr, const char *token,
-		const struct sockaddr_in *sa)
+		const struct dht_addr *sa)
 {
   char reference[HASH_STRING_LEN + 1];
 
   if (memcmp
       (dr_generate_token (dr, sa, dr->m_curtoken, reference), token,
-       DR_SIZE_TOKEN) == 0)
+       LOCAL_TOKEN_LEN) == 0)
     return 1;
 
   return memcmp (dr_generate_token (dr, sa, dr->m_prevtoken, reference),
-		 token, DR_SIZE_TOKEN) == 0;
+		 token, LOCAL_TOKEN_LEN) == 0;
 }
 
 struct dht_node *
-dr_find_node (struct dht_router *dr, const struct sockaddr_in *sa)
+dr_find_node (struct dht_router *dr, const struct dht_addr *sa)
 {
   struct map_node *in;
+  struct dht_table *tb;
+
+  tb = DR_TABLE (dr, DA_FAMILY (sa));
 
-  LIST_FOREACH (in, &dr->m_nodes, entries)
+  LIST_FOREACH (in, &tb->m_nodes, entries)
   {
-    if (((struct dht_node *) in->value)->m_sockaddr.sin_addr.s_addr ==
-	sa->sin_addr.s_addr)
+    if (da_same_host (&((struct dht_node *) in->value)->m_sockaddr, sa))
       return (struct dht_node *) in->value;
   }
 
   return NULL;
 }
 
-struct map_node *
-dr_split_bucket (struct dht_router *dr, struct map_node *ib,
-		 struct dht_node *node)
+/* 
+ * split our own leaf, returns the leaf that covers our id afterwards
+ * */
+struct dht_bucket *
+dr_split_bucket (struct dht_router *dr, struct dht_table *tb,
+		 struct dht_bucket *bucket)
 {
-  struct map_node *newib;
-  struct dht_bucket *newbucket;
-  struct string str;
-
-  newbucket = db_split ((struct dht_bucket *) ib->value, dr->node->hashsg);
+  struct dht_bucket *other;
 
-  if (dr->node->m_bucket->m_child != NULL)
-    dr->node->m_bucket = dr->node->m_bucket->m_child;
+  tb->m_bucket = db_split (bucket, dr->node->hashsg);
+  tb->m_numbuckets++;
 
-  string_set2 (&str, newbucket->m_end, HASH_STRING_LEN);
-  map_insert_before (&dr->m_buckets, ib, &str, newbucket);
+  other = bucket->m_child[bucket->m_child[0] == tb->m_bucket];
 
-  newib = NULL;
+  db_extend (tb->m_bucket, dr->m_extend);
 
-  if (DB_IS_INRANGE (newbucket, dr->node->hashsg))
+  if (DB_IS_EMPTY (tb->m_bucket))
     {
-      if (DB_IS_EMPTY ((struct dht_bucket *) ib->value))
-	{
-	  dr_bootstrap_bucket (dr, (struct dht_bucket *) ib->value);
-	}
+      dr_bootstrap_bucket (dr, tb, tb->m_bucket);
     }
-  else
+  else if (DB_IS_EMPTY (other))
     {
-      if (DB_IS_EMPTY (newbucket))
-	{
-	  dr_bootstrap_bucket (dr, newbucket);
-	}
-
-      newib = ib;
+      dr_bootstrap_bucket (dr, tb, other);
     }
 
-  return newib;
+  return tb->m_bucket;
 }
 
+/* 
+ * return 0 if the node did not fit and was deleted
+ * */
 int
-dr_add_node_to_bucket (struct dht_router *dr, struct dht_node *node)
+dr_add_node_to_bucket (struct dht_router *dr, struct dht_table *tb,
+		       struct dht_node *node)
 {
-  struct map_node *ib, *in;
+  struct map_node *in;
+  struct dht_bucket *bucket;
   struct dht_node *bnode;
 
-  ib = dr_find_bucket (dr, node->hashsg);
+  bucket = dr_find_bucket (dr, tb, node->hashsg);
 
-  while (DB_IS_FULL ((struct dht_bucket *) ib->value))
+  while (DB_IS_FULL (bucket))
     {
-      bnode = db_find_replacement ((struct dht_bucket *) ib->value, 0);
+      bnode = db_find_replacement (bucket, 0);
 
       if (DN_IS_BAD (bnode))
 	{
-	  LIST_FOREACH (in, &dr->m_nodes, entries)
+	  LIST_FOREACH (in, &tb->m_nodes, entries)
 	  {
-	    if (hashsg_cmp (in->key.data, bnode->hashsg) == 0)
+	    if (in->value == bnode)
 	      {
-		dr_delete_node (dr, in);
+		dr_delete_node (dr, tb, in);
 		break;
 	      }
 	  }
 	}
       else
 	{
-	  if ((struct dht_bucket *) ib->value != dr->node->m_bucket)
+	  if (bucket != tb->m_bucket || !DB_CAN_SPLIT (bucket))
 	    {
-	      LIST_FOREACH (in, &dr->m_nodes, entries)
+	      LIST_FOREACH (in, &tb->m_nodes, entries)
 	      {
-		if (hashsg_cmp (in->key.data, node->hashsg) == 0)
+		if (in->value == node)
 		  {
-		    dr_delete_node (dr, in);
-		    return 0;
+		    dr_delete_node (dr, tb, in);
+		    break;
 		  }
 	      }
+	      return 0;
 	    }
-	  ib = dr_split_bucket (dr, ib, node);
+	  dr_split_bucket (dr, tb, bucket);
+	  bucket = dr_find_bucket (dr, tb, node->hashsg);
 	}
     }
 
-  db_add_node ((struct dht_bucket *) ib->value, node);
-  node->m_bucket = (struct dht_bucket *) ib->value;
+  db_add_node (bucket, node, dr_time (dr));
+  node->m_bucket = bucket;
+  dr->m_snapdirty = 1;
 
-  return 0;
+  return 1;
 }
 
 void
-dr_delete_node (struct dht_router *dr, struct map_node *in)
+dr_delete_node (struct dht_router *dr, struct dht_table *tb,
+		struct map_node *in)
 {
-  db_remove_node (((struct dht_node *) in->value)->m_bucket,
-		  (struct dht_node *) in->value);
+  struct dht_node *node;
+
+  node = (struct dht_node *) in->value;
+  if (node->m_bucket != NULL)
+    db_remove_node (node->m_bucket, node);
+
+  map_remove (&tb->m_nodes, in);
+  dn_cleanup (node);
+  dr->m_snapdirty = 1;
 }
 
 struct dht_object *
@@ -883,23 +1557,27 @@ dr_store_cache (struct dht_router *dr, struct dht_object *container)
   struct dht_object *nodes, *contacts, *top;
   struct map_node *mn;
   struct string str, str2;
+  int i;
 
   string_set (&str, "self_id");
   string_set2 (&str2, dr->node->hashsg, HASH_STRING_LEN);
   obj_insert_key_string (container, &str, &str2);
 
-  string_set (&str, "nodes");
-  nodes = obj_init (OBJ_TYPE_MAP);
-  obj_insert_key_object (container, &str, nodes);
-  LIST_FOREACH (mn, &dr->m_nodes, entries)
-  {
-    if (!DN_IS_BAD ((struct dht_node *) mn->value))
+  for (i = 0; i < DR_NUM_TABLES; i++)
+    {
+      string_set (&str, dr_nodes_key[i]);
+      nodes = obj_init (OBJ_TYPE_MAP);
+      obj_insert_key_object (container, &str, nodes);
+      LIST_FOREACH (mn, &dr->m_tables[i].m_nodes, entries)
       {
-	top = obj_init (OBJ_TYPE_MAP);
-	obj_insert_key_object (nodes, &mn->key, top);
-	dn_store_cache ((struct dht_node *) mn->value, top);
+	if (!DN_IS_BAD ((struct dht_node *) mn->value))
+	  {
+	    top = obj_init (OBJ_TYPE_MAP);
+	    obj_insert_key_object (nodes, &mn->key, top);
+	    dn_store_cache ((struct dht_node *) mn->value, top);
+	  }
       }
-  }
+    }
 
   if (!MAP_EMPTY (&dr->m_contacts))
     {
@@ -922,58 +1600,65 @@ dr_store_cache (struct dht_router *dr, struct dht_object *container)
 void
 dr_bootstrap (struct dht_router *dr)
 {
-  struct dht_node *node;
   struct map_node *mn;
-  int i, bu;
+  int i;
 
   i = 0;
   while (i++ < 8 && (mn = map_begin (&dr->m_contacts)))
     {
-      struct sockaddr_in sa;
-      sa.sin_family = AF_INET;
-      sa.sin_addr.s_addr = inet_addr (mn->key.data);
-      sa.sin_port = htons ((unsigned int) mn->value);
-      memset (sa.sin_zero, 0, 8);
-      dr_contact (dr, &sa, (unsigned int) mn->value);
+      struct dht_addr sa;
+      if (da_from_string (&sa, mn->key.data, (unsigned long) mn->value) == 0)
+	dr_contact (dr, &sa, (unsigned long) mn->value);
       map_remove (&dr->m_contacts, mn);
     }
 
-  if (LIST_EMPTY (&dr->m_nodes))
+  for (i = 0; i < DR_NUM_TABLES; i++)
+    dr_bootstrap_table (dr, &dr->m_tables[i]);
+}
+
+void
+dr_bootstrap_table (struct dht_router *dr, struct dht_table *tb)
+{
+  struct dht_node *node;
+  struct db_chain *dc;
+  int bu;
+
+  if (LIST_EMPTY (&tb->m_nodes))
     return;
 
-  dr_bootstrap_bucket (dr, dr->node->m_bucket);
+  dr_bootstrap_bucket (dr, tb, tb->m_bucket);
 
-  LIST_FOREACH (node, dr->node->m_bucket->m_nodes, entries)
+  LIST_FOREACH (node, tb->m_bucket->m_nodes, entries)
   {
     if (DN_IS_GOOD (node))
       ds_ping (dr->m_server, node->hashsg, &node->m_sockaddr);
   }
 
-  if (MAP_SIZE (&dr->m_buckets) < 2)
+  if (tb->m_numbuckets < 2)
     return;
 
-  mn = map_begin (&dr->m_buckets);
-  bu = rand () % MAP_SIZE (&dr->m_buckets);
-  while (mn != NULL && bu++ > 0)
-    {
-      mn = LIST_NEXT (mn, entries);
-    }
+  dc = dbc_init (tb->m_root, dr->node->hashsg);
+  bu = rand () % tb->m_numbuckets;
+  while (bu-- > 0 && dbc_next (dc) != NULL);
 
-  if (mn != NULL && mn->value != dr->node->m_bucket)
+  if (dbc_bucket (dc) != NULL && dbc_bucket (dc) != tb->m_bucket)
     {
-      dr_bootstrap_bucket (dr, (struct dht_bucket *) mn->value);
+      dr_bootstrap_bucket (dr, tb, dbc_bucket (dc));
     }
+
+  dbc_cleanup (dc);
 }
 
 void
-dr_bootstrap_bucket (struct dht_router *dr, struct dht_bucket *bucket)
+dr_bootstrap_bucket (struct dht_router *dr, struct dht_table *tb,
+		     struct dht_bucket *bucket)
 {
   char contactid[HASH_STRING_LEN + 1];
 
   if (!DR_IS_ACTIVE (dr))
     return;
 
-  if (bucket == dr->node->m_bucket)
+  if (bucket == tb->m_bucket)
     {
       hashsg_cpy (contactid, dr->node->hashsg);
       contactid[HASH_STRING_LEN - 1] ^= 1;
@@ -983,14 +1668,130 @@ dr_bootstrap_bucket (struct dht_router *dr, struct dht_bucket *bucket)
       db_get_random_id (bucket, contactid);
     }
 
-  ds_find_node (dr->m_server, bucket, contactid);
+  ds_find_node (dr->m_server, tb->af, bucket, contactid);
 }
 
+/* 
+ * take a reference on the current snapshot, safe from any thread;
+ * returns NULL before the first snapshot is published, which dr_init
+ * does. dr must still be alive: do not call this after dr_cleanup,
+ * though references taken before stay valid until released
+ * */
+struct dht_snapshot *
+dr_snapshot_get (struct dht_router *dr)
+{
+  struct dht_snapshot *dsn;
+
+  DHT_ATOMIC_INC (&dr->m_snapreaders);
+  dsn = DHT_ATOMIC_GETPTR (&dr->m_snapshot);
+  if (dsn != NULL)
+    dsn_acquire (dsn);
+  DHT_ATOMIC_DEC (&dr->m_snapreaders);
+
+  return dsn;
+}
+
+void
+dr_snapshot_release (struct dht_snapshot *dsn)
+{
+  dsn_release (dsn);
+}
+
+/* 
+ * network thread only, swap in a fresh snapshot if the tables changed
+ * and drop our references on replaced ones once no reader can still be
+ * between loading the old pointer and taking its reference
+ * */
+void
+dr_snapshot_publish (struct dht_router *dr)
+{
+  struct dht_snapshot *dsn;
+
+  if (dr->m_snapdirty)
+    {
+      dsn = DHT_ATOMIC_XCHGPTR (&dr->m_snapshot, dsn_init (dr));
+      dsn->m_next = dr->m_retired;
+      dr->m_retired = dsn;
+      dr->m_snapdirty = 0;
+    }
+
+  if (DHT_ATOMIC_GET (&dr->m_snapreaders) != 0)
+    return;
+
+  while ((dsn = dr->m_retired) != NULL)
+    {
+      dr->m_retired = dsn->m_next;
+      dsn_release (dsn);
+    }
+}
+
+static void
+dr_timer_swap (struct dht_router *dr, int i, int j)
+{
+  struct timer *tm;
+
+  tm = dr->m_timers[i];
+  dr->m_timers[i] = dr->m_timers[j];
+  dr->m_timers[j] = tm;
+
+  dr->m_timers[i]->m_index = i;
+  dr->m_timers[j]->m_index = j;
+}
+
+static void
+dr_timer_up (struct dht_router *dr, int i)
+{
+  while (i > 0
+	 && timercmp (dr->m_timers[(i - 1) / 2]->at, dr->m_timers[i]->at, >))
+    {
+      dr_timer_swap (dr, i, (i - 1) / 2);
+      i = (i - 1) / 2;
+    }
+}
+
+static void
+dr_timer_down (struct dht_router *dr, int i)
+{
+  int child;
+
+  while ((child = 2 * i + 1) < dr->m_numtimers)
+    {
+      if (child + 1 < dr->m_numtimers
+	  && timercmp (dr->m_timers[child]->at,
+		       dr->m_timers[child + 1]->at, >))
+	child++;
+
+      if (!timercmp (dr->m_timers[i]->at, dr->m_timers[child]->at, >))
+	break;
+
+      dr_timer_swap (dr, i, child);
+      i = child;
+    }
+}
+
+/* 
+ * call cb after msec, and again every msec for as long as it
+ * returns non-zero
+ * */
 struct timer *
 dr_timer_add (struct dht_router *dr, int msec, dht_source cb, void *arg)
 {
   struct timer *timer;
-  struct timeval now[1], add[1];
+  struct timer **timers;
+  struct timeval now[1];
+
+  if (dr->m_numtimers == dr->m_maxtimers)
+    {
+      timers = realloc (dr->m_timers, (dr->m_maxtimers * 2 + 16)
+			* sizeof (struct timer *));
+      if (timers == NULL)
+	{
+	  ttdht_err ("Memory error.\n");
+	  return NULL;
+	}
+      dr->m_timers = timers;
+      dr->m_maxtimers = dr->m_maxtimers * 2 + 16;
+    }
 
   timer = calloc (1, sizeof (struct timer));
   if (timer == NULL)
@@ -999,23 +1800,71 @@ dr_timer_add (struct dht_router *dr, int msec, dht_source cb, void *arg)
       return NULL;
     }
 
-  gettimeofday (now, NULL);
+  dr_gettime (dr, now);
 
-  add->tv_sec = msec / 1000;
-  add->tv_usec = (msec % 1000) * 1000;
-  timeradd (now, add, timer->at);
+  timer->interval->tv_sec = msec / 1000;
+  timer->interval->tv_usec = (msec % 1000) * 1000;
+  timeradd (now, timer->interval, timer->at);
 
   timer->cb = cb;
   timer->arg = arg;
 
-  LIST_INSERT_HEAD (dr->timer_list, timer, entries);
+  timer->m_index = dr->m_numtimers++;
+  dr->m_timers[timer->m_index] = timer;
+  dr_timer_up (dr, timer->m_index);
 
   return timer;
 }
 
+/* 
+ * move a pending timer to msec from now, later runs keep that interval
+ * */
+void
+dr_timer_reset (struct dht_router *dr, struct timer *timer, int msec)
+{
+  struct timeval now[1];
+
+  dr_gettime (dr, now);
+
+  timer->interval->tv_sec = msec / 1000;
+  timer->interval->tv_usec = (msec % 1000) * 1000;
+  timeradd (now, timer->interval, timer->at);
+
+  dr_timer_up (dr, timer->m_index);
+  dr_timer_down (dr, timer->m_index);
+}
+
 void
 dr_timer_remove (struct dht_router *dr, struct timer *timer)
 {
-  LIST_REMOVE (timer, entries);
+  int i;
+
+  i = timer->m_index;
+  if (i != --dr->m_numtimers)
+    {
+      dr_timer_swap (dr, i, dr->m_numtimers);
+      dr_timer_up (dr, i);
+      dr_timer_down (dr, i);
+    }
+
   free (timer);
 }
+
+/* 
+ * msec until the earliest timer is due, -1 if there is none
+ * */
+int
+dr_timer_next (struct dht_router *dr, const struct timeval *now)
+{
+  struct timer *tm;
+  long msec;
+
+  if (dr->m_numtimers == 0)
+    return -1;
+
+  tm = dr->m_timers[0];
+  msec = (tm->at->tv_sec - now->tv_sec) * 1000
+    + (tm->at->tv_usec - now->tv_usec + 999) / 1000;
+
+  return msec > 0 ? msec : 0;
+}
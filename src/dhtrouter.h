@@ -30,6 +30,7 @@
 
 #include "dhtnode.h"
 #include "dhtserver.h"
+#include "dhtsnap.h"
 
 #include <limits.h>
 #ifndef PATH_MAX
@@ -46,6 +47,38 @@
 #define DR_TIMEOUT_REMOVE_NODE      (4 * 60 * 60)
 #define DR_TIMEOUT_PEER_ANNOUNCE    (30 * 60)
 
+/* 
+ * longest read wait in msec when the io can not be woken up
+ * */
+#define DR_TIMEOUT_POLL             100
+
+#define DR_NUM_ACTIONS              1024
+#define DR_NUM_READS                64
+#define DR_NUM_SENDS                128
+#define DR_SIZE_PACKET              1500
+
+/* 
+ * send classes, dr_flush writes a class only when every class before
+ * it is empty
+ * */
+#define DR_PRI_REPLY                0
+#define DR_PRI_USER                 1
+#define DR_PRI_MAINT                2
+#define DR_NUM_PRIS                 3
+
+#define DR_NUM_QUEUED(dr)           (DR_NUM_SENDS - (dr)->m_numsendbufs)
+#define DR_IS_PACED(dr)             ((dr)->m_pacing)
+
+/* 
+ * msec worth of traffic the pacer lets out at once after idling
+ * */
+#define DR_PACE_BURST               250
+
+/* 
+ * longest wait in msec while sends are held back by a full socket
+ * */
+#define DR_TIMEOUT_SEND             10
+
 #define DR_NUM_BOOTSTRAP_COMPLETE   32
 #define DR_NUM_BOOTSTRAP_CONTACTS   64
 
@@ -54,18 +87,24 @@
 
 /* 
  * timer callback function
- * return 0 if the function should be removed, other wise keep
+ * return 0 if the function should be removed, other wise it runs again
+ * after the same interval
  * */
 typedef int (*dht_source) (void *);
 
 #define DHT_SOURCE(f)   (int (*) (void *)) f
 
+/* 
+ * timers live in a binary min-heap on their deadline, m_index is the
+ * slot in dr->m_timers so cancelling does not search
+ * */
 struct timer
 {
   struct timeval at[1];
+  struct timeval interval[1];
   dht_source cb;
   void *arg;
-    LIST_ENTRY (timer) entries;
+  int m_index;
 };
 
 struct dht_action
@@ -79,19 +118,88 @@ struct dht_action
   int actport;
   void (*actcb) (const char *, const char *, void *);
   void *actarg;
-    LIST_ENTRY (dht_action) entries;
 };
 
 enum
 { DHT_ACTION_NONE = 0, DHT_ACTION_PUB, DHT_ACTION_SEARCH };
 
+/* 
+ * one datagram of a batch read or write, buf and size are set up by the
+ * router, read_batch fills in len, addr and addrlen
+ * */
+struct dht_packet
+{
+  char *buf;
+  size_t size;
+  ssize_t len;
+  struct dht_addr addr;
+  socklen_t addrlen;
+
+  /* 
+   * transaction of a queued query, handed to ds_sent when the datagram
+   * leaves the send queue; NULL for anything else
+   * */
+  void *tag;
+};
+
+/* 
+ * read stores the source address in the sockaddr buffer, the socklen_t
+ * holds its size on input and the address length on output, addresses
+ * may be IPv4, IPv6 or IPv4-mapped IPv6; the last argument is the
+ * longest wait in msec, -1 blocks until a packet or a wakeup arrives
+ *
+ * wakeup is optional, it may be called from any thread and must make a
+ * pending read return at once
+ *
+ * read_batch is optional, it receives up to the given number of
+ * packets with one wait of at most msec like read and returns how many
+ * it filled, or -1 if none were ready
+ *
+ * write_batch is optional, it sends the packets in order and returns how
+ * many went out, or -1 with errno set for the first one
+ *
+ * gettime is optional, it fills in the current time the router runs
+ * its timers and ages on, a monotonic clock by default; a simulation
+ * or a replay passes a virtual clock it advances itself, and the time
+ * must never go back
+ * */
 typedef struct
 {
   void *fdp;
-  ssize_t (*read) (void *, char *, size_t, struct sockaddr_in *, int);
-  ssize_t (*write) (void *, const char *, size_t, struct sockaddr_in *);
+  ssize_t (*read) (void *, char *, size_t, struct sockaddr *, socklen_t *,
+		   int);
+  ssize_t (*write) (void *, const char *, size_t, const struct sockaddr *,
+		    socklen_t);
+  void (*wakeup) (void *);
+  int (*read_batch) (void *, struct dht_packet *, int, int);
+  int (*write_batch) (void *, struct dht_packet *, int);
+  void (*gettime) (void *, struct timeval *);
 } dhtio_t;
 
+#define DR_TABLE_V4                 0
+#define DR_TABLE_V6                 1
+#define DR_NUM_TABLES               2
+
+#define DR_TABLE(dr, af)            (&(dr)->m_tables[(af) == AF_INET6 ? DR_TABLE_V6 : DR_TABLE_V4])
+#define DR_NUM_NODES(dr)            (MAP_SIZE (&(dr)->m_tables[DR_TABLE_V4].m_nodes) + MAP_SIZE (&(dr)->m_tables[DR_TABLE_V6].m_nodes))
+
+/* 
+ * one routing table per address family
+ * */
+struct dht_table
+{
+  int af;
+
+  /* 
+   * root of the prefix trie and the leaf our own id falls into
+   * */
+  struct dht_bucket *m_root;
+  struct dht_bucket *m_bucket;
+  int m_numbuckets;
+
+  struct map m_nodes;
+};
+
 struct dht_router
 {
   struct dht_node *node;
@@ -102,8 +210,7 @@ struct dht_router
 
   struct timer *boot_timer;
 
-  struct map m_nodes;
-  struct map m_buckets;
+  struct dht_table m_tables[DR_NUM_TABLES];
   struct map m_trackers;
   struct map m_contacts;
 
@@ -113,17 +220,85 @@ struct dht_router
   int m_curtoken;
   int m_prevtoken;
 
-    LIST_HEAD (timer_list, timer) timer_list[1];
-    LIST_HEAD (action_list, dht_action) action_list[1];
+  /* 
+   * number of levels next to our own leaf with extended buckets
+   * */
+  int m_extend;
+
+  /* 
+   * the published table snapshot, readers currently fetching it and
+   * replaced snapshots waiting for those readers to leave
+   * */
+  struct dht_snapshot *volatile m_snapshot;
+  volatile long m_snapreaders;
+  struct dht_snapshot *m_retired;
+  int m_snapdirty;
+
+  struct timer **m_timers;
+  int m_numtimers;
+  int m_maxtimers;
+
+  /* 
+   * actions queued by any thread, m_wakepending is set while a wakeup
+   * is on its way to dr_run
+   * */
+  struct ring *m_actions;
+  volatile long m_wakepending;
+
+  struct dht_pools m_pools;
 
   void *m_fdp;
-  ssize_t (*read) (void *, char *, size_t, struct sockaddr_in *, int);
-  ssize_t (*write) (void *, const char *, size_t, struct sockaddr_in *);
+  ssize_t (*read) (void *, char *, size_t, struct sockaddr *, socklen_t *,
+		   int);
+  ssize_t (*write) (void *, const char *, size_t, const struct sockaddr *,
+		    socklen_t);
+  void (*wakeup) (void *);
+  int (*read_batch) (void *, struct dht_packet *, int, int);
+  int (*write_batch) (void *, struct dht_packet *, int);
+  void (*gettime) (void *, struct timeval *);
+
+  /* 
+   * the clock sampled by dr_update_time at the start of each iteration,
+   * and the offset from the monotonic clock to the system time when the
+   * router started
+   * */
+  struct timeval m_now[1];
+  struct timeval m_clockbase[1];
+  int m_clockid;
+
+  /* 
+   * receive buffers handed to read, DR_NUM_READS of DR_SIZE_PACKET
+   * bytes each
+   * */
+  struct dht_packet *m_packets;
+
+  /* 
+   * datagrams encoded during one iteration, one queue per send class
+   * sharing DR_NUM_SENDS buffers, written out by dr_flush; m_senddrops
+   * counts the ones lost to a full queue or a send error
+   * */
+  struct dht_packet *m_sends[DR_NUM_PRIS];
+  int m_numsends[DR_NUM_PRIS];
+  char **m_sendbufs;
+  int m_numsendbufs;
+  unsigned int m_senddrops;
+
+  /* 
+   * outbound pacer, a zero rate does not limit; m_pacing is set while
+   * the pacer holds queued datagrams back and m_senddefers counts the
+   * datagrams queued behind it
+   * */
+  volatile long m_ratebytes;
+  volatile long m_ratepackets;
+  struct tbucket m_pacebytes;
+  struct tbucket m_pacepackets;
+  int m_pacing;
+  unsigned int m_senddefers;
 
   /* 
    * 0 means running, !0 means quit 
    * */
-  int quit;
+  volatile long quit;
 };
 
 struct dht_router *dr_init (struct dht_object *, int, dhtio_t *);
@@ -134,54 +309,89 @@ int dr_start (struct dht_router *, int);
 
 void dr_stop (struct dht_router *);
 
+void dr_wakeup (struct dht_router *);
+
 int dr_run (struct dht_router *);
 
-void dr_pub (struct dht_router *, const char *, unsigned short);
-void dr_get (struct dht_router *, const char *,
-	     void (*)(const char *, const char *, void *), void *);
+void dr_update_time (struct dht_router *);
+
+void dr_gettime (struct dht_router *, struct timeval *);
+
+time_t dr_time (struct dht_router *);
+
+unsigned int dr_msec (struct dht_router *);
+
+int dr_next_timeout (struct dht_router *);
+
+int dr_process_once (struct dht_router *, int);
+
+int dr_send (struct dht_router *, const char *, size_t,
+	     const struct dht_addr *, int, void *);
+void dr_send_cancel (struct dht_router *, void *);
+int dr_flush (struct dht_router *);
+void dr_set_rate (struct dht_router *, unsigned int, unsigned int);
+
+int dr_pub (struct dht_router *, const char *, unsigned short);
+int dr_get (struct dht_router *, const char *,
+	    void (*)(const char *, const char *, void *), void *);
 void dr_announce (struct dht_router *, const char *, void *);
 void dr_cancel_announce (struct dht_router *, const char *,
 			 struct dht_tracker *);
 
 struct dht_tracker *dr_get_tracker (struct dht_router *, const char *, int);
 
-int dr_want_node (struct dht_router *, const char *);
-struct dht_node *dr_get_node (struct dht_router *, const char *);
+int dr_want_node (struct dht_router *, struct dht_table *, const char *);
+struct dht_node *dr_get_node (struct dht_router *, struct dht_table *,
+			      const char *);
 
 void dr_add_contact (struct dht_router *, const char *, int);
-void dr_contact (struct dht_router *, struct sockaddr_in *, int);
-struct dht_node *dr_find_node (struct dht_router *,
-			       const struct sockaddr_in *);
+void dr_contact (struct dht_router *, struct dht_addr *, int);
+struct dht_node *dr_find_node (struct dht_router *, const struct dht_addr *);
 
 struct dht_node *dr_node_queried (struct dht_router *, const char *,
-				  struct sockaddr_in *);
+				  struct dht_addr *);
 struct dht_node *dr_node_replied (struct dht_router *, const char *,
-				  const struct sockaddr_in *);
+				  const struct dht_addr *);
 struct dht_node *dr_node_inactive (struct dht_router *, const char *,
-				   const struct sockaddr_in *);
+				   const struct dht_addr *);
 void dr_node_invalid (struct dht_router *, const char *);
 
-char *dr_store_closest_nodes (struct dht_router *, const char *, char *,
-			      char *);
+char *dr_store_closest_nodes (struct dht_router *, struct dht_table *,
+			      const char *, char *, char *);
 struct dht_object *dr_store_cache (struct dht_router *, struct dht_object *);
 
-char *dr_generate_token (struct dht_router *, const struct sockaddr_in *,
+char *dr_generate_token (struct dht_router *, const struct dht_addr *,
 			 int, char *);
-char *dr_make_token (struct dht_router *, const struct sockaddr_in *, char *);
+char *dr_make_token (struct dht_router *, const struct dht_addr *, char *);
 int dr_token_valid (struct dht_router *, const char *,
-		    const struct sockaddr_in *);
+		    const struct dht_addr *);
 
-struct map_node *dr_find_bucket (struct dht_router *, const char *);
-int dr_add_node_to_bucket (struct dht_router *, struct dht_node *);
-void dr_delete_node (struct dht_router *, struct map_node *);
-struct map_node *dr_split_bucket (struct dht_router *, struct map_node *,
-				  struct dht_node *);
+void dr_extend_buckets (struct dht_router *, int);
+
+struct dht_bucket *dr_find_bucket (struct dht_router *, struct dht_table *,
+				   const char *);
+int dr_add_node_to_bucket (struct dht_router *, struct dht_table *,
+			   struct dht_node *);
+void dr_delete_node (struct dht_router *, struct dht_table *,
+		     struct map_node *);
+struct dht_bucket *dr_split_bucket (struct dht_router *, struct dht_table *,
+				    struct dht_bucket *);
 
 void dr_bootstrap (struct dht_router *);
-void dr_bootstrap_bucket (struct dht_router *, struct dht_bucket *);
+void dr_bootstrap_table (struct dht_router *, struct dht_table *);
+void dr_bootstrap_bucket (struct dht_router *, struct dht_table *,
+			  struct dht_bucket *);
+
+struct dht_snapshot *dr_snapshot_get (struct dht_router *);
+void dr_snapshot_release (struct dht_snapshot *);
+void dr_snapshot_publish (struct dht_router *);
 
 struct timer *dr_timer_add (struct dht_router *, int, dht_source, void *);
 
+void dr_timer_reset (struct dht_router *, struct timer *, int);
+
 void dr_timer_remove (struct dht_router *, struct timer *);
 
+int dr_timer_next (struct dht_router *, const struct timeval *);
+
 #endif
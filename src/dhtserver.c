@@ -39,7 +39,12 @@
 
 #define PEER_VERSION "LT\x0C\x20"
 
-#define HOST_MAX_IP          (ntohl (inet_addr ("239.255.255.255")))
+/* 
+ * address families requested by the "want" argument of BEP 32
+ * */
+#define DS_WANT_N4           1
+#define DS_WANT_N6           2
+#define DS_WANT(af)          ((af) == AF_INET6 ? DS_WANT_N6 : DS_WANT_N4)
 
 static char *queries[] = {
   "ping",
@@ -50,70 +55,88 @@ static char *queries[] = {
 
 extern char zero_id[];
 
-static int ds_ontimer (struct dht_server *);
+static int ds_trans_timeout (struct dht_ttype_trans_t *);
+static int ds_rto (struct dht_server *, struct dht_trans *);
 
-static void ds_write (struct dht_server *, struct sockaddr_in *,
-		      struct dht_object *);
+static int ds_write (struct dht_server *, struct dht_addr *, int,
+		     struct dht_object *, void *);
 
 static int ds_encode_buf (struct dht_server *, struct dht_object *, char *,
 			  int);
 
-static struct dht_ttype_trans_t *ds_map_lower_bound (struct dht_server *,
-						     dht_trans_key_type);
-static struct dht_ttype_trans_t *ds_map_find (struct dht_server *,
-					      dht_trans_key_type);
+static struct dht_trans_dest *ds_find_dest (struct dht_server *,
+					    const struct dht_addr *);
+static struct dht_ttype_trans_t *ds_find_trans (struct dht_server *,
+						const struct dht_addr *,
+						unsigned int);
+static void ds_remove_trans (struct dht_server *, struct dht_ttype_trans_t *);
+static int ds_send_trans (struct dht_server *, struct dht_ttype_trans_t *);
+static void ds_free_trans (struct dht_server *, struct dht_ttype_trans_t *);
+static int ds_parse_tid (struct dht_server *, const struct dht_addr *,
+			 const struct string *, unsigned int *);
 
 static void ds_reset_statistics (struct dht_server *);
 
 static int ds_obj_valid (struct dht_server *, struct dht_object *);
 
 static void ds_process_query (struct dht_server *, struct dht_object *,
-			      const char *, struct sockaddr_in *sa,
-			      struct dht_object *);
-static void ds_process_response (struct dht_server *, int, const char *,
-				 struct sockaddr_in *, struct dht_object *);
-static void ds_process_error (struct dht_server *, int, struct sockaddr_in *,
+			      const char *, struct dht_addr *sa,
 			      struct dht_object *);
+static void ds_process_response (struct dht_server *, unsigned int,
+				 const char *, struct dht_addr *,
+				 struct dht_object *);
+static void ds_process_error (struct dht_server *, unsigned int,
+			      struct dht_addr *, struct dht_object *);
+
+static int ds_parse_want (struct dht_object *, struct dht_addr *);
 
 static void ds_parse_find_node_reply (struct dht_server *, struct dht_trans *,
-				      struct string *);
+				      struct string *, int);
 static void ds_parse_find_node_reply2 (struct dht_server *,
 				       struct dht_trans *, struct list *);
 static void ds_parse_get_peers_reply (struct dht_server *, struct dht_trans *,
 				      struct dht_object *);
 
+static void ds_add_search_contact (struct dht_server *, struct dht_search *,
+				   const char *, struct dht_addr *);
+
 static void ds_find_node_next (struct dht_server *, struct dht_trans *);
 
-static void ds_create_query (struct dht_server *, struct dht_trans *, int,
-			     struct sockaddr_in *, int);
+static int ds_create_query (struct dht_server *,
+			    struct dht_ttype_trans_t *);
+static void ds_send_query (struct dht_server *, struct dht_ttype_trans_t *);
 static void ds_create_response (struct dht_server *, struct dht_object *,
-				struct sockaddr_in *, struct dht_object *);
+				struct dht_addr *, struct dht_object *);
+
+static int ds_store_nodes (struct dht_server *, const char *, int,
+			   struct dht_object *);
 
 static void ds_create_find_node_response (struct dht_server *,
-					  struct dht_object *,
+					  struct dht_object *, int,
 					  struct dht_object *);
 static void ds_create_get_peers_response (struct dht_server *,
 					  struct dht_object *,
-					  struct sockaddr_in *,
+					  struct dht_addr *, int,
 					  struct dht_object *);
 static void ds_create_announce_peer_response (struct dht_server *,
 					      struct dht_object *,
-					      struct sockaddr_in *,
+					      struct dht_addr *,
 					      struct dht_object *);
 
 static int ds_add_trans (struct dht_server *, struct dht_trans *, int);
 
-static struct dht_ttype_trans_t *ds_failed_transaction (struct dht_server *,
-							struct
-							dht_ttype_trans_t *,
-							int);
+static void ds_failed_transaction (struct dht_server *,
+				   struct dht_ttype_trans_t *, int);
 
 static void ds_clear_trans (struct dht_server *);
 
+static int ds_elapsed_ms (struct dht_server *, const struct timeval *);
+
 struct dht_server *
 ds_init (struct dht_router *dr)
 {
   struct dht_server *ds;
+  int i;
 
   ds = (struct dht_server *) calloc (1, sizeof (struct dht_server));
   assert (ds);
@@ -126,6 +149,17 @@ ds_init (struct dht_router *dr)
 
   LIST_INIT (&ds->node_info_list);
   LIST_INIT (&ds->m_trans);
+  SIMPLEQ_INIT (&ds->m_admit);
+  ht_init (&ds->m_transidx, DS_TRANS_SLOTS);
+  ht_init (&ds->m_dests, DS_TRANS_SLOTS);
+  ds->m_transkey = rand ();
+  ds->m_tidnext = (unsigned short) rand ();
+  ds->m_tidkey = rand ();
+
+  ds->m_limitkey = rand ();
+  for (i = 0; i < DS_NUM_QUERIES; i++)
+    ds->m_qrate[i] = DS_QUERY_RATE;
+  ds->m_qrate[DS_QUERY_ANNOUNCE_PEER] = DS_ANNOUNCE_RATE;
 
   return ds;
 }
@@ -133,7 +167,20 @@ ds_init (struct dht_router *dr)
 void
 ds_cleanup (struct dht_server *ds)
 {
+  unsigned int *qd;
+
+  qd = ds->m_querydrops;
+  if (qd[DS_QUERY_PING] + qd[DS_QUERY_FIND_NODE] + qd[DS_QUERY_GET_PEERS] +
+      qd[DS_QUERY_ANNOUNCE_PEER] + qd[DS_QUERY_OTHER] > 0)
+    ttdht_info ("rate limited queries dropped: %u ping, %u find_node, "
+		"%u get_peers, %u announce_peer, %u other\n",
+		qd[DS_QUERY_PING], qd[DS_QUERY_FIND_NODE],
+		qd[DS_QUERY_GET_PEERS], qd[DS_QUERY_ANNOUNCE_PEER],
+		qd[DS_QUERY_OTHER]);
+
   ds_stop (ds);
+  ht_cleanup (&ds->m_transidx);
+  ht_cleanup (&ds->m_dests);
   free (ds);
 }
 
@@ -151,9 +198,6 @@ ds_start (struct dht_server *ds, unsigned short port)
 
   ds->port = port;
 
-  ds->timer =
-    dr_timer_add (ds->m_router, 3 * 1000, DHT_SOURCE (ds_ontimer), ds);
-
   return 0;
 }
 
@@ -163,22 +207,131 @@ ds_stop (struct dht_server *ds)
   if (!DR_IS_ACTIVE (ds->m_router))
     return;
 
-  if (ds->timer != NULL)
+  ds->m_networkup = 0;
+
+  ds_clear_trans (ds);
+}
+
+/* 
+ * limit queries of type to rate per second from every host, 0 lifts
+ * the limit; may be called from any thread
+ * */
+void
+ds_set_query_limit (struct dht_server *ds, int type, unsigned int rate)
+{
+  if (type >= 0 && type < DS_NUM_QUERIES)
+    DHT_ATOMIC_SET (&ds->m_qrate[type], rate);
+}
+
+/* 
+ * the query method of a raw message without decoding it, the "q" key
+ * holds one of the known names
+ * return -1 if the message is not a query
+ * */
+static int
+ds_query_type (const char *buf, int siz)
+{
+  static const char *names[] = { "4:ping", "9:find_node", "9:get_peers",
+    "13:announce_peer"
+  };
+  const char *cp, *end;
+  int i, len, isquery;
+
+  end = buf + siz;
+  isquery = 0;
+  for (cp = buf; cp + 6 <= end; cp++)
     {
-      dr_timer_remove (ds->m_router, ds->timer);
-      ds->timer = NULL;
+      if (memcmp (cp, "1:y1:q", 6) == 0)
+	{
+	  isquery = 1;
+	  break;
+	}
     }
+  if (!isquery)
+    return -1;
 
-  ds->m_networkup = 0;
+  for (cp = buf; cp + 3 <= end; cp++)
+    {
+      if (memcmp (cp, "1:q", 3) != 0)
+	continue;
 
-  ds_clear_trans (ds);
+      for (i = 0; i < DS_QUERY_OTHER; i++)
+	{
+	  len = strlen (names[i]);
+	  if (cp + 3 + len <= end && memcmp (cp + 3, names[i], len) == 0)
+	    return i;
+	}
+    }
+
+  return DS_QUERY_OTHER;
+}
+
+/* 
+ * charge a query to its sender, IPv6 hosts are counted by their /64
+ * return -1 if it is over the limit and must be dropped
+ * */
+static int
+ds_limit (struct dht_server *ds, struct dht_addr *sa, const char *buf,
+	  int siz)
+{
+  struct tbucket *b1, *b2;
+  unsigned char key[9];
+  unsigned int rate, burst, now, h, t1, t2;
+  int type, len;
+
+  type = ds_query_type (buf, siz);
+  if (type < 0)
+    return 0;
+
+  rate = DHT_ATOMIC_GET (&ds->m_qrate[type]);
+  if (rate == 0)
+    return 0;
+
+  if (DA_IS_V6 (sa))
+    {
+      memcpy (key, &sa->sin6.sin6_addr, 8);
+      len = 8;
+    }
+  else
+    {
+      memcpy (key, &sa->sin.sin_addr, 4);
+      len = 4;
+    }
+  key[len++] = (unsigned char) type;
+
+  h = hash_bytes (key, len, ds->m_limitkey);
+  b1 = &ds->m_limits[h & (DS_NUM_LIMITS - 1)];
+  b2 = &ds->m_limits[(h >> 16) & (DS_NUM_LIMITS - 1)];
+
+  burst = rate * DS_LIMIT_BURST;
+  now = dr_msec (ds->m_router);
+
+  /* 
+   * a host is only held back when both of its buckets are empty, so
+   * sharing one with a busy host does not silence it
+   * */
+  t1 = tb_refill (b1, rate, burst, now);
+  t2 = tb_refill (b2, rate, burst, now);
+  if (t1 == 0 && t2 == 0)
+    {
+      ds->m_querydrops[type]++;
+      return -1;
+    }
+
+  if (t1 > 0)
+    b1->tokens -= 1;
+  if (t2 > 0)
+    b2->tokens -= 1;
+
+  return 0;
 }
 
 int
-ds_process (struct dht_server *ds, struct sockaddr_in *rmt, char *buf,
+ds_process (struct dht_server *ds, struct dht_addr *rmt, char *buf,
 	    int siz)
 {
   struct dht_object *obj, *transid, *newtransid;
+  unsigned int tid;
   int type = '?';
   char *nodeid = NULL, *cp;
   struct string str, *tpo;
@@ -188,6 +341,11 @@ ds_process (struct dht_server *ds, struct sockaddr_in *rmt, char *buf,
       return 0;
     }
 
+  if (ds_limit (ds, rmt, buf, siz) < 0)
+    {
+      return 0;
+    }
+
   string_set2 (&str, buf, siz);
   obj = buf_to_object (&str);
   if (obj == NULL)
@@ -253,12 +411,13 @@ ds_process (struct dht_server *ds, struct sockaddr_in *rmt, char *buf,
       break;
 
     case 'r':
-      ds_process_response (ds, (unsigned char) tpo->data[0], nodeid, rmt,
-			   obj);
+      if (ds_parse_tid (ds, rmt, tpo, &tid) == 0)
+	ds_process_response (ds, tid, nodeid, rmt, obj);
       break;
 
     case 'e':
-      ds_process_error (ds, (unsigned char) tpo->data[0], rmt, obj);
+      if (ds_parse_tid (ds, rmt, tpo, &tid) == 0)
+	ds_process_error (ds, tid, rmt, obj);
       break;
 
     default:
@@ -279,41 +438,52 @@ ds_reset_statistics (struct dht_server *ds)
 }
 
 void
-ds_ping (struct dht_server *ds, const char *id, struct sockaddr_in *sa)
+ds_ping (struct dht_server *ds, const char *id, struct dht_addr *sa)
 {
-  struct dht_ttype_trans_t *dtt;
   struct dht_trans *dtr;
-  dht_trans_key_type rid;
-
-  rid = dtr_key (sa, 0);
-  dtt = ds_map_lower_bound (ds, rid);
 
-  if (dtt == NULL || !dtr_key_match (dtt->key, sa))
+  if (ds_find_dest (ds, sa) == NULL)
     {
-      dtr = dtr_init (-1, 30, id, sa);
+      dtr = dtr_init (&ds->m_router->m_pools, -1, 30, id, sa);
       dtr->type = DHT_PING;
-      ds_add_trans (ds, dtr, 0);
+      ds_add_trans (ds, dtr, DR_PRI_MAINT);
     }
 }
 
+/* 
+ * next contact a search may query; while the pacer holds sends back or
+ * transactions wait for admission a search keeps one query outstanding,
+ * so lookups slow down instead of timing out in the send queue and each
+ * of many lookups still gets its turn
+ * */
+static struct dht_node_search_t *
+ds_search_contact (struct dht_server *ds, struct dht_search *dsea)
+{
+  if ((DR_IS_PACED (ds->m_router) || ds->m_numwaiting > 0)
+      && dsea->m_pending > 0)
+    return NULL;
+
+  return dsea_get_contact (dsea);
+}
+
 void
-ds_find_node (struct dht_server *ds, struct dht_bucket *contacts,
+ds_find_node (struct dht_server *ds, int af, struct dht_bucket *contacts,
 	      const char *target)
 {
   struct dht_search *search;
   struct dht_node_search_t *ns;
 
-  search = dsea_init (target, contacts);
+  search = dsea_init (&ds->m_router->m_pools, target, af, contacts);
 
   if (search == NULL)
     return;
 
-  while ((ns = dsea_get_contact (search)) != NULL)
+  while ((ns = ds_search_contact (ds, search)) != NULL)
     {
       struct dht_trans *dts;
       dts = dts_init (4, 30, ns);
       dts->type = DHT_FIND_NODE;
-      ds_add_trans (ds, dts, 0);
+      ds_add_trans (ds, dts, DR_PRI_MAINT);
     }
 
   if (!DSEA_START (search))
@@ -325,69 +495,102 @@ ds_announce (struct dht_server *ds, const char *key, unsigned short port,
 	     int ispub, void (*cb) (const char *, const char *, void *),
 	     void *arg)
 {
-  struct map_node *mn;
   struct dht_node_search_t *ns;
   struct dht_trans *dts;
   struct dht_search *announce;
+  struct dht_table *tb;
   char info[HASH_STRING_LEN + 1];
+  int i;
 
   hashsg_init (key, (int) strlen (key), info);
 
-  mn = dr_find_bucket (ds->m_router, info);
-  if (mn == NULL)
+  /* 
+   * every address family runs its own lookup
+   * */
+  for (i = 0; i < DR_NUM_TABLES; i++)
     {
-      ttdht_debug ("No buckets\n");
-      return;
-    }
+      tb = &ds->m_router->m_tables[i];
+      if (MAP_EMPTY (&tb->m_nodes))
+	continue;
 
-  announce = dann_init (key, info, (struct dht_bucket *) mn->value, cb, arg);
-  if (announce == NULL)
-    {
-      ttdht_debug ("create announce failed.\n");
-      return;
-    }
+      announce = dann_init (&ds->m_router->m_pools, key, info, tb->af,
+			    dr_find_bucket (ds->m_router, tb, info), cb, arg);
+      if (announce == NULL)
+	{
+	  ttdht_debug ("create announce failed.\n");
+	  continue;
+	}
 
-  announce->is_pub = ispub;
-  announce->m_port = port;
+      announce->is_pub = ispub;
+      announce->m_port = port;
 
-  while ((ns = dsea_get_contact (announce)) != NULL)
-    {
-      dts = dts_init (4, 30, ns);
-      dts->type = DHT_FIND_NODE;
-      ds_add_trans (ds, dts, 0);
-    }
+      while ((ns = ds_search_contact (ds, announce)) != NULL)
+	{
+	  dts = dts_init (4, 30, ns);
+	  dts->type = DHT_FIND_NODE;
+	  ds_add_trans (ds, dts, DR_PRI_USER);
+	}
 
-  if (!DSEA_START (announce))
-    {
-      dann_cleanup (announce);
+      if (!DSEA_START (announce))
+	{
+	  dann_cleanup (announce);
+	}
     }
 }
 
+static int
+ds_announce_match (struct dht_ttype_trans_t *dtt, const char *info,
+		   void *arg)
+{
+  struct dht_search *dsea;
+
+  dsea = dtt->trans->m_search;
+  if (dsea == NULL || dsea->is_anno != 1)
+    return 0;
+
+  return (info == NULL || hashsg_cmp (dsea->m_target, info) == 0)
+    && (arg == NULL || dsea->arg == arg);
+}
+
 void
 ds_cancel_announce (struct dht_server *ds, const char *info, void *arg)
 {
   struct dht_ttype_trans_t *dtt, *dtt2;
-
-  while ((dtt = LIST_FIRST (&ds->m_trans)) != NULL)
+  struct trans_queue waiting;
+
+  /* 
+   * waiting transactions go first, so none of the announce is sent
+   * when those in flight are removed below
+   * */
+  waiting = ds->m_admit;
+  if (SIMPLEQ_EMPTY (&waiting))
+    waiting.sqh_last = &waiting.sqh_first;
+  SIMPLEQ_INIT (&ds->m_admit);
+  ds->m_numwaiting = 0;
+
+  while ((dtt = SIMPLEQ_FIRST (&waiting)) != NULL)
     {
-      struct dht_search *dsea;
-
-      dsea = dtt->trans->m_search;
-      if (dsea && dsea->is_anno == 1)
+      SIMPLEQ_REMOVE_HEAD (&waiting, dtt, m_queue);
+      if (ds_announce_match (dtt, info, arg))
 	{
-	  if ((info == NULL || hashsg_cmp (dsea->m_target, info) == 0)
-	      && (arg == NULL || dsea->arg == arg))
-	    {
-	      dts_cleanup (dtt->trans);
-	      dtt2 = LIST_NEXT (dtt, entries);
-	      LIST_REMOVE (dtt, entries);
-	      free (dtt);
-	      dtt = dtt2;
-	      continue;
-	    }
+	  dts_cleanup (dtt->trans);
+	  ds_free_trans (ds, dtt);
+	}
+      else
+	{
+	  SIMPLEQ_INSERT_TAIL (&ds->m_admit, dtt, m_queue);
+	  ds->m_numwaiting++;
 	}
+    }
 
-      dtt = LIST_NEXT (dtt, entries);
+  for (dtt = LIST_FIRST (&ds->m_trans); dtt != NULL; dtt = dtt2)
+    {
+      dtt2 = LIST_NEXT (dtt, entries);
+      if (ds_announce_match (dtt, info, arg))
+	{
+	  dts_cleanup (dtt->trans);
+	  ds_remove_trans (ds, dtt);
+	}
     }
 }
 
@@ -399,7 +602,7 @@ ds_update (struct dht_server *ds)
 
 static void
 ds_process_query (struct dht_server *ds, struct dht_object *transid,
-		  const char *id, struct sockaddr_in *sa,
+		  const char *id, struct dht_addr *sa,
 		  struct dht_object *msg)
 {
   struct dht_object *arg, *reply;
@@ -430,9 +633,10 @@ ds_process_query (struct dht_server *ds, struct dht_object *transid,
   reply = obj_init (OBJ_TYPE_MAP);
 
   if (!strcmp (query, "find_node"))
-    ds_create_find_node_response (ds, arg, reply);
+    ds_create_find_node_response (ds, arg, ds_parse_want (arg, sa), reply);
   else if (!strcmp (query, "get_peers"))
-    ds_create_get_peers_response (ds, arg, sa, reply);
+    ds_create_get_peers_response (ds, arg, sa, ds_parse_want (arg, sa),
+				  reply);
   else if (!strcmp (query, "announce_peer"))
     ds_create_announce_peer_response (ds, arg, sa, reply);
   else if (strcmp (query, "ping"))
@@ -443,39 +647,111 @@ ds_process_query (struct dht_server *ds, struct dht_object *transid,
   ds_create_response (ds, transid, sa, reply);
 }
 
+/* 
+ * families of nodes a query asks for,
+ * the family of the querying node when it does not say
+ * */
+static int
+ds_parse_want (struct dht_object *arg, struct dht_addr *sa)
+{
+  struct list *want;
+  struct list_node *ln;
+  struct string str, *item;
+  int ret;
+
+  ret = 0;
+
+  string_set (&str, "want");
+  want = obj_get_key_list (arg, &str);
+  if (want != NULL)
+    {
+      LIST_FOREACH (ln, want, entries)
+      {
+	item = OBJ_AS_STRING ((struct dht_object *) ln->item);
+	if (item == NULL || item->len != 2)
+	  continue;
+
+	if (memcmp (item->data, "n4", 2) == 0)
+	  ret |= DS_WANT_N4;
+	else if (memcmp (item->data, "n6", 2) == 0)
+	  ret |= DS_WANT_N6;
+      }
+    }
+
+  if (ret == 0)
+    ret = DS_WANT (DA_FAMILY (sa));
+
+  return ret;
+}
+
+/* 
+ * store "nodes" and "nodes6" closest to target into reply,
+ * return the number of nodes stored
+ * */
+static int
+ds_store_nodes (struct dht_server *ds, const char *target, int want,
+		struct dht_object *reply)
+{
+  char compact[sizeof (struct compact_node6_info) * DB_NUM_NODES];
+  static const char *key[DR_NUM_TABLES] = { "nodes", "nodes6" };
+  struct dht_table *tb;
+  struct string str, str2;
+  char *end;
+  int i, ret;
+
+  ret = 0;
+  for (i = 0; i < DR_NUM_TABLES; i++)
+    {
+      tb = &ds->m_router->m_tables[i];
+      if (!(want & DS_WANT (tb->af)))
+	continue;
+
+      end = dr_store_closest_nodes (ds->m_router, tb, target, compact,
+				    compact + DA_NODE_LEN (tb->af)
+				    * DB_NUM_NODES);
+      if (end == compact)
+	continue;
+
+      string_set (&str, key[i]);
+      string_set2 (&str2, compact, end - compact);
+      obj_insert_key_string (reply, &str, &str2);
+
+      ret += (end - compact) / DA_NODE_LEN (tb->af);
+    }
+
+  return ret;
+}
+
 static void
 ds_create_find_node_response (struct dht_server *ds, struct dht_object *arg,
-			      struct dht_object *reply)
+			      int want, struct dht_object *reply)
 {
-  char compact[sizeof (struct compact_node_info) * DB_NUM_NODES];
-  char *end;
-  struct string str, str2, *tpo;
+  struct string str, *tpo;
 
   string_set (&str, "target");
   tpo = obj_get_key_string (arg, &str);
-  end =
-    dr_store_closest_nodes (ds->m_router, tpo->data, compact,
-			    compact + sizeof (compact));
-
-  if (end == compact)
+  if (tpo == NULL)
     {
-      ttdht_debug ("No nodes.\n");
+      ttdht_debug ("No target.\n");
       return;
     }
 
-  string_set (&str, "nodes");
-  string_set2 (&str2, compact, end - compact);
-  obj_insert_key_string (reply, &str, &str2);
+  if (ds_store_nodes (ds, tpo->data, want, reply) == 0)
+    {
+      ttdht_debug ("No nodes.\n");
+    }
 }
 
 static void
 ds_create_get_peers_response (struct dht_server *ds, struct dht_object *arg,
-			      struct sockaddr_in *sa,
+			      struct dht_addr *sa, int want,
 			      struct dht_object *reply)
 {
   char key[HASH_STRING_LEN * 2];
   struct dht_tracker *tracker;
+  struct dht_object *values;
   struct string str, str2, *info;
+  int n;
 
   dr_make_token (ds->m_router, sa, key);
 
@@ -485,45 +761,48 @@ ds_create_get_peers_response (struct dht_server *ds, struct dht_object *arg,
 
   string_set (&str, "info_hash");
   info = obj_get_key_string (arg, &str);
+  if (info == NULL)
+    {
+      ttdht_debug ("No info_hash.\n");
+      return;
+    }
 
   tracker = dr_get_tracker (ds->m_router, info->data, 0);
 
-  if (!tracker || DTK_EMPTY (tracker))
+  n = 0;
+  if (tracker && !DTK_EMPTY (tracker))
     {
-      char compact[sizeof (struct compact_node_info) * DB_NUM_NODES];
-      char *end = dr_store_closest_nodes (ds->m_router, info->data, compact,
-					  compact + sizeof (compact));
+      values = obj_init (OBJ_TYPE_LIST);
+      if (want & DS_WANT_N4)
+	n += dt_get_peers (tracker, AF_INET, DTK_MAX_PEERS, values);
+      if (want & DS_WANT_N6)
+	n += dt_get_peers (tracker, AF_INET6, DTK_MAX_PEERS, values);
 
-      if (end == compact)
+      if (n > 0)
 	{
-	  ttdht_debug ("No peers nor nodes.\n");
-	  return;
+	  string_set (&str, "values");
+	  obj_insert_key_object (reply, &str, values);
+	}
+      else
+	{
+	  obj_cleanup (values);
 	}
-
-      string_set (&str, "nodes");
-      string_set2 (&str2, compact, end - compact);
-      obj_insert_key_string (reply, &str, &str2);
     }
-  else
+
+  if (n == 0 && ds_store_nodes (ds, info->data, want, reply) == 0)
     {
-      struct dht_object *values;
-      struct string *peers;
-      values = obj_init (OBJ_TYPE_LIST);
-      peers = dt_get_peers (tracker, DTK_MAX_PEERS);
-      obj_insert_list_string (values, peers);
-      string_clear (peers);
-      string_set (&str, "values");
-      obj_insert_key_object (reply, &str, values);
+      ttdht_debug ("No peers nor nodes.\n");
     }
 }
 
 static void
 ds_create_announce_peer_response (struct dht_server *ds,
 				  struct dht_object *arg,
-				  struct sockaddr_in *sa,
+				  struct dht_addr *sa,
 				  struct dht_object *reply)
 {
   struct dht_tracker *tracker;
+  struct dht_addr peer;
   struct string str, *info, *token;
 
   string_set (&str, "info_hash");
@@ -531,7 +810,8 @@ ds_create_announce_peer_response (struct dht_server *ds,
 
   string_set (&str, "token");
   token = obj_get_key_string (arg, &str);
-  if (!dr_token_valid (ds->m_router, token->data, sa))
+  if (info == NULL || token == NULL || token->len < LOCAL_TOKEN_LEN
+      || !dr_token_valid (ds->m_router, token->data, sa))
     {
       ttdht_debug ("Token invalid.\n");
       return;
@@ -540,23 +820,25 @@ ds_create_announce_peer_response (struct dht_server *ds,
   tracker = dr_get_tracker (ds->m_router, info->data, 1);
 
   string_set (&str, "port");
-  dt_add_peer (tracker, sa->sin_addr.s_addr,
-	       htons (obj_get_key_value (arg, &str)));
+  memcpy (&peer, sa, sizeof (struct dht_addr));
+  da_set_port (&peer, obj_get_key_value (arg, &str));
+  dt_add_peer (tracker, &peer, dr_time (ds->m_router));
 }
 
 static void
-ds_process_response (struct dht_server *ds, int transid, const char *id,
-		     struct sockaddr_in *sa, struct dht_object *req)
+ds_process_response (struct dht_server *ds, unsigned int transid,
+		     const char *id, struct dht_addr *sa,
+		     struct dht_object *req)
 {
   struct dht_trans *dtr;
   struct dht_ttype_trans_t *dtt;
+  struct dht_node *node;
   struct dht_object *res;
-  dht_trans_key_type key;
   struct string str, *snodes;
   struct list *snodes2;
+  int rtt;
 
-  key = dtr_key (sa, transid);
-  dtt = ds_map_find (ds, key);
+  dtt = ds_find_trans (ds, sa, transid);
   if (dtt == NULL)
     {
       return;
@@ -581,11 +863,11 @@ ds_process_response (struct dht_server *ds, int transid, const char *id,
   switch (dtr->type)
     {
     case DHT_FIND_NODE:
-      string_set (&str, "nodes");
+      string_set (&str, dtr->m_search->m_af == AF_INET6 ? "nodes6" : "nodes");
       snodes = obj_get_key_string (res, &str);
       if (snodes != NULL)
 	{
-	  ds_parse_find_node_reply (ds, dtr, snodes);
+	  ds_parse_find_node_reply (ds, dtr, snodes, dtr->m_search->m_af);
 	}
       string_set (&str, "nodes2");
       snodes2 = obj_get_key_list (res, &str);
@@ -603,22 +885,30 @@ ds_process_response (struct dht_server *ds, int transid, const char *id,
       break;
     }
 
-  dr_node_replied (ds->m_router, id, sa);
+  /* 
+   * the reply to a query sent more than once may answer any of them,
+   * so it is not timed (Karn)
+   * */
+  node = dr_node_replied (ds->m_router, id, sa);
+  if (!DTRAN_RESENT (dtr))
+    {
+      rtt = ds_elapsed_ms (ds, &dtr->m_sent);
+      rtt_update (&ds->m_srtt, &ds->m_rttvar, rtt);
+      if (node != NULL)
+	dn_update_rtt (node, rtt);
+    }
 
   dts_cleanup (dtr);
-  LIST_REMOVE (dtt, entries);
-  free (dtt);
+  ds_remove_trans (ds, dtt);
 }
 
 static void
-ds_process_error (struct dht_server *ds, int transid, struct sockaddr_in *sa,
-		  struct dht_object *req)
+ds_process_error (struct dht_server *ds, unsigned int transid,
+		  struct dht_addr *sa, struct dht_object *req)
 {
-  dht_trans_key_type key;
   struct dht_ttype_trans_t *dtt;
 
-  key = dtr_key (sa, transid);
-  dtt = ds_map_find (ds, key);
+  dtt = ds_find_trans (ds, sa, transid);
 
   if (dtt == NULL)
     return;
@@ -626,41 +916,37 @@ ds_process_error (struct dht_server *ds, int transid, struct sockaddr_in *sa,
   ds->m_repliesreceived++;
   ds->m_networkup = 1;
 
-  LIST_REMOVE (dtt, entries);
   dtr_cleanup (dtt->trans);
-  free (dtt);
+  ds_remove_trans (ds, dtt);
 }
 
 static void
 ds_parse_find_node_reply (struct dht_server *ds, struct dht_trans *dts,
-			  struct string *nodes)
+			  struct string *nodes, int af)
 {
   int size, i;
-  char buf[32];
+#ifdef _DEBUG
+  char buf[DA_STRLEN];
+#endif
 
   dts_complete (dts, 1);
 
-  size = nodes->len / 26;
+  size = nodes->len / DA_NODE_LEN (af);
   for (i = 0; i < size; ++i)
     {
-      char *p = (char *) nodes->data + i * 26;
+      char *p = (char *) nodes->data + i * DA_NODE_LEN (af);
       if (hashsg_cmp (p, ds->m_router->node->hashsg) != 0)
 	{
-	  struct sockaddr_in sa[1];
-	  sa->sin_family = AF_INET;
-	  memcpy (&sa->sin_addr, p + HASH_STRING_LEN, 4);
-	  memcpy (&sa->sin_port, p + HASH_STRING_LEN + 4, 2);
-	  memset (sa->sin_zero, 0, 8);
-	  if (ntohl (sa->sin_addr.s_addr) >= HOST_MAX_IP)
+	  struct dht_addr sa[1];
+	  if (da_load_compact (sa, af, p + HASH_STRING_LEN) < 0
+	      || DA_FAMILY (sa) != af || !da_valid (sa))
 	    {
-	      ttdht_debug ("Invalid IP or Port [%s:%d].\n",
-			   inet_ntoa (sa->sin_addr), ntohs (sa->sin_port));
+	      ttdht_debug ("Invalid IP or Port [%s].\n",
+			   da_ntop (sa, buf, sizeof buf));
 	      continue;
 	    }
-//        inet_ntop (AF_INET, &sa->sin_addr, buf, sizeof buf);
-	  strcpy (buf, inet_ntoa (sa->sin_addr));
-	  ttdht_debug ("Add contact [%s:%d].\n", buf, ntohs (sa->sin_port));
-	  dsea_add_contact (dts->m_search, p, (struct sockaddr *) sa);
+	  ttdht_debug ("Add contact [%s].\n", da_ntop (sa, buf, sizeof buf));
+	  ds_add_search_contact (ds, dts->m_search, p, sa);
 	}
     }
 
@@ -674,28 +960,29 @@ ds_parse_find_node_reply2 (struct dht_server *ds, struct dht_trans *dts,
   struct string *str;
   struct dht_object *obj;
   struct list_node *ln;
-  char buf[32];
+#ifdef _DEBUG
+  char buf[DA_STRLEN];
+#endif
 
   dts_complete (dts, 1);
 
   LIST_FOREACH (ln, list, entries)
   {
-    struct sockaddr_in sa[1];
+    struct dht_addr sa[1];
     obj = ln->item;
 
-    if (obj == NULL || (str = OBJ_AS_STRING (obj)) == NULL)
+    if (obj == NULL || (str = OBJ_AS_STRING (obj)) == NULL
+	|| str->len < HASH_STRING_LEN + 12 + DA_COMPACT_LEN4)
       {
 	continue;
       }
 
-    sa->sin_family = AF_INET;
-    memcpy (&sa->sin_addr, str->data + HASH_STRING_LEN + 12, 4);
-    memcpy (&sa->sin_port, str->data + HASH_STRING_LEN + 16, 2);
-    memset (sa->sin_zero, 0, 8);
-    //inet_ntop (AF_INET, &sa->sin_addr, buf, sizeof buf);
-    strcpy (buf, inet_ntoa (sa->sin_addr));
-    ttdht_debug ("Add contact [%s:%d].\n", buf, ntohs (sa->sin_port));
-    dsea_add_contact (dts->m_search, str->data, (struct sockaddr *) sa);
+    if (dts->m_search->m_af != AF_INET)
+      continue;
+
+    da_load_compact (sa, AF_INET, str->data + HASH_STRING_LEN + 12);
+    ttdht_debug ("Add contact [%s].\n", da_ntop (sa, buf, sizeof buf));
+    ds_add_search_contact (ds, dts->m_search, str->data, sa);
   }
 
   ds_find_node_next (ds, dts);
@@ -729,27 +1016,52 @@ ds_parse_get_peers_reply (struct dht_server *ds, struct dht_trans *dtr,
 	  struct string *tpo;
 
 	  tpo = obj_get_key_string (res, &str);
-	  dtan = dtan_init (dtr->m_id, &dtr->m_sa, dann->m_target, tpo);
+	  dtan = dtan_init (dtr->m_pools, dtr->m_id, &dtr->m_sa,
+			    dann->m_target, tpo);
 	  dtan->type = DHT_ANNOUNCE_PEER;
 	  dtan->m_search = dann;
 
-	  ds_add_trans (ds, dtan, 0);
+	  ds_add_trans (ds, dtan, DR_PRI_USER);
 	}
     }
 }
 
+static void
+ds_add_search_contact (struct dht_server *ds, struct dht_search *dsea,
+		       const char *id, struct dht_addr *sa)
+{
+  struct dht_node *node;
+
+  /* 
+   * nodes we already know carry their measured round trip time
+   * into the search
+   * */
+  node = dr_get_node (ds->m_router, DR_TABLE (ds->m_router, DA_FAMILY (sa)),
+		      id);
+  if (node != NULL && node != ds->m_router->node
+      && da_equal (&node->m_sockaddr, sa))
+    {
+      dsea_add_node (dsea, node);
+      return;
+    }
+
+  dsea_add_contact (dsea, id, sa);
+}
+
 static void
 ds_find_node_next (struct dht_server *ds, struct dht_trans *dts)
 {
   struct dht_node_search_t *dns;
   struct dht_search *dann;
+  int i, n;
 
-  while ((dns = dsea_get_contact (dts->m_search)) != NULL)
+  while ((dns = ds_search_contact (ds, dts->m_search)) != NULL)
     {
       struct dht_trans *dtr;
       dtr = dts_init (4, 30, dns);
       dtr->type = DHT_FIND_NODE;
-      ds_add_trans (ds, dtr, 0);
+      ds_add_trans (ds, dtr,
+		    dts->m_search->is_anno ? DR_PRI_USER : DR_PRI_MAINT);
     }
 
   if (!dts->m_search->is_anno)
@@ -761,33 +1073,42 @@ ds_find_node_next (struct dht_server *ds, struct dht_trans *dts)
 	       dann->m_pending);
   if (DSEA_COMPLETE (dann))
     {
-      for (dns = dann_start_announce (dann); dns != NULL;
-	   dns = LIST_NEXT (dns, entries))
+      n = dann_start_announce (dann);
+      for (i = 0; i < n; i++)
 	{
 	  struct dht_trans *dtr;
-	  dtr = dts_init (-1, 30, dns);
+	  dtr = dts_init (-1, 30, DSEA_CANDIDATE (dann, i));
 	  dtr->type = DHT_GET_PEERS;
-	  ds_add_trans (ds, dtr, 0);
+	  ds_add_trans (ds, dtr, DR_PRI_USER);
 	}
     }
 }
 
-static void
-ds_create_query (struct dht_server *ds, struct dht_trans *dtr, int transid,
-		 struct sockaddr_in *sa, int pri)
+/* 
+ * queue the query of dtt, return -1 if it was not
+ * */
+static int
+ds_create_query (struct dht_server *ds, struct dht_ttype_trans_t *dtt)
 {
-  char trans_id[3];
-  struct dht_object *query, *q;
+  char trans_id[DS_TID_LEN];
+  int i, ret;
+#ifdef _DEBUG
+  char buf[DA_STRLEN];
+#endif
+  struct dht_object *query, *q, *want;
+  struct dht_trans *dtr;
   struct string str, str2;
 
+  dtr = dtt->trans;
   if (hashsg_cmp (dtr->m_id, ds->m_router->node->hashsg) == 0)
-    return;
+    return -1;
 
   query = obj_init (OBJ_TYPE_MAP);
-  sprintf (trans_id, "%c", transid);
+  for (i = 0; i < DS_TID_LEN; i++)
+    trans_id[i] = (char) (dtt->m_tid >> (8 * (DS_TID_LEN - 1 - i)));
 
   string_set (&str, "t");
-  string_set2 (&str2, trans_id, 1);
+  string_set2 (&str2, trans_id, DS_TID_LEN);
   obj_insert_key_string (query, &str, &str2);
 
   string_set (&str, "y");
@@ -825,7 +1146,7 @@ ds_create_query (struct dht_server *ds, struct dht_trans *dtr, int transid,
       string_set (&str, "info_hash");
       string_set2 (&str2, dtr->m_search->m_target, HASH_STRING_LEN);
       obj_insert_key_string (q, &str, &str2);
-      ttdht_debug ("get key: %s from %s:%d\n", dtr->m_search->key, inet_ntoa (dtr->m_sa.sin_addr), ntohs (dtr->m_sa.sin_port));	// for debug
+      ttdht_debug ("get key: %s from %s\n", dtr->m_search->key, da_ntop (&dtr->m_sa, buf, sizeof buf));	// for debug
       break;
 
     case DHT_ANNOUNCE_PEER:
@@ -839,22 +1160,36 @@ ds_create_query (struct dht_server *ds, struct dht_trans *dtr, int transid,
       string_set (&str, "port");
       obj_insert_key_value (q, &str, dtr->m_search->m_port);
 
-      ttdht_debug ("pub key: %s with port: %d on %s:%d\n", dtr->m_search->key, dtr->m_search->m_port, inet_ntoa (dtr->m_sa.sin_addr), ntohs (dtr->m_sa.sin_port));	// for debug
+      ttdht_debug ("pub key: %s with port: %d on %s\n", dtr->m_search->key, dtr->m_search->m_port, da_ntop (&dtr->m_sa, buf, sizeof buf));	// for debug
       break;
     }
 
+  /* 
+   * lookups only ask for nodes of the family of their own table
+   * */
+  if (dtr->type == DHT_FIND_NODE || dtr->type == DHT_GET_PEERS)
+    {
+      want = obj_init (OBJ_TYPE_LIST);
+      string_set (&str2, dtr->m_search->m_af == AF_INET6 ? "n6" : "n4");
+      obj_insert_list_string (want, &str2);
+      string_set (&str, "want");
+      obj_insert_key_object (q, &str, want);
+    }
+
   ds->m_queriessent++;
 
-  ttdht_debug ("dht server send query: %d to %s:%d\n", dtr->type,
-	       inet_ntoa (dtr->m_sa.sin_addr), ntohs (dtr->m_sa.sin_port));
-  ds_write (ds, &dtr->m_sa, query);
+  ttdht_debug ("dht server send query: %d to %s\n", dtr->type,
+	       da_ntop (&dtr->m_sa, buf, sizeof buf));
+  ret = ds_write (ds, &dtr->m_sa, dtt->m_pri, query, dtt);
 
   obj_cleanup (query);
+
+  return ret;
 }
 
 static void
 ds_create_response (struct dht_server *ds, struct dht_object *transid,
-		    struct sockaddr_in *sa, struct dht_object *res)
+		    struct dht_addr *sa, struct dht_object *res)
 {
   struct dht_object *reply;
   struct string str, str2;
@@ -879,128 +1214,433 @@ ds_create_response (struct dht_server *ds, struct dht_object *transid,
   string_set (&str2, PEER_VERSION);
   obj_insert_key_string (reply, &str, &str2);
 
-  ds_write (ds, sa, reply);
+  ds_write (ds, sa, DR_PRI_REPLY, reply, NULL);
 
   obj_cleanup (reply);
 }
 
-static struct dht_ttype_trans_t *
-ds_map_lower_bound (struct dht_server *ds, dht_trans_key_type key)
+/* 
+ * keyed hash of the address and port a transaction goes to
+ * */
+static unsigned int
+ds_dest_hash (struct dht_server *ds, const struct dht_addr *sa)
 {
-  struct dht_ttype_trans_t *dtt, *bigger;
+  unsigned char key[sizeof (struct in6_addr) + 2];
+  unsigned short port;
+  const char *host;
+  int len;
 
-  bigger = LIST_FIRST (&ds->m_trans);
+  host = da_host (sa, &len);
+  memcpy (key, host, len);
+  port = DA_PORT (sa);
+  memcpy (key + len, &port, 2);
 
-  LIST_FOREACH (dtt, &ds->m_trans, entries)
-  {
-    if (dtt->key == key)
-      return dtt;
+  return hash_bytes (key, len + 2, ds->m_transkey);
+}
 
-    if (dtt->key > key)
-      {
-	if (dtt->key < bigger->key)
-	  {
-	    bigger = dtt;
-	  }
-      }
-  }
+static int
+ds_dest_equal (const void *item, const void *key)
+{
+  return da_equal (&((const struct dht_trans_dest *) item)->m_sa,
+		   (const struct dht_addr *) key);
+}
+
+static struct dht_trans_dest *
+ds_find_dest (struct dht_server *ds, const struct dht_addr *sa)
+{
+  return ht_find (&ds->m_dests, ds_dest_hash (ds, sa), ds_dest_equal, sa);
+}
+
+struct ds_trans_key
+{
+  const struct dht_addr *sa;
+  unsigned int tid;
+};
+
+static int
+ds_trans_equal (const void *item, const void *key)
+{
+  const struct dht_ttype_trans_t *dtt;
+  const struct ds_trans_key *tk;
+
+  dtt = (const struct dht_ttype_trans_t *) item;
+  tk = (const struct ds_trans_key *) key;
+
+  return dtt->m_tid == tk->tid && ds_dest_equal (dtt->m_dest, tk->sa);
+}
+
+static unsigned int
+ds_trans_hash (unsigned int desthash, unsigned int tid)
+{
+  return hash_bytes (&tid, sizeof (tid), desthash);
+}
+
+/* 
+ * the transaction with id tid in flight to sa, or NULL
+ * */
+static struct dht_ttype_trans_t *
+ds_find_trans (struct dht_server *ds, const struct dht_addr *sa,
+	       unsigned int tid)
+{
+  struct ds_trans_key tk;
 
-  return bigger;
+  tk.sa = sa;
+  tk.tid = tid;
+
+  return ht_find (&ds->m_transidx,
+		  ds_trans_hash (ds_dest_hash (ds, sa), tid),
+		  ds_trans_equal, &tk);
 }
 
+/* 
+ * new entry for dtr, counted for its destination
+ * */
 static struct dht_ttype_trans_t *
-ds_map_find (struct dht_server *ds, dht_trans_key_type key)
+ds_new_trans (struct dht_server *ds, struct dht_trans *dtr, int pri)
 {
   struct dht_ttype_trans_t *dtt;
+  struct dht_trans_dest *dest;
+  unsigned int hash;
 
-  LIST_FOREACH (dtt, &ds->m_trans, entries)
-  {
-    if (dtt->key == key)
-      return dtt;
-  }
+  hash = ds_dest_hash (ds, &dtr->m_sa);
+  dest = ht_find (&ds->m_dests, hash, ds_dest_equal, &dtr->m_sa);
+  if (dest == NULL)
+    {
+      dest = (struct dht_trans_dest *)
+	dp_alloc (&ds->m_router->m_pools.m_dests);
+      memcpy (&dest->m_sa, &dtr->m_sa, sizeof (struct dht_addr));
+      dest->m_hash = hash;
+      ht_insert (&ds->m_dests, hash, dest);
+    }
+  dest->m_count++;
 
-  return NULL;
+  dtt = (struct dht_ttype_trans_t *)
+    dp_alloc (&ds->m_router->m_pools.m_transrefs);
+  dtt->m_dest = dest;
+  dtt->trans = dtr;
+  dtt->m_server = ds;
+  dtt->m_pri = pri;
+
+  return dtt;
 }
 
+/* 
+ * free an entry that is not in flight, the caller frees the transaction
+ * */
+static void
+ds_free_trans (struct dht_server *ds, struct dht_ttype_trans_t *dtt)
+{
+  struct dht_trans_dest *dest;
+
+  dest = dtt->m_dest;
+  if (--dest->m_count == 0)
+    {
+      ht_remove (&ds->m_dests, dest->m_hash, dest);
+      dp_free (&ds->m_router->m_pools.m_dests, dest);
+    }
+
+  dp_free (&ds->m_router->m_pools.m_transrefs, dtt);
+}
+
+/* 
+ * file dtt under its address and tid
+ * */
+static void
+ds_insert_trans (struct dht_server *ds, struct dht_ttype_trans_t *dtt)
+{
+  dtt->m_hash = ds_trans_hash (dtt->m_dest->m_hash, dtt->m_tid);
+  ht_insert (&ds->m_transidx, dtt->m_hash, dtt);
+  LIST_INSERT_HEAD (&ds->m_trans, dtt, entries);
+}
+
+/* 
+ * unlink dtt from the list and the indexes and free it, then send
+ * what it made room for; the caller frees the transaction
+ * */
+static void
+ds_remove_trans (struct dht_server *ds, struct dht_ttype_trans_t *dtt)
+{
+  if (dtt->m_timer != NULL)
+    dr_timer_remove (ds->m_router, dtt->m_timer);
+  if (dtt->m_queued > 0)
+    dr_send_cancel (ds->m_router, dtt);
+
+  ht_remove (&ds->m_transidx, dtt->m_hash, dtt);
+  LIST_REMOVE (dtt, entries);
+  ds_free_trans (ds, dtt);
+
+  ds_admit (ds);
+}
+
+/* 
+ * room for another transaction: fewer than DS_MAX_INFLIGHT in flight
+ * and a send queue the pacer does not hold back and that is not
+ * backed up
+ * */
 static int
-ds_add_trans (struct dht_server *ds, struct dht_trans *dtr, int pri)
+ds_can_send (struct dht_server *ds)
+{
+  return HT_COUNT (&ds->m_transidx) < DS_MAX_INFLIGHT
+    && !DR_IS_PACED (ds->m_router)
+    && DR_NUM_QUEUED (ds->m_router) < DS_SEND_BACKLOG;
+}
+
+/* 
+ * send waiting transactions, oldest first, while there is room
+ * return the number sent
+ * */
+int
+ds_admit (struct dht_server *ds)
 {
   struct dht_ttype_trans_t *dtt;
-  unsigned int rnd, id;
-  dht_trans_key_type key;
+  int n;
 
-  rnd = (unsigned char) rand ();
-  id = rnd;
+  n = 0;
+  while (ds_can_send (ds) && (dtt = SIMPLEQ_FIRST (&ds->m_admit)) != NULL)
+    {
+      SIMPLEQ_REMOVE_HEAD (&ds->m_admit, dtt, m_queue);
+      ds->m_numwaiting--;
+      if (ds_send_trans (ds, dtt) == 0)
+	n++;
+    }
+
+  return n;
+}
+
+/* 
+ * the transaction id for counter to sa
+ * */
+static unsigned int
+ds_tid (struct dht_server *ds, const struct dht_addr *sa,
+	unsigned int counter)
+{
+  unsigned int h;
+
+  counter &= 0xFFFF;
+  h = hash_bytes (&counter, sizeof (counter),
+		  ds_dest_hash (ds, sa) ^ ds->m_tidkey);
 
-  key = dtr_key (&dtr->m_sa, id);
-  dtt = ds_map_lower_bound (ds, key);
+  return counter << 16 | (h & 0xFFFF);
+}
+
+/* 
+ * the id of a reply from sa, or -1 when it is not one we could have
+ * sent there; a spoofed reply has to guess the hash and is dropped
+ * without a lookup
+ * */
+static int
+ds_parse_tid (struct dht_server *ds, const struct dht_addr *sa,
+	      const struct string *str, unsigned int *tid)
+{
+  unsigned int id;
+  int i;
 
-  while (dtt != NULL && dtt->key == key)
+  if (str == NULL || str->len != DS_TID_LEN)
+    return -1;
+
+  id = 0;
+  for (i = 0; i < DS_TID_LEN; i++)
+    id = id << 8 | (unsigned char) str->data[i];
+
+  if (ds_tid (ds, sa, id >> 16) != id)
+    return -1;
+
+  *tid = id;
+  return 0;
+}
+
+/* 
+ * send dtr now, or queue it behind the others waiting when there is no
+ * room for it
+ * */
+static int
+ds_add_trans (struct dht_server *ds, struct dht_trans *dtr, int pri)
+{
+  struct dht_ttype_trans_t *dtt;
+
+  dtt = ds_new_trans (ds, dtr, pri);
+
+  if (!ds_can_send (ds) || !SIMPLEQ_EMPTY (&ds->m_admit))
     {
-      dtt = LIST_NEXT (dtt, entries);
-      id = (unsigned char) (id + 1);
+      SIMPLEQ_INSERT_TAIL (&ds->m_admit, dtt, m_queue);
+      ds->m_numwaiting++;
+      return 0;
+    }
 
-      if (id == rnd)
-	{
-	  dtr_cleanup (dtr);
-	  return -1;
-	}
+  return ds_send_trans (ds, dtt);
+}
+
+static int
+ds_send_trans (struct dht_server *ds, struct dht_ttype_trans_t *dtt)
+{
+  struct dht_trans *dtr;
+  unsigned int id, n;
+
+  dtr = dtt->trans;
 
-      if (id == 0)
+  /* 
+   * the counter only comes back to an id still in flight to the same
+   * host after 65536 queries, then the next one is taken
+   * */
+  for (n = 0;; n++)
+    {
+      id = ds_tid (ds, &dtr->m_sa, ds->m_tidnext++);
+      if (ds_find_trans (ds, &dtr->m_sa, id) == NULL)
+	break;
+      if (n == 0xFFFF)
 	{
-	  key = dtr_key (&dtr->m_sa, id);
-	  dtt = ds_map_lower_bound (ds, key);
+	  /* 
+	   * fails like one that timed out, so its search goes on
+	   * */
+	  ds_free_trans (ds, dtt);
+	  if (dtr->type == DHT_FIND_NODE)
+	    {
+	      dts_complete (dtr, 0);
+	      ds_find_node_next (ds, dtr);
+	    }
+	  dts_cleanup (dtr);
+	  return -1;
 	}
     }
 
-  dtt =
-    (struct dht_ttype_trans_t *) calloc (1,
-					 sizeof (struct dht_ttype_trans_t));
-  assert (dtt);
-  dtt->key = key;
-  dtt->trans = dtr;
-  LIST_INSERT_HEAD (&ds->m_trans, dtt, entries);
+  dtt->m_tid = id;
+  ds_insert_trans (ds, dtt);
 
-  ds_create_query (ds, dtr, id, &dtr->m_sa, pri);
+  dtr->m_rto = ds_rto (ds, dtr);
+  if (dtr->m_has_quicktimeout)
+    dtr->m_quicktimeout = dtr->m_rto;
+
+  ds_send_query (ds, dtt);
 
   return 0;
 }
 
-static int
-ds_ontimer (struct dht_server *ds)
+/* 
+ * queue another copy of the query of dtt, ds_sent follows once it
+ * left the send queue, at once when it could not be queued
+ * */
+static void
+ds_send_query (struct dht_server *ds, struct dht_ttype_trans_t *dtt)
+{
+  dtt->m_queued++;
+  if (ds_create_query (ds, dtt) < 0)
+    ds_sent (ds, dtt);
+}
+
+/* 
+ * the router wrote or dropped a query of the transaction tag: wait the
+ * retransmission timeout from now, but not past the timeout of the
+ * transaction, which runs from the first copy
+ * */
+void
+ds_sent (struct dht_server *ds, void *tag)
 {
   struct dht_ttype_trans_t *dtt;
   struct dht_trans *dtr;
-  time_t t;
+  int wait;
+
+  dtt = (struct dht_ttype_trans_t *) tag;
+  dtr = dtt->trans;
+
+  dtt->m_queued--;
+  if (dtt->m_timer != NULL)
+    return;
+
+  if (!DTRAN_RESENT (dtr))
+    dr_gettime (ds->m_router, &dtr->m_sent);
+
+  wait = dtr->m_timeout - ds_elapsed_ms (ds, &dtr->m_sent);
+  if (wait > dtr->m_rto)
+    wait = dtr->m_rto;
+  if (wait < 0)
+    wait = 0;
+
+  dtt->m_timer = dr_timer_add (ds->m_router, wait,
+			       DHT_SOURCE (ds_trans_timeout), dtt);
+}
+
+/* 
+ * retransmission timeout for dtr in msec, from the round trip time of
+ * its node when that was measured, else of all replies
+ * */
+static int
+ds_rto (struct dht_server *ds, struct dht_trans *dtr)
+{
+  struct dht_node *node;
+  int rto;
+
+  if (dtr->m_node != NULL)
+    node = dtr->m_node->node;
+  else
+    node = dr_get_node (ds->m_router,
+			DR_TABLE (ds->m_router, DA_FAMILY (&dtr->m_sa)),
+			dtr->m_id);
+
+  if (node != NULL && DN_HAS_RTT (node))
+    rto = node->m_srtt + 4 * node->m_rttvar;
+  else if (ds->m_srtt > 0)
+    rto = ds->m_srtt + 4 * ds->m_rttvar;
+  else
+    rto = DS_RTO_MAX;
+
+  if (rto < DS_RTO_MIN)
+    rto = DS_RTO_MIN;
+  if (rto > DS_RTO_MAX)
+    rto = DS_RTO_MAX;
+
+  return rto;
+}
+
+/* 
+ * timer of a transaction, due every time the retransmission timeout
+ * passes after a copy of the query left the send queue: the first time
+ * a search gives up waiting and queries another contact, then the query
+ * is queued again with the timeout doubled and the timer waits for
+ * ds_sent; after the last retry or at the timeout the transaction fails
+ * */
+static int
+ds_trans_timeout (struct dht_ttype_trans_t *dtt)
+{
+  struct dht_server *ds;
+  struct dht_trans *dtr;
+  int wait;
 
-  time (&t);
-  for (dtt = LIST_FIRST (&ds->m_trans); dtt != NULL;)
+  ds = dtt->m_server;
+  dtr = dtt->trans;
+
+  if (dtr->m_has_quicktimeout)
     {
-      dtr = dtt->trans;
-      if (dtr->m_has_quicktimeout && dtr->m_quicktimeout < t)
-	{
-	  dtt = ds_failed_transaction (ds, dtt, 1);
-	  continue;
-	}
-      else if (dtr->m_timeout < t)
-	{
-	  dtt = ds_failed_transaction (ds, dtt, 0);
-	  continue;
-	}
-      else
-	{
-	  dtt = LIST_NEXT (dtt, entries);
-	}
+      ds_failed_transaction (ds, dtt, 1);
+      dtr->m_has_quicktimeout = 0;
     }
 
-  return 1;
+  wait = dtr->m_timeout - ds_elapsed_ms (ds, &dtr->m_sent);
+  if (DTRAN_RETRY (dtr) > 0 && wait > 0)
+    {
+      DTRAN_DEC_RETRY (dtr);
+      dtr->m_rto *= 2;
+      if (dtr->m_rto > DS_RTO_BACKOFF)
+	dtr->m_rto = DS_RTO_BACKOFF;
+
+      /* 
+       * the router removes this timer once this returns, ds_sent arms
+       * the next one
+       * */
+      dtt->m_timer = NULL;
+      ds_send_query (ds, dtt);
+      return 0;
+    }
+
+  dtt->m_timer = NULL;
+  ds_failed_transaction (ds, dtt, 0);
+
+  return 0;
 }
 
-static struct dht_ttype_trans_t *
+static void
 ds_failed_transaction (struct dht_server *ds, struct dht_ttype_trans_t *dtt,
 		       int quick)
 {
-  struct dht_ttype_trans_t *dtt2;
   struct dht_trans *dtr;
 
   dtr = dtt->trans;
@@ -1020,15 +1660,11 @@ ds_failed_transaction (struct dht_server *ds, struct dht_ttype_trans_t *dtt,
       ds_find_node_next (ds, dtr);
     }
 
-  dtt2 = LIST_NEXT (dtt, entries);
   if (!quick)
     {
       dts_cleanup (dtt->trans);
-      LIST_REMOVE (dtt, entries);
-      free (dtt);
+      ds_remove_trans (ds, dtt);
     }
-
-  return dtt2;
 }
 
 static void
@@ -1036,14 +1672,32 @@ ds_clear_trans (struct dht_server *ds)
 {
   struct dht_ttype_trans_t *dtt;
 
+  while ((dtt = SIMPLEQ_FIRST (&ds->m_admit)) != NULL)
+    {
+      SIMPLEQ_REMOVE_HEAD (&ds->m_admit, dtt, m_queue);
+      dtr_cleanup (dtt->trans);
+      ds_free_trans (ds, dtt);
+    }
+  ds->m_numwaiting = 0;
+
   while ((dtt = LIST_FIRST (&ds->m_trans)) != NULL)
     {
       dtr_cleanup (dtt->trans);
-      LIST_REMOVE (dtt, entries);
-      free (dtt);
+      ds_remove_trans (ds, dtt);
     }
 }
 
+static int
+ds_elapsed_ms (struct dht_server *ds, const struct timeval *since)
+{
+  struct timeval now[1];
+
+  dr_gettime (ds->m_router, now);
+
+  return (int) ((now->tv_sec - since->tv_sec) * 1000
+		+ (now->tv_usec - since->tv_usec) / 1000);
+}
+
 static int
 ds_encode_buf (struct dht_server *ds, struct dht_object *obj, char *buf,
 	       int siz)
@@ -1064,18 +1718,22 @@ ds_encode_buf (struct dht_server *ds, struct dht_object *obj, char *buf,
   return ret;
 }
 
-static void
-ds_write (struct dht_server *ds, struct sockaddr_in *sa,
-	  struct dht_object *obj)
+/* 
+ * queue obj to sa, tag is the transaction of a query;
+ * return -1 if nothing was queued
+ * */
+static int
+ds_write (struct dht_server *ds, struct dht_addr *sa, int pri,
+	  struct dht_object *obj, void *tag)
 {
   char buf[1500];
   int ret;
 
-  if (ntohl (sa->sin_addr.s_addr) >= HOST_MAX_IP)
+  if (!da_valid (sa))
     {
-      ttdht_debug ("Invalid IP or Port [%s:%d], can't send message.\n",
-		   inet_ntoa (sa->sin_addr), ntohs (sa->sin_port));
-      return;
+      ttdht_debug ("Invalid IP or Port [%s], can't send message.\n",
+		   da_ntop (sa, buf, sizeof buf));
+      return -1;
     }
 
   ret = ds_encode_buf (ds, obj, buf, sizeof buf);
@@ -1083,10 +1741,10 @@ ds_write (struct dht_server *ds, struct sockaddr_in *sa,
   if (ret < 0)
     {
       ttdht_debug ("encode error.\n");
-      return;
+      return -1;
     }
 
-  ds->m_router->write (ds->m_router->m_fdp, buf, ret, sa);
+  return dr_send (ds->m_router, buf, ret, sa, pri, tag);
 }
 
 static int
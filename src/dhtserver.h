@@ -34,6 +34,59 @@
 #define DS_QUERIES_SENT(ds)      (ds->m_queriessent)
 #define DS_REPLIES_RECEIVED(ds)  (ds->m_repliesreceived)
 
+/* 
+ * inbound query limiter: buckets in the table, seconds of queries a
+ * host may send at once, default queries per second per host
+ * */
+#define DS_NUM_LIMITS            1024
+#define DS_LIMIT_BURST           2
+#define DS_QUERY_RATE            50
+#define DS_ANNOUNCE_RATE         10
+
+/* 
+ * initial slots of the transaction and destination indexes
+ * */
+#define DS_TRANS_SLOTS           256
+
+/* 
+ * transactions a router keeps in flight at once; further queries wait
+ * in the admission queue and are sent in order as replies come back
+ * */
+#define DS_MAX_INFLIGHT          256
+
+/* 
+ * datagrams the router may hold in its send queue before new
+ * transactions wait for admission too; while the pacer holds the queue
+ * back they always wait
+ * */
+#define DS_SEND_BACKLOG          32
+
+/* 
+ * bytes of a transaction id: a 16 bit counter followed by 16 bits of a
+ * keyed hash of the counter and the destination
+ * */
+#define DS_TID_LEN               4
+
+/* 
+ * bounds in msec of the retransmission timeout, srtt + 4 * rttvar of
+ * the node or of all replies, which is also the quick timeout of a
+ * search query; a query is sent again when it passes, waiting twice
+ * as long each time up to DS_RTO_BACKOFF
+ * */
+#define DS_RTO_MIN               250
+#define DS_RTO_MAX               4000
+#define DS_RTO_BACKOFF           8000
+
+enum
+{
+  DS_QUERY_PING = 0,
+  DS_QUERY_FIND_NODE,
+  DS_QUERY_GET_PEERS,
+  DS_QUERY_ANNOUNCE_PEER,
+  DS_QUERY_OTHER,
+  DS_NUM_QUERIES
+};
+
 struct compact_node_info
 {
   char id[HASH_STRING_LEN];
@@ -41,17 +94,45 @@ struct compact_node_info
   char port[2];
 };
 
+struct compact_node6_info
+{
+  char id[HASH_STRING_LEN];
+  char addr[16];
+  char port[2];
+};
+
+/* 
+ * a host with transactions in flight or waiting, m_count of them
+ * */
+struct dht_trans_dest
+{
+  struct dht_addr m_sa;
+  unsigned int m_hash;
+  int m_count;
+};
+
 struct dht_ttype_trans_t
 {
-  dht_trans_type key;
+  unsigned int m_tid;
+  unsigned int m_hash;
+  struct dht_trans_dest *m_dest;
   struct dht_trans *trans;
+
+  /* 
+   * fires at the quick timeout, if there is one, then at the timeout;
+   * armed once the query has left the router's send queue, where
+   * m_queued copies of it still are
+   * */
+  struct dht_server *m_server;
+  struct timer *m_timer;
+  int m_queued;
+  int m_pri;
     LIST_ENTRY (dht_ttype_trans_t) entries;
+    SIMPLEQ_ENTRY (dht_ttype_trans_t) m_queue;
 };
 
 struct dht_server
 {
-  struct timer *timer;
-
   unsigned short port;
 
     LIST_HEAD (node_info_list, node_info) node_info_list;
@@ -66,7 +147,45 @@ struct dht_server
   unsigned int m_queriessent;
   unsigned int m_repliesreceived;
 
+  /* 
+   * queries of one type from one host share two buckets picked by keyed
+   * hashes and are dropped before decoding when both are empty;
+   * m_qrate is queries per second per host, 0 for no limit
+   * */
+  struct tbucket m_limits[DS_NUM_LIMITS];
+  unsigned int m_limitkey;
+  volatile long m_qrate[DS_NUM_QUERIES];
+  unsigned int m_querydrops[DS_NUM_QUERIES];
+
+  /* 
+   * round trip time of all replies, for nodes not measured yet
+   * */
+  int m_srtt;
+  int m_rttvar;
+
+  /* 
+   * transactions in flight: m_trans for ds_cancel_announce and
+   * ds_clear_trans to walk, each times out on its own timer; m_transidx
+   * keyed by address, port and transaction id, m_dests by address and
+   * port, both hashed with m_transkey
+   * */
     LIST_HEAD (trans_map, dht_ttype_trans_t) m_trans;
+  struct htable m_transidx;
+  struct htable m_dests;
+  unsigned int m_transkey;
+
+  /* 
+   * transactions waiting for one in flight to finish, oldest first;
+   * they hold their destination but have no id or timer yet
+   * */
+    SIMPLEQ_HEAD (trans_queue, dht_ttype_trans_t) m_admit;
+  unsigned int m_numwaiting;
+
+  /* 
+   * next transaction id counter and the key its hash is made with
+   * */
+  unsigned short m_tidnext;
+  unsigned int m_tidkey;
 
   int m_networkup;
 };
@@ -79,11 +198,14 @@ int ds_start (struct dht_server *, unsigned short);
 
 void ds_stop (struct dht_server *);
 
+void ds_set_query_limit (struct dht_server *, int, unsigned int);
+
 void ds_restart (struct dht_server *);
 
-void ds_ping (struct dht_server *, const char *, struct sockaddr_in *);
+void ds_ping (struct dht_server *, const char *, struct dht_addr *);
 
-void ds_find_node (struct dht_server *, struct dht_bucket *, const char *);
+void ds_find_node (struct dht_server *, int, struct dht_bucket *,
+		   const char *);
 
 void ds_announce (struct dht_server *, const char *, unsigned short, int,
 		  void (*)(const char *, const char *, void *), void *);
@@ -92,6 +214,10 @@ void ds_cancel_announce (struct dht_server *, const char *, void *);
 
 void ds_update (struct dht_server *);
 
-int ds_process (struct dht_server *, struct sockaddr_in *, char *, int);
+int ds_process (struct dht_server *, struct dht_addr *, char *, int);
+
+int ds_admit (struct dht_server *);
+
+void ds_sent (struct dht_server *, void *);
 
 #endif
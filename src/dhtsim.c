@@ -0,0 +1,569 @@
+/*
+* This file is part of the libttdht package
+* Copyright (C) <2008>  <Alf>
+*
+* Contact: Alf <naihe2010@126.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*
+*/
+/* @CFILE dhtsim.c
+*/
+
+#include "dhtsim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+static ssize_t dsim_read (void *, char *, size_t, struct sockaddr *,
+			  socklen_t *, int);
+static ssize_t dsim_write (void *, const char *, size_t,
+			   const struct sockaddr *, socklen_t);
+static int dsim_read_batch (void *, struct dht_packet *, int, int);
+static int dsim_write_batch (void *, struct dht_packet *, int);
+static void dsim_gettime (void *, struct timeval *);
+
+/* 
+ * a network of num routers in this process, every access link set up
+ * as link; seed makes the node ids and the link behaviour repeatable
+ * */
+struct dht_sim *
+dsim_init (int num, const struct dsim_link *link, unsigned int seed)
+{
+  struct dht_sim *sim;
+  struct dsim_node *sn;
+  dhtio_t io;
+  int i;
+
+  sim = (struct dht_sim *) calloc (1, sizeof (struct dht_sim));
+  assert (sim);
+
+  sim->m_nodes = (struct dsim_node *) calloc (num, sizeof (struct dsim_node));
+  assert (sim->m_nodes);
+  sim->m_numnodes = num;
+
+  SIMPLEQ_INIT (&sim->m_free);
+
+  sim->m_random = seed ^ 0x9E3779B9U;
+  if (sim->m_random == 0)
+    sim->m_random = 1;
+
+  sim->m_clock.tv_sec = DSIM_EPOCH;
+  sim->m_clock.tv_usec = 0;
+  sim->m_now = (unsigned int) (sim->m_clock.tv_sec * 1000);
+
+  /* 
+   * the routers draw their ids and tokens from rand
+   * */
+  srand (seed);
+
+  memset (&io, 0, sizeof io);
+  io.read = dsim_read;
+  io.write = dsim_write;
+  io.read_batch = dsim_read_batch;
+  io.write_batch = dsim_write_batch;
+  io.gettime = dsim_gettime;
+
+  for (i = 0; i < num; i++)
+    {
+      sn = DSIM_NODE (sim, i);
+      sn->m_sim = sim;
+      sn->m_index = i;
+      sn->m_link = *link;
+      sn->m_linkfree = sim->m_now;
+      SIMPLEQ_INIT (&sn->m_inbox);
+
+      da_init (&sn->m_addr, AF_INET);
+      sn->m_addr.sin.sin_addr.s_addr = htonl (DSIM_ADDR_BASE + i);
+      da_set_port (&sn->m_addr, DSIM_PORT);
+
+      io.fdp = sn;
+      sn->m_router = dr_init (NULL, DSIM_PORT, &io);
+      dr_start (sn->m_router, DSIM_PORT);
+    }
+
+  return sim;
+}
+
+void
+dsim_cleanup (struct dht_sim *sim)
+{
+  struct dsim_packet *pkt;
+  struct dsim_node *sn;
+  int i;
+
+  for (i = 0; i < sim->m_numnodes; i++)
+    {
+      sn = DSIM_NODE (sim, i);
+      dr_cleanup (sn->m_router);
+
+      while ((pkt = SIMPLEQ_FIRST (&sn->m_inbox)) != NULL)
+	{
+	  SIMPLEQ_REMOVE_HEAD (&sn->m_inbox, pkt, entries);
+	  free (pkt);
+	}
+    }
+
+  for (i = 0; i < sim->m_numheap; i++)
+    free (sim->m_heap[i]);
+
+  while ((pkt = SIMPLEQ_FIRST (&sim->m_free)) != NULL)
+    {
+      SIMPLEQ_REMOVE_HEAD (&sim->m_free, pkt, entries);
+      free (pkt);
+    }
+
+  free (sim->m_heap);
+  free (sim->m_nodes);
+  free (sim);
+}
+
+void
+dsim_set_link (struct dht_sim *sim, int i, const struct dsim_link *link)
+{
+  struct dsim_node *sn;
+
+  /* 
+   * the uplink of a node that was not limited so far is free now
+   * */
+  sn = DSIM_NODE (sim, i);
+  sn->m_link = *link;
+  if ((int) (sn->m_linkfree - sim->m_now) < 0)
+    sn->m_linkfree = sim->m_now;
+}
+
+/* 
+ * give node from the address of node to as a bootstrap contact
+ * */
+void
+dsim_contact (struct dht_sim *sim, int from, int to)
+{
+  char host[16];
+  unsigned int a;
+
+  a = DSIM_ADDR_BASE + to;
+  snprintf (host, sizeof host, "%u.%u.%u.%u", a >> 24, (a >> 16) & 0xFF,
+	    (a >> 8) & 0xFF, a & 0xFF);
+  dr_add_contact (DSIM_ROUTER (sim, from), host, DSIM_PORT);
+}
+
+/* 
+ * xorshift, the simulation keeps its own stream so the routers' use of
+ * rand does not change the link behaviour
+ * */
+unsigned int
+dsim_random (struct dht_sim *sim)
+{
+  unsigned int x;
+
+  x = sim->m_random;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  sim->m_random = x;
+
+  return x;
+}
+
+/* 
+ * a before b on the wire
+ * */
+static int
+dsim_before (const struct dsim_packet *a, const struct dsim_packet *b)
+{
+  if (a->m_due != b->m_due)
+    return (int) (a->m_due - b->m_due) < 0;
+
+  return (int) (a->m_seq - b->m_seq) < 0;
+}
+
+static void
+dsim_heap_push (struct dht_sim *sim, struct dsim_packet *pkt)
+{
+  struct dsim_packet *tmp;
+  int i, parent;
+
+  if (sim->m_numheap == sim->m_maxheap)
+    {
+      sim->m_maxheap = sim->m_maxheap ? sim->m_maxheap * 2 : 256;
+      sim->m_heap = (struct dsim_packet **)
+	realloc (sim->m_heap, sim->m_maxheap * sizeof (struct dsim_packet *));
+      assert (sim->m_heap);
+    }
+
+  i = sim->m_numheap++;
+  sim->m_heap[i] = pkt;
+  while (i > 0)
+    {
+      parent = (i - 1) / 2;
+      if (!dsim_before (sim->m_heap[i], sim->m_heap[parent]))
+	break;
+      tmp = sim->m_heap[i];
+      sim->m_heap[i] = sim->m_heap[parent];
+      sim->m_heap[parent] = tmp;
+      i = parent;
+    }
+}
+
+static struct dsim_packet *
+dsim_heap_pop (struct dht_sim *sim)
+{
+  struct dsim_packet *pkt, *tmp;
+  int i, child;
+
+  pkt = sim->m_heap[0];
+  sim->m_heap[0] = sim->m_heap[--sim->m_numheap];
+
+  i = 0;
+  while ((child = 2 * i + 1) < sim->m_numheap)
+    {
+      if (child + 1 < sim->m_numheap
+	  && dsim_before (sim->m_heap[child + 1], sim->m_heap[child]))
+	child++;
+      if (!dsim_before (sim->m_heap[child], sim->m_heap[i]))
+	break;
+      tmp = sim->m_heap[i];
+      sim->m_heap[i] = sim->m_heap[child];
+      sim->m_heap[child] = tmp;
+      i = child;
+    }
+
+  return pkt;
+}
+
+static struct dsim_packet *
+dsim_packet_get (struct dht_sim *sim)
+{
+  struct dsim_packet *pkt;
+
+  pkt = SIMPLEQ_FIRST (&sim->m_free);
+  if (pkt != NULL)
+    {
+      SIMPLEQ_REMOVE_HEAD (&sim->m_free, pkt, entries);
+      return pkt;
+    }
+
+  pkt = (struct dsim_packet *) malloc (sizeof (struct dsim_packet));
+  assert (pkt);
+  sim->m_numpackets++;
+
+  return pkt;
+}
+
+/* 
+ * the node listening on sa, -1 if there is none
+ * */
+static int
+dsim_lookup (struct dht_sim *sim, const struct sockaddr *sa, socklen_t salen)
+{
+  struct dht_addr addr;
+  unsigned int i;
+
+  memset (&addr, 0, sizeof addr);
+  memcpy (&addr, sa, salen < sizeof addr ? salen : sizeof addr);
+  if (da_normalize (&addr) < 0 || DA_FAMILY (&addr) != AF_INET
+      || DA_PORT (&addr) != htons (DSIM_PORT))
+    return -1;
+
+  i = ntohl (addr.sin.sin_addr.s_addr) - DSIM_ADDR_BASE;
+
+  return i < (unsigned int) sim->m_numnodes ? (int) i : -1;
+}
+
+static int
+dsim_is_query (const char *buf, size_t size)
+{
+  size_t i;
+
+  for (i = 0; i + 6 <= size; i++)
+    {
+      if (memcmp (buf + i, "1:y1:q", 6) == 0)
+	return 1;
+    }
+
+  return 0;
+}
+
+static unsigned int
+dsim_delay (struct dht_sim *sim, const struct dsim_link *link)
+{
+  if (link->jitter == 0)
+    return link->latency;
+
+  return link->latency + dsim_random (sim) % (link->jitter + 1);
+}
+
+static int
+dsim_lost (struct dht_sim *sim, const struct dsim_link *link)
+{
+  return link->loss > 0 && dsim_random (sim) % 1000 < link->loss;
+}
+
+/* 
+ * put a datagram on the wire, it leaves once the uplink has sent what
+ * is ahead of it; unknown destinations, a full uplink and loss drop it
+ * silently like a real network does
+ * */
+static ssize_t
+dsim_write (void *p, const char *buf, size_t size, const struct sockaddr *sa,
+	    socklen_t salen)
+{
+  struct dsim_node *sn, *dst;
+  struct dsim_packet *pkt;
+  struct dht_sim *sim;
+  unsigned int depart;
+  int to, query;
+
+  sn = (struct dsim_node *) p;
+  sim = sn->m_sim;
+
+  query = dsim_is_query (buf, size);
+  sn->m_sent++;
+  if (query)
+    sn->m_queries++;
+  sim->m_sent++;
+  sim->m_bytes += size;
+
+  to = dsim_lookup (sim, sa, salen);
+  if (to < 0 || size > DR_SIZE_PACKET)
+    {
+      sim->m_dropped++;
+      return size;
+    }
+  dst = DSIM_NODE (sim, to);
+
+  depart = sim->m_now;
+  if (sn->m_link.bandwidth > 0)
+    {
+      if ((int) (sn->m_linkfree - depart) > 0)
+	depart = sn->m_linkfree;
+      if (depart - sim->m_now > DSIM_MAX_BACKLOG)
+	{
+	  sim->m_dropped++;
+	  return size;
+	}
+      sn->m_linkfree = depart
+	+ (unsigned int) ((unsigned long long) size * 1000
+			  / sn->m_link.bandwidth);
+    }
+
+  if (dsim_lost (sim, &sn->m_link) || dsim_lost (sim, &dst->m_link))
+    {
+      sim->m_lost++;
+      return size;
+    }
+
+  pkt = dsim_packet_get (sim);
+  pkt->m_due = depart + dsim_delay (sim, &sn->m_link)
+    + dsim_delay (sim, &dst->m_link);
+  pkt->m_seq = sim->m_seq++;
+  pkt->m_from = sn->m_index;
+  pkt->m_to = to;
+  pkt->m_hop = query ? sn->m_hop + 1 : sn->m_hop;
+  pkt->m_len = size;
+  memcpy (pkt->m_buf, buf, size);
+
+  dsim_heap_push (sim, pkt);
+
+  return size;
+}
+
+static int
+dsim_write_batch (void *p, struct dht_packet *pkts, int num)
+{
+  int i;
+
+  for (i = 0; i < num; i++)
+    dsim_write (p, pkts[i].buf, pkts[i].len, &pkts[i].addr.sa,
+		pkts[i].addrlen);
+
+  return num;
+}
+
+/* 
+ * hand the next arrived datagram to the router, the simulation never
+ * blocks so the wait is ignored
+ * */
+static ssize_t
+dsim_read (void *p, char *buf, size_t size, struct sockaddr *sa,
+	   socklen_t *salen, int tim)
+{
+  struct dsim_node *sn, *src;
+  struct dsim_packet *pkt;
+  struct dht_sim *sim;
+  size_t len;
+
+  sn = (struct dsim_node *) p;
+  sim = sn->m_sim;
+
+  pkt = SIMPLEQ_FIRST (&sn->m_inbox);
+  if (sn->m_hold || pkt == NULL)
+    return -1;
+  SIMPLEQ_REMOVE_HEAD (&sn->m_inbox, pkt, entries);
+
+  src = DSIM_NODE (sim, pkt->m_from);
+  len = (size_t) pkt->m_len < size ? (size_t) pkt->m_len : size;
+  memcpy (buf, pkt->m_buf, len);
+  if (*salen > sizeof (struct sockaddr_in))
+    *salen = sizeof (struct sockaddr_in);
+  memcpy (sa, &src->m_addr.sin, *salen);
+
+  sn->m_hop = pkt->m_hop;
+  sn->m_received++;
+  sim->m_delivered++;
+
+  SIMPLEQ_INSERT_HEAD (&sim->m_free, pkt, entries);
+
+  return len;
+}
+
+static int
+dsim_read_batch (void *p, struct dht_packet *pkts, int num, int tim)
+{
+  pkts->addrlen = sizeof (struct dht_addr);
+  pkts->len = dsim_read (p, pkts->buf, pkts->size, &pkts->addr.sa,
+			 &pkts->addrlen, tim);
+
+  return pkts->len < 0 ? -1 : 1;
+}
+
+/* 
+ * deliver the datagrams that are due, then let every router run its
+ * due timers and actions, write out what was queued from outside its
+ * loop and handle what arrived, one datagram at a time
+ * return the number of router iterations
+ * */
+int
+dsim_step (struct dht_sim *sim)
+{
+  struct dsim_packet *pkt;
+  struct dsim_node *sn;
+  int i, count;
+
+  while (sim->m_numheap > 0 && (int) (sim->m_heap[0]->m_due - sim->m_now) <= 0)
+    {
+      pkt = dsim_heap_pop (sim);
+      SIMPLEQ_INSERT_TAIL (&DSIM_NODE (sim, pkt->m_to)->m_inbox, pkt,
+			   entries);
+    }
+
+  count = 0;
+  for (i = 0; i < sim->m_numnodes; i++)
+    {
+      sn = DSIM_NODE (sim, i);
+
+      if (dr_next_timeout (sn->m_router) == 0
+	  || (DR_NUM_QUEUED (sn->m_router) > 0
+	      && !DR_IS_PACED (sn->m_router)))
+	{
+	  sn->m_hold = 1;
+	  sn->m_hop = 0;
+	  dr_process_once (sn->m_router, 0);
+	  sn->m_hold = 0;
+	  count++;
+	}
+
+      while (!SIMPLEQ_EMPTY (&sn->m_inbox))
+	{
+	  dr_process_once (sn->m_router, 0);
+	  count++;
+	}
+    }
+
+  return count;
+}
+
+/* 
+ * msec until dsim_step has work, -1 if nothing is scheduled
+ * */
+int
+dsim_next_timeout (struct dht_sim *sim)
+{
+  struct dsim_node *sn;
+  int i, timeout, wait;
+
+  timeout = -1;
+  if (sim->m_numheap > 0)
+    {
+      timeout = (int) (sim->m_heap[0]->m_due - sim->m_now);
+      if (timeout < 0)
+	timeout = 0;
+    }
+
+  for (i = 0; i < sim->m_numnodes && timeout != 0; i++)
+    {
+      sn = DSIM_NODE (sim, i);
+      wait = SIMPLEQ_EMPTY (&sn->m_inbox) ? dr_next_timeout (sn->m_router) : 0;
+      if (wait >= 0 && (timeout < 0 || wait < timeout))
+	timeout = wait;
+    }
+
+  return timeout;
+}
+
+/* 
+ * every router of the simulation reads the same virtual clock
+ * */
+static void
+dsim_gettime (void *p, struct timeval *tv)
+{
+  *tv = ((struct dsim_node *) p)->m_sim->m_clock;
+}
+
+/* 
+ * move the virtual clock msec ahead
+ * */
+void
+dsim_advance (struct dht_sim *sim, unsigned int msec)
+{
+  struct timeval tv;
+
+  tv.tv_sec = msec / 1000;
+  tv.tv_usec = (msec % 1000) * 1000;
+  timeradd (&sim->m_clock, &tv, &sim->m_clock);
+  sim->m_now += msec;
+}
+
+/* 
+ * run the network for msec of virtual time, jumping from one due
+ * datagram or timer to the next
+ * */
+void
+dsim_run (struct dht_sim *sim, unsigned int msec)
+{
+  unsigned int end;
+  int left, wait;
+
+  end = sim->m_now + msec;
+  for (;;)
+    {
+      dsim_step (sim);
+
+      left = (int) (end - sim->m_now);
+      if (left <= 0)
+	break;
+
+      /* 
+       * a timer due within the current msec has not fired yet, so the
+       * clock always moves on
+       * */
+      wait = dsim_next_timeout (sim);
+      if (wait < 0 || wait > left)
+	wait = left;
+      dsim_advance (sim, wait > 0 ? wait : 1);
+    }
+}
@@ -0,0 +1,167 @@
+/*
+* This file is part of the libttdht package
+* Copyright (C) <2008>  <Alf>
+*
+* Contact: Alf <naihe2010@126.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*
+*/
+/* @CFILE dhtsim.h
+*/
+
+#ifndef _DHT_SIM_H_
+#define _DHT_SIM_H_
+
+#include "dhtrouter.h"
+
+/* 
+ * node i of a simulation listens on 10.0.0.1 + i
+ * */
+#define DSIM_ADDR_BASE          0x0A000001
+#define DSIM_PORT               6881
+
+/* 
+ * the virtual clock starts at this second, so runs with the same seed
+ * repeat exactly
+ * */
+#define DSIM_EPOCH              1262304000
+
+/* 
+ * msec of traffic an uplink queues before it drops
+ * */
+#define DSIM_MAX_BACKLOG        1000
+
+#define DSIM_NODE(sim, i)       (&(sim)->m_nodes[i])
+#define DSIM_ROUTER(sim, i)     ((sim)->m_nodes[i].m_router)
+
+/* 
+ * the access link of one node; a datagram crosses the sender's and the
+ * receiver's link, each adds latency plus up to jitter msec and loses
+ * loss per mille of the datagrams, bandwidth is the uplink in bytes
+ * per second, 0 does not limit
+ * */
+struct dsim_link
+{
+  unsigned int latency;
+  unsigned int jitter;
+  unsigned int loss;
+  unsigned int bandwidth;
+};
+
+struct dsim_packet
+{
+  SIMPLEQ_ENTRY (dsim_packet) entries;
+
+  /* 
+   * delivery time and sequence number, equal times arrive in send
+   * order
+   * */
+  unsigned int m_due;
+  unsigned int m_seq;
+
+  int m_from;
+  int m_to;
+
+  /* 
+   * queries answering a datagram of hop h are hop h + 1, replies keep
+   * the hop of their query
+   * */
+  int m_hop;
+
+  int m_len;
+  char m_buf[DR_SIZE_PACKET];
+};
+
+SIMPLEQ_HEAD (dsim_packet_list, dsim_packet);
+
+struct dht_sim;
+
+struct dsim_node
+{
+  struct dht_sim *m_sim;
+  int m_index;
+
+  struct dht_addr m_addr;
+  struct dht_router *m_router;
+
+  struct dsim_link m_link;
+  unsigned int m_linkfree;
+
+  /* 
+   * arrived datagrams, handed to the router one per dr_process_once so
+   * every send can be traced to what caused it; m_hold keeps them back
+   * while the timers run
+   * */
+  struct dsim_packet_list m_inbox;
+  int m_hold;
+  int m_hop;
+
+  unsigned int m_sent;
+  unsigned int m_queries;
+  unsigned int m_received;
+};
+
+struct dht_sim
+{
+  struct dsim_node *m_nodes;
+  int m_numnodes;
+
+  /* 
+   * datagrams on the wire in a binary min-heap on delivery time, the
+   * delivered ones are kept for reuse
+   * */
+  struct dsim_packet **m_heap;
+  int m_numheap;
+  int m_maxheap;
+  struct dsim_packet_list m_free;
+  int m_numpackets;
+  unsigned int m_seq;
+
+  unsigned int m_random;
+
+  /* 
+   * the virtual clock every router reads, m_now is the same time in
+   * wrapping msec; it only moves in dsim_run
+   * */
+  struct timeval m_clock;
+  unsigned int m_now;
+
+  unsigned int m_sent;
+  unsigned int m_delivered;
+  unsigned int m_lost;
+  unsigned int m_dropped;
+  unsigned long long m_bytes;
+};
+
+struct dht_sim *dsim_init (int, const struct dsim_link *, unsigned int);
+
+void dsim_cleanup (struct dht_sim *);
+
+void dsim_set_link (struct dht_sim *, int, const struct dsim_link *);
+
+void dsim_contact (struct dht_sim *, int, int);
+
+unsigned int dsim_random (struct dht_sim *);
+
+int dsim_step (struct dht_sim *);
+
+int dsim_next_timeout (struct dht_sim *);
+
+void dsim_advance (struct dht_sim *, unsigned int);
+
+void dsim_run (struct dht_sim *, unsigned int);
+
+#endif
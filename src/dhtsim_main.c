@@ -0,0 +1,308 @@
+/*
+* This file is part of the libttdht package
+* Copyright (C) <2008>  <Alf>
+*
+* Contact: Alf <naihe2010@126.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*
+*/
+/* @CFILE dhtsim_main.c
+*/
+
+/* 
+ * scenario driver for the simulated network: bootstrap a network, let
+ * some nodes announce keys, look the keys up from other nodes and
+ * report what the lookups cost
+ * */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "dhtsim.h"
+#include "dhtlog.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_MALLINFO2
+#include <malloc.h>
+#endif
+
+#define SIM_BOOTSTRAP_ROUNDS    3
+#define SIM_TIMEOUT_ROUND       1000
+#define SIM_TIMEOUT_SEARCH      120000
+
+struct lookup
+{
+  struct dht_sim *sim;
+  int node;
+  unsigned int start;
+
+  int found;
+  unsigned int latency;
+  int hops;
+  unsigned int queries;
+};
+
+static void
+lookup_found (const char *key, const char *peer, void *arg)
+{
+  struct lookup *lk;
+  struct dsim_node *sn;
+
+  lk = (struct lookup *) arg;
+  if (lk->found)
+    return;
+
+  sn = DSIM_NODE (lk->sim, lk->node);
+  lk->found = 1;
+  lk->latency = lk->sim->m_now - lk->start;
+  lk->hops = sn->m_hop;
+  lk->queries = sn->m_queries - lk->queries;
+}
+
+/* 
+ * bytes allocated from the heap, -1 if it can not be told
+ * */
+static long
+heap_bytes (void)
+{
+#ifdef HAVE_MALLINFO2
+  struct mallinfo2 mi;
+
+  mi = mallinfo2 ();
+  return (long) (mi.uordblks + mi.hblkhd);
+#else
+  return -1;
+#endif
+}
+
+static int
+cmp_uint (const void *a, const void *b)
+{
+  unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void
+usage (const char *prog)
+{
+  fprintf (stderr,
+	   "usage: %s [-n nodes] [-c contacts] [-k keys] [-l lookups]\n"
+	   "\t[-d latency] [-j jitter] [-p loss] [-b bandwidth] [-s seed]\n"
+	   "\t[-t timeout] [-v]\n\n"
+	   "\tlatency and jitter are msec per access link, loss is per mille\n"
+	   "\tper access link and bandwidth is uplink bytes per second;\n"
+	   "\tannounces and lookups get timeout msec to finish\n",
+	   prog);
+  exit (1);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct dsim_link link = { 40, 10, 10, 0 };
+  struct dht_sim *sim;
+  struct lookup *lookups;
+  unsigned int seed, start, sent, timeout, *latencies;
+  unsigned long nodes;
+  long base, heap;
+  clock_t cpu;
+  int num, contacts, numkeys, numlookups, *order;
+  int i, j, c, tmp, found, hops, maxhops, queries;
+  char key[64];
+
+  num = 500;
+  contacts = 8;
+  numkeys = 10;
+  numlookups = 50;
+  seed = 1;
+  timeout = SIM_TIMEOUT_SEARCH;
+  log_setlevel (3);
+
+  while ((c = getopt (argc, argv, "n:c:k:l:d:j:p:b:s:t:v")) != -1)
+    {
+      switch (c)
+	{
+	case 'n':
+	  num = atoi (optarg);
+	  break;
+	case 'c':
+	  contacts = atoi (optarg);
+	  break;
+	case 'k':
+	  numkeys = atoi (optarg);
+	  break;
+	case 'l':
+	  numlookups = atoi (optarg);
+	  break;
+	case 'd':
+	  link.latency = atoi (optarg);
+	  break;
+	case 'j':
+	  link.jitter = atoi (optarg);
+	  break;
+	case 'p':
+	  link.loss = atoi (optarg);
+	  break;
+	case 'b':
+	  link.bandwidth = atoi (optarg);
+	  break;
+	case 's':
+	  seed = strtoul (optarg, NULL, 0);
+	  break;
+	case 't':
+	  timeout = atoi (optarg);
+	  break;
+	case 'v':
+	  log_setlevel (1);
+	  break;
+	default:
+	  usage (argv[0]);
+	}
+    }
+
+  if (num < 2 || numkeys < 1 || numlookups < 1)
+    usage (argv[0]);
+  if (numlookups > num)
+    numlookups = num;
+
+  printf ("%d nodes, links %u+%u msec, %u.%u%% loss, ", num, link.latency,
+	  link.jitter, link.loss / 10, link.loss % 10);
+  if (link.bandwidth > 0)
+    printf ("%u bytes/s uplink\n", link.bandwidth);
+  else
+    printf ("unlimited uplink\n");
+
+  /* 
+   * every node knows a few nodes that joined before it
+   * */
+  cpu = clock ();
+  base = heap_bytes ();
+  sim = dsim_init (num, &link, seed);
+  for (i = 1; i < num; i++)
+    {
+      for (j = 0; j < contacts; j++)
+	dsim_contact (sim, i, dsim_random (sim) % i);
+    }
+
+  start = sim->m_now;
+  sent = sim->m_sent;
+  dsim_run (sim, SIM_TIMEOUT_ROUND);
+  for (j = 0; j < SIM_BOOTSTRAP_ROUNDS; j++)
+    {
+      for (i = 0; i < num; i++)
+	dr_bootstrap (DSIM_ROUTER (sim, i));
+      dsim_run (sim, SIM_TIMEOUT_ROUND);
+    }
+
+  nodes = 0;
+  for (i = 0; i < num; i++)
+    nodes += DR_NUM_NODES (DSIM_ROUTER (sim, i));
+  printf ("bootstrap: %u msec, %u packets, %.1f nodes per table\n",
+	  sim->m_now - start, sim->m_sent - sent, (double) nodes / num);
+
+  heap = heap_bytes ();
+  if (base >= 0 && heap >= 0)
+    printf ("memory: %ld bytes per node\n",
+	    (long) (heap - base
+		    - (long) sim->m_numpackets * sizeof (struct dsim_packet))
+	    / num);
+
+  for (i = 0; i < numkeys; i++)
+    {
+      snprintf (key, sizeof key, "dhtsim-%u-%d", seed, i);
+      dr_pub (DSIM_ROUTER (sim, dsim_random (sim) % num), key, 10000 + i);
+    }
+  dsim_run (sim, timeout);
+
+  /* 
+   * each lookup runs on its own node so the queries it sends can be
+   * told apart
+   * */
+  order = (int *) calloc (num, sizeof (int));
+  lookups = (struct lookup *) calloc (numlookups, sizeof (struct lookup));
+  latencies = (unsigned int *) calloc (numlookups, sizeof (unsigned int));
+  if (order == NULL || lookups == NULL || latencies == NULL)
+    {
+      ttdht_err ("Memory error\n");
+      return 1;
+    }
+
+  for (i = 0; i < num; i++)
+    order[i] = i;
+  for (i = num - 1; i > 0; i--)
+    {
+      j = dsim_random (sim) % (i + 1);
+      tmp = order[i];
+      order[i] = order[j];
+      order[j] = tmp;
+    }
+
+  sent = sim->m_sent;
+  for (i = 0; i < numlookups; i++)
+    {
+      lookups[i].sim = sim;
+      lookups[i].node = order[i];
+      lookups[i].start = sim->m_now;
+      lookups[i].queries = DSIM_NODE (sim, order[i])->m_queries;
+
+      snprintf (key, sizeof key, "dhtsim-%u-%d", seed,
+		(int) (dsim_random (sim) % numkeys));
+      dr_get (DSIM_ROUTER (sim, order[i]), key, lookup_found, &lookups[i]);
+    }
+  dsim_run (sim, timeout);
+
+  found = hops = maxhops = queries = 0;
+  for (i = 0; i < numlookups; i++)
+    {
+      if (!lookups[i].found)
+	continue;
+
+      latencies[found++] = lookups[i].latency;
+      hops += lookups[i].hops;
+      if (lookups[i].hops > maxhops)
+	maxhops = lookups[i].hops;
+      queries += lookups[i].queries;
+    }
+
+  printf ("lookups: %d of %d found, %.1f packets per lookup\n", found,
+	  numlookups, (double) (sim->m_sent - sent) / numlookups);
+  if (found > 0)
+    {
+      qsort (latencies, found, sizeof (unsigned int), cmp_uint);
+      printf ("latency: median %u, p90 %u, max %u msec\n",
+	      latencies[found / 2], latencies[found * 9 / 10],
+	      latencies[found - 1]);
+      printf ("hops: mean %.1f, max %d\n", (double) hops / found, maxhops);
+      printf ("queries to first result: %.1f\n", (double) queries / found);
+    }
+  printf ("network: %u sent, %u delivered, %u lost, %u dropped\n",
+	  sim->m_sent, sim->m_delivered, sim->m_lost, sim->m_dropped);
+  printf ("simulated %u msec in %.1f sec of cpu\n", sim->m_now - start,
+	  (double) (clock () - cpu) / CLOCKS_PER_SEC);
+
+  dsim_cleanup (sim);
+  free (latencies);
+  free (lookups);
+  free (order);
+
+  return 0;
+}
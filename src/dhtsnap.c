@@ -0,0 +1,185 @@
+/*
+* This file is part of the libttdht package
+* Copyright (C) <2008>  <Alf>
+*
+* Contact: Alf <naihe2010@126.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*
+*/
+/* @CFILE dhtsnap.c
+*/
+
+#include "dhtsnap.h"
+#include "dhtbucket.h"
+#include "dhtnode.h"
+#include "dhtrouter.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+static void
+dsn_copy_table (struct dht_snap_table *st, struct dht_table *tb)
+{
+  struct db_chain *dc;
+  struct dht_bucket *bucket;
+  struct dht_snap_bucket *sb;
+  struct dht_snap_node *sn;
+  struct dht_node *node;
+  char first[HASH_STRING_LEN + 1];
+
+  /* 
+   * walking away from the all zero id visits the leaves in prefix order
+   * */
+  hashsg_clear (first, 0);
+  dc = dbc_init (tb->m_root, first);
+
+  do
+    {
+      bucket = dbc_bucket (dc);
+
+      sb = &st->m_buckets[st->m_numbuckets++];
+      hashsg_cpy (sb->m_prefix, bucket->m_prefix);
+      sb->m_depth = bucket->m_depth;
+      sb->m_capacity = bucket->m_capacity;
+      sb->m_lastchanged = bucket->m_lastchanged;
+      sb->m_first = st->m_numnodes;
+
+      LIST_FOREACH (node, bucket->m_nodes, entries)
+      {
+	sn = &st->m_nodes[st->m_numnodes++];
+	hashsg_cpy (sn->hashsg, node->hashsg);
+	sn->m_sockaddr = node->m_sockaddr;
+	sn->m_lastseen = node->m_lastseen;
+	sn->m_good = DN_IS_GOOD (node);
+	sn->m_bad = DN_IS_BAD (node);
+	sn->m_rtt = DN_RTT (node);
+      }
+
+      sb->m_size = st->m_numnodes - sb->m_first;
+    }
+  while (dbc_next (dc) != NULL);
+
+  dbc_cleanup (dc);
+}
+
+/* 
+ * copy the routing tables into one block, the caller owns the
+ * returned reference
+ * */
+struct dht_snapshot *
+dsn_init (struct dht_router *dr)
+{
+  struct dht_snapshot *dsn;
+  struct dht_snap_node *nodes;
+  struct dht_snap_bucket *buckets;
+  struct dht_table *tb;
+  size_t numnodes, numbuckets;
+  int i;
+
+  assert (DR_NUM_TABLES == DSN_NUM_TABLES);
+
+  numnodes = 0;
+  numbuckets = 0;
+  for (i = 0; i < DR_NUM_TABLES; i++)
+    {
+      numnodes += MAP_SIZE (&dr->m_tables[i].m_nodes);
+      numbuckets += dr->m_tables[i].m_numbuckets;
+    }
+
+  dsn = (struct dht_snapshot *) calloc (1, sizeof (struct dht_snapshot)
+					+ numnodes *
+					sizeof (struct dht_snap_node) +
+					numbuckets *
+					sizeof (struct dht_snap_bucket));
+  assert (dsn);
+
+  dsn->m_refs = 1;
+  dsn->m_created = dr_time (dr);
+  dsn->m_next = NULL;
+  hashsg_cpy (dsn->m_self, dr->node->hashsg);
+
+  nodes = (struct dht_snap_node *) (dsn + 1);
+  buckets = (struct dht_snap_bucket *) (nodes + numnodes);
+
+  for (i = 0; i < DR_NUM_TABLES; i++)
+    {
+      tb = &dr->m_tables[i];
+
+      dsn->m_tables[i].af = tb->af;
+      dsn->m_tables[i].m_nodes = nodes;
+      dsn->m_tables[i].m_buckets = buckets;
+
+      dsn_copy_table (&dsn->m_tables[i], tb);
+
+      nodes += dsn->m_tables[i].m_numnodes;
+      buckets += dsn->m_tables[i].m_numbuckets;
+    }
+
+  return dsn;
+}
+
+void
+dsn_acquire (struct dht_snapshot *dsn)
+{
+  DHT_ATOMIC_INC (&dsn->m_refs);
+}
+
+void
+dsn_release (struct dht_snapshot *dsn)
+{
+  if (DHT_ATOMIC_DEC (&dsn->m_refs) == 0)
+    free (dsn);
+}
+
+/* 
+ * fill nodes with up to max good or questionable nodes of the given
+ * family sorted by distance to target, returns the count
+ * */
+int
+dsn_closest_nodes (struct dht_snapshot *dsn, int af, const char *target,
+		   const struct dht_snap_node **nodes, int max)
+{
+  struct dht_snap_table *st;
+  const struct dht_snap_node *sn;
+  int i, j, count;
+
+  st = DSN_TABLE (dsn, af);
+  count = 0;
+
+  for (i = 0; i < st->m_numnodes; i++)
+    {
+      sn = &st->m_nodes[i];
+      if (sn->m_bad)
+	continue;
+
+      for (j = count; j > 0 && hashsg_closer (target, sn->hashsg,
+					       nodes[j - 1]->hashsg); j--)
+	{
+	  if (j < max)
+	    nodes[j] = nodes[j - 1];
+	}
+
+      if (j < max)
+	{
+	  nodes[j] = sn;
+	  if (count < max)
+	    count++;
+	}
+    }
+
+  return count;
+}
@@ -0,0 +1,111 @@
+/*
+* This file is part of the libttdht package
+* Copyright (C) <2008>  <Alf>
+*
+* Contact: Alf <naihe2010@126.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*
+*/
+/* @CFILE dhtsnap.h
+*/
+
+#ifndef _DHT_SNAP_H_
+#define _DHT_SNAP_H_
+
+#include "dhtlib.h"
+#include "dhtaddr.h"
+
+#include <time.h>
+
+#define DSN_NUM_TABLES              2
+
+struct dht_router;
+
+/* 
+ * immutable copies of the routing tables, published by the network
+ * thread and read by application threads without locks
+ * */
+struct dht_snap_node
+{
+  char hashsg[HASH_STRING_LEN + 1];
+
+  struct dht_addr m_sockaddr;
+
+  time_t m_lastseen;
+  int m_good;
+  int m_bad;
+  int m_rtt;
+};
+
+struct dht_snap_bucket
+{
+  char m_prefix[HASH_STRING_LEN + 1];
+  int m_depth;
+  int m_capacity;
+
+  time_t m_lastchanged;
+
+  /* 
+   * the nodes of this bucket are m_nodes[m_first .. m_first + m_size)
+   * of the table
+   * */
+  int m_first;
+  int m_size;
+};
+
+struct dht_snap_table
+{
+  int af;
+
+  int m_numnodes;
+  struct dht_snap_node *m_nodes;
+
+  /* 
+   * leaves in prefix order
+   * */
+  int m_numbuckets;
+  struct dht_snap_bucket *m_buckets;
+};
+
+struct dht_snapshot
+{
+  volatile long m_refs;
+
+  time_t m_created;
+
+  char m_self[HASH_STRING_LEN + 1];
+
+  struct dht_snap_table m_tables[DSN_NUM_TABLES];
+
+  /* 
+   * retire list of the publishing router
+   * */
+  struct dht_snapshot *m_next;
+};
+
+#define DSN_TABLE(dsn, af)          (&(dsn)->m_tables[(af) == AF_INET6 ? 1 : 0])
+#define DSN_NUM_NODES(dsn)          ((dsn)->m_tables[0].m_numnodes + (dsn)->m_tables[1].m_numnodes)
+
+struct dht_snapshot *dsn_init (struct dht_router *);
+
+void dsn_acquire (struct dht_snapshot *);
+
+void dsn_release (struct dht_snapshot *);
+
+int dsn_closest_nodes (struct dht_snapshot *, int, const char *,
+		       const struct dht_snap_node **, int);
+
+#endif
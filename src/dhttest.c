@@ -31,41 +31,49 @@
 #include <stdlib.h>
 #include <assert.h>
 
-static int dht_fd;
-static ssize_t dht_read (void *, char *, size_t, struct sockaddr_in *, int);
-static ssize_t dht_write (void *, const char *, size_t, struct sockaddr_in *);
+static int dht_sock;
+static ssize_t dht_read (void *, char *, size_t, struct sockaddr *,
+			 socklen_t *, int);
+static ssize_t dht_write (void *, const char *, size_t,
+			  const struct sockaddr *, socklen_t);
 
 int
 main (int argc, char *argv[])
 {
-  struct sockaddr_in addr[1];
+  struct sockaddr_in6 addr[1];
   dhtio_t io[1] = { {
-      &dht_fd,
+      &dht_sock,
         dht_read,
         dht_write
   }};
   dht_t *dht;
+  int off = 0;
 
-  dht_fd = socket (AF_INET, SOCK_DGRAM, 0);
-  assert (dht_fd > 0);
+  /* 
+   * one dual stack socket serves both the IPv4 and IPv6 tables
+   * */
+  dht_sock = socket (AF_INET6, SOCK_DGRAM, 0);
+  assert (dht_sock > 0);
+  setsockopt (dht_sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof off);
 
-  addr->sin_family = AF_INET;
-  addr->sin_addr.s_addr = inet_addr ("0.0.0.0");
-  addr->sin_port = htons (6681);
-  memset (addr->sin_zero, 0, 8);
+  memset (addr, 0, sizeof (struct sockaddr_in6));
+  addr->sin6_family = AF_INET6;
+  addr->sin6_addr = in6addr_any;
+  addr->sin6_port = htons (6681);
 
-  assert (!bind (dht_fd, (struct sockaddr *) addr, sizeof (struct sockaddr)));
+  assert (!bind (dht_sock, (struct sockaddr *) addr,
+		 sizeof (struct sockaddr_in6)));
 
   dht = dht_new ("dht.cache", 6681, io);
   return 0;
 }
 
 static ssize_t 
-dht_read (void *p, char *buf, size_t size, struct sockaddr_in *sa, int tim)
+dht_read (void *p, char *buf, size_t size, struct sockaddr *sa,
+	  socklen_t *salen, int tim)
 {
   int fd;
   ssize_t ret;
-  socklen_t siz;
   fd_set set[1];
   struct timeval tv[1];
 
@@ -73,30 +81,46 @@ dht_read (void *p, char *buf, size_t size, struct sockaddr_in *sa, int tim)
 
   FD_ZERO (set);
   FD_SET (fd, set);
-  tv->tv_sec = tim;
-  tv->tv_usec = 0;
-  if (select (fd + 1, set, NULL, NULL, tv) <= 0
+  tv->tv_sec = tim / 1000;
+  tv->tv_usec = (tim % 1000) * 1000;
+  if (select (fd + 1, set, NULL, NULL, tim < 0 ? NULL : tv) <= 0
       || !FD_ISSET (fd, set))
     {
       return -1;
     }
 
-  siz = sizeof (struct sockaddr);
-  ret = recvfrom (fd, buf, size, 0, (struct sockaddr *) sa, &siz);
+  ret = recvfrom (fd, buf, size, 0, sa, salen);
 
   return ret;
 }
 
 static ssize_t 
-dht_write (void *p, const char *buf, size_t size, struct sockaddr_in *sa)
+dht_write (void *p, const char *buf, size_t size, const struct sockaddr *sa,
+	   socklen_t salen)
 {
+  struct sockaddr_in6 mapped[1];
   int fd;
   ssize_t ret;
-  socklen_t siz;
 
   fd = * (int *) p;
-  siz = sizeof (struct sockaddr);
-  ret = sendto (fd, buf, size, 0, (struct sockaddr *) sa, siz);
+
+  /* 
+   * IPv4 destinations go out as IPv4-mapped addresses
+   * */
+  if (sa->sa_family == AF_INET)
+    {
+      memset (mapped, 0, sizeof (struct sockaddr_in6));
+      mapped->sin6_family = AF_INET6;
+      mapped->sin6_port = ((const struct sockaddr_in *) sa)->sin_port;
+      mapped->sin6_addr.s6_addr[10] = 0xFF;
+      mapped->sin6_addr.s6_addr[11] = 0xFF;
+      memcpy (&mapped->sin6_addr.s6_addr[12],
+	      &((const struct sockaddr_in *) sa)->sin_addr, 4);
+      sa = (const struct sockaddr *) mapped;
+      salen = sizeof (struct sockaddr_in6);
+    }
+
+  ret = sendto (fd, buf, size, 0, sa, salen);
 
   return ret;
 }
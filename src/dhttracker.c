@@ -51,26 +51,19 @@ dt_init (void)
 }
 
 void
-dt_add_peer (struct dht_tracker *dt, unsigned long ip, unsigned short port)
+dt_add_peer (struct dht_tracker *dt, const struct dht_addr *sa, time_t t)
 {
   struct dht_sockaddr *addr, *oldest = NULL;
-  struct sockaddr_in laddr;
-  time_t t, minseen = UINT_MAX;
+  time_t minseen = UINT_MAX;
 
-  if (port == 0)
+  if (DA_PORT (sa) == 0)
     return;
 
-  laddr.sin_family = AF_INET;
-  laddr.sin_addr.s_addr = ip;
-  laddr.sin_port = port;
-  memset (laddr.sin_zero, 0, 8);
-
-  time (&t);
   LIST_FOREACH (addr, &dt->m_peers, entries)
   {
-    if (addr->m_sa.sin_addr.s_addr == laddr.sin_addr.s_addr)
+    if (da_same_host (&addr->m_sa, sa))
       {
-	addr->m_sa.sin_port = laddr.sin_port;
+	memcpy (&addr->m_sa, sa, sizeof (struct dht_addr));
 	addr->m_lastseen = t;
 	return;
       }
@@ -89,53 +82,72 @@ dt_add_peer (struct dht_tracker *dt, unsigned long ip, unsigned short port)
 	  return;
 	}
 
-      memcpy (&addr->m_sa, &laddr, sizeof (struct sockaddr_in));
+      memcpy (&addr->m_sa, sa, sizeof (struct dht_addr));
       addr->m_lastseen = t;
       LIST_INSERT_HEAD (&dt->m_peers, addr, entries);
       DTK_SIZE (dt)++;
     }
   else
     {
-      oldest->m_sa.sin_addr.s_addr = laddr.sin_addr.s_addr;
-      oldest->m_sa.sin_port = laddr.sin_port;
+      memcpy (&oldest->m_sa, sa, sizeof (struct dht_addr));
       oldest->m_lastseen = t;
     }
 }
 
-struct string *
-dt_get_peers (struct dht_tracker *dt, unsigned int max)
+/* 
+ * append at most max compact peers of the family af to the values list,
+ * starting at a random peer when there are more than max of them
+ * return the number of peers stored
+ * */
+int
+dt_get_peers (struct dht_tracker *dt, int af, unsigned int max,
+	      struct dht_object *values)
 {
-  static struct string res;
-  unsigned int i = 0, first = 0, last = 0, blocks;
-  struct dht_sockaddr *dsa = LIST_FIRST (&dt->m_peers);
+  struct dht_sockaddr *dsa;
+  struct string str;
+  char compact[DA_COMPACT_LEN6];
+  unsigned int total, first, i, n;
 
-  if (DTK_SIZE (dt) > max)
-    {
-      blocks = (DTK_SIZE (dt) + max - 1) / max;
-      first += (rand () % blocks) * (DTK_SIZE (dt) - max) / (blocks - 1);
-      last = first + max;
-    }
+  total = 0;
+  LIST_FOREACH (dsa, &dt->m_peers, entries)
+  {
+    if (DA_FAMILY (&dsa->m_sa) == af)
+      total++;
+  }
 
-  while (i < first)
-    dsa = LIST_NEXT (dsa, entries);
+  if (total == 0)
+    return 0;
 
-  memset (&res, 0, sizeof (res));
-  string_ext (&res, max * 6 * sizeof (char));
+  first = total > max ? rand () % total : 0;
 
-  while (i < last)
+  i = n = 0;
+  while (n < total && n < max)
     {
-      memcpy (res.data + (i - first) * 6, &dsa->m_sa.sin_addr, 6);
-      dsa = LIST_NEXT (dsa, entries);
+      LIST_FOREACH (dsa, &dt->m_peers, entries)
+      {
+	if (DA_FAMILY (&dsa->m_sa) != af)
+	  continue;
+
+	if (i++ >= first && n < max)
+	  {
+	    da_store_compact (&dsa->m_sa, compact);
+	    string_set2 (&str, compact, DA_COMPACT_LEN (af));
+	    obj_insert_list_string (values, &str);
+	    n++;
+	  }
+      }
+      first = 0;
+      i = 0;
     }
 
-  return &res;
+  return n;
 }
 
 void
-dt_prune (struct dht_tracker *dt, int maxage)
+dt_prune (struct dht_tracker *dt, int maxage, time_t now)
 {
   struct dht_sockaddr *addr;
-  time_t minseen = time (NULL) - maxage;
+  time_t minseen = now - maxage;
 
   LIST_FOREACH (addr, &dt->m_peers, entries)
   {
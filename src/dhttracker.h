@@ -29,17 +29,9 @@
 #define _DHT_TRACKER_H_
 
 #include "queue.h"
+#include "dhtaddr.h"
 
 #include <time.h>
-#ifdef _WIN32
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#else
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h>
-#include <arpa/inet.h>
-#endif
 
 #define DTK_MAX_PEERS 32
 #define DTK_MAX_SIZE  128
@@ -49,7 +41,7 @@
 
 struct dht_sockaddr
 {
-  struct sockaddr_in m_sa;
+  struct dht_addr m_sa;
   time_t m_lastseen;
     LIST_ENTRY (dht_sockaddr) entries;
 };
@@ -65,10 +57,11 @@ struct dht_tracker *dt_init (void);
 
 void dt_cleanup (struct dht_tracker *);
 
-void dt_add_peer (struct dht_tracker *, unsigned long, unsigned short);
+void dt_add_peer (struct dht_tracker *, const struct dht_addr *, time_t);
 
-struct string *dt_get_peers (struct dht_tracker *, unsigned int);
+int dt_get_peers (struct dht_tracker *, int, unsigned int,
+		  struct dht_object *);
 
-void dt_prune (struct dht_tracker *, int);
+void dt_prune (struct dht_tracker *, int, time_t);
 
 #endif
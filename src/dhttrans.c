@@ -35,11 +35,17 @@
 #include <string.h>
 #include <assert.h>
 
-static struct dht_node_search_t *dsea_find_lower_bound (struct dht_search *,
-							const char *);
+static unsigned int dsea_find_lower_bound (struct dht_search *,
+					   const char *);
+static struct dht_node_search_t *dsea_insert (struct dht_search *,
+					      const char *,
+					      const struct dht_addr *);
+static struct dht_node_search_t *dsea_select (struct dht_search *,
+					      unsigned int);
 
 struct dht_search *
-dsea_init (const char *target, struct dht_bucket *contacts)
+dsea_init (struct dht_pools *pools, const char *target, int af,
+	   struct dht_bucket *contacts)
 {
   struct dht_search *dsea;
 
@@ -47,13 +53,16 @@ dsea_init (const char *target, struct dht_bucket *contacts)
   assert (dsea);
 
   hashsg_cpy (dsea->m_target, target);
+  dsea->m_pools = pools;
 
-  dsea->m_next = NULL;
+  dsea->m_af = af;
+  dsea->m_next = 0;
+  hs_init (&dsea->m_seen, DSEARCH_SEEN_SLOTS);
+  dsea->m_seenkey = rand ();
   dsea->m_pending = 0;
   dsea->m_contacted = 0;
   dsea->m_replied = 0;
   dsea->m_concurrency = 3;
-  dsea->m_restart = 0;
   dsea->m_started = 0;
 
   dsea_add_contacts (dsea, contacts);
@@ -64,8 +73,6 @@ dsea_init (const char *target, struct dht_bucket *contacts)
 void
 dsea_claenup (struct dht_search *dsea)
 {
-  struct dht_node_search_t *dns;
-
   if (dsea->m_pending)
     {
       ttdht_err ("cleanup called with pending transactions.");
@@ -78,74 +85,115 @@ dsea_claenup (struct dht_search *dsea)
       return;
     }
 
-  LIST_FOREACH (dns, &dsea->dht_node_search_list, entries)
-  {
-    LIST_REMOVE (dns, entries);
-    dsea->dht_node_search_count--;
-    free (dns);
-  }
+  dsea_cleanup (dsea);
 }
 
-static struct dht_node_search_t *
-dsea_find_lower_bound (struct dht_search *dsea, const char *id)
+/* 
+ * keys of the seen set for the address and port of sa and for id
+ * */
+static void
+dsea_seen_keys (struct dht_search *dsea, const char *id,
+		const struct dht_addr *sa, unsigned int *keys)
 {
-  struct dht_node_search_t *dnst, *smaller;
-
-  smaller = NULL;
-  dnst = LIST_FIRST (&dsea->dht_node_search_list);
+  unsigned char key[sizeof (struct in6_addr) + 2];
+  unsigned short port;
+  const char *host;
+  int len;
+
+  host = da_host (sa, &len);
+  memcpy (key, host, len);
+  port = DA_PORT (sa);
+  memcpy (key + len, &port, 2);
+
+  keys[0] = hash_bytes (key, len + 2, dsea->m_seenkey);
+  keys[1] = hash_bytes (id, HASH_STRING_LEN, ~dsea->m_seenkey);
+}
 
-  if (dnst == NULL)
-    return NULL;
+/* 
+ * index of the first candidate not closer to the target than id
+ * */
+static unsigned int
+dsea_find_lower_bound (struct dht_search *dsea, const char *id)
+{
+  unsigned int lo, hi, mid;
 
-  while (dnst && hashsg_closer (dsea->m_target, dnst->node->hashsg, id))
+  lo = 0;
+  hi = dsea->dht_node_search_count;
+  while (lo < hi)
     {
-      smaller = dnst;
-      dnst = LIST_NEXT (dnst, entries);
+      mid = (lo + hi) / 2;
+      if (hashsg_closer (dsea->m_target, dsea->m_cands[mid]->node->hashsg,
+			 id))
+	lo = mid + 1;
+      else
+	hi = mid;
     }
 
-  return smaller;
+  return lo;
 }
 
-int
-dsea_add_contact (struct dht_search *dsea, const char *id,
-		  struct sockaddr *sa)
+static struct dht_node_search_t *
+dsea_insert (struct dht_search *dsea, const char *id,
+	     const struct dht_addr *sa)
 {
-  struct dht_node_search_t *dns, *entry, *nentry;
-  struct dht_node *n;
-
-  entry = dsea_find_lower_bound (dsea, id);
+  struct dht_node_search_t *dns;
+  unsigned int pos, keys[2];
+
+  /* 
+   * a contact only counts as seen once it is stored, so one turned
+   * away while the array is full may still come in later
+   * */
+  dsea_seen_keys (dsea, id, sa, keys);
+  if (hs_find (&dsea->m_seen, keys[0]) || hs_find (&dsea->m_seen, keys[1]))
+    return NULL;
 
-  if (entry != NULL && (nentry = LIST_NEXT (entry, entries)) != NULL)
+  if (dsea->dht_node_search_count == DSEARCH_MAX_CANDIDATES)
     {
-      if (memcmp (&nentry->node->m_sockaddr, sa, sizeof (*sa)) == 0)
-	{
-	  return 0;
-	}
+      dsea_trim (dsea, 0);
+      if (dsea->dht_node_search_count == DSEARCH_MAX_CANDIDATES)
+	return NULL;
     }
 
-  n = dn_init (id, (struct sockaddr_in *) sa);
-  assert (n);
-
-  dns =
-    (struct dht_node_search_t *) calloc (1,
-					 sizeof (struct dht_node_search_t));
-  assert (dns);
+  pos = dsea_find_lower_bound (dsea, id);
 
-  dns->node = n;
+  dns = (struct dht_node_search_t *) dp_alloc (&dsea->m_pools->m_candidates);
+  hashsg_cpy (dns->node->hashsg, id);
+  memcpy (&dns->node->m_sockaddr, sa, sizeof (struct dht_addr));
   dns->search = dsea;
 
-  if (entry == NULL)
-    {
-      LIST_INSERT_HEAD (&dsea->dht_node_search_list, dns, entries);
-    }
-  else
-    {
-      LIST_INSERT_AFTER (entry, dns, entries);
-    }
-
+  memmove (&dsea->m_cands[pos + 1], &dsea->m_cands[pos],
+	   (dsea->dht_node_search_count - pos) * sizeof (dsea->m_cands[0]));
+  dsea->m_cands[pos] = dns;
   dsea->dht_node_search_count++;
 
-  dsea->m_restart = 1;
+  hs_add (&dsea->m_seen, keys[0]);
+  hs_add (&dsea->m_seen, keys[1]);
+
+  if (pos <= dsea->m_next)
+    dsea->m_next = pos;
+
+  return dns;
+}
+
+int
+dsea_add_contact (struct dht_search *dsea, const char *id,
+		  const struct dht_addr *sa)
+{
+  return dsea_insert (dsea, id, sa) != NULL;
+}
+
+int
+dsea_add_node (struct dht_search *dsea, struct dht_node *node)
+{
+  struct dht_node_search_t *dns;
+
+  dns = dsea_insert (dsea, node->hashsg, &node->m_sockaddr);
+  if (dns == NULL)
+    return 0;
+
+  dns->node->m_srtt = node->m_srtt;
+  dns->node->m_rttvar = node->m_rttvar;
+
   return 1;
 }
 
@@ -156,7 +204,7 @@ dsea_add_contacts (struct dht_search *dsea, struct dht_bucket *contacts)
   struct db_chain *chain;
   int needclosest, needgood;
 
-  chain = dbc_init (contacts);
+  chain = dbc_init (contacts, dsea->m_target);
 
   needclosest = DSEARCH_MAX_CONTACTS - dsea->dht_node_search_count;
   needgood = DB_NUM_NODES;
@@ -176,8 +224,7 @@ dsea_add_contacts (struct dht_search *dsea, struct dht_bucket *contacts)
 	}
 
       if ((!DN_IS_BAD (node) || needclosest > 0)
-	  && dsea_add_contact (dsea, node->hashsg,
-			       (struct sockaddr *) &node->m_sockaddr))
+	  && dsea_add_node (dsea, node))
 	{
 	  needgood -= !DN_IS_BAD (node);
 	  needclosest--;
@@ -194,31 +241,64 @@ dsea_uncontacted (struct dht_search *dsea, struct dht_node *node)
     && (!DN_IS_BAD (node));
 }
 
+/* 
+ * among the first uncontacted candidates sharing the distance class
+ * of the closest one, pick the node that answered fastest so far
+ * */
+static struct dht_node_search_t *
+dsea_select (struct dht_search *dsea, unsigned int limit)
+{
+  struct dht_node_search_t *dns, *best;
+  unsigned int i;
+  int bits;
+
+  best = dsea->m_cands[dsea->m_next];
+  bits = hashsg_prefix_len (dsea->m_target, best->node->hashsg);
+
+  for (i = dsea->m_next + 1;
+       i < limit && i < dsea->m_next + DSEARCH_RTT_WINDOW; i++)
+    {
+      dns = dsea->m_cands[i];
+      if (hashsg_prefix_len (dsea->m_target, dns->node->hashsg) != bits)
+	break;
+
+      if (dsea_uncontacted (dsea, dns->node)
+	  && DN_RTT (dns->node) < DN_RTT (best->node))
+	best = dns;
+    }
+
+  return best;
+}
+
+/* 
+ * only the DSEARCH_MAX_CONTACTS closest candidates are ever queried
+ * */
 struct dht_node_search_t *
 dsea_get_contact (struct dht_search *dsea)
 {
   struct dht_node_search_t *ret;
+  unsigned int limit;
 
   if (dsea->m_pending >= dsea->m_concurrency)
     return NULL;
 
-  if (dsea->m_restart)
-    dsea_trim (dsea, 0);
+  limit = dsea->dht_node_search_count;
+  if (limit > DSEARCH_MAX_CONTACTS)
+    limit = DSEARCH_MAX_CONTACTS;
 
-  ret = dsea->m_next;
-  if (ret == NULL)
-    return ret;
+  if (dsea->m_next >= limit)
+    return NULL;
+
+  ret = dsea_select (dsea, limit);
 
   dsea_set_node_active (dsea, ret, 1);
 
   dsea->m_pending++;
   dsea->m_contacted++;
 
-  while ((dsea->m_next = LIST_NEXT (dsea->m_next, entries)) != NULL)
-    {
-      if (dsea_uncontacted (dsea, dsea->m_next->node))
-	break;
-    }
+  while (dsea->m_next < dsea->dht_node_search_count
+	 && !dsea_uncontacted (dsea, dsea->m_cands[dsea->m_next]->node))
+    dsea->m_next++;
 
   return ret;
 }
@@ -227,9 +307,13 @@ void
 dsea_node_status (struct dht_search *dsea, struct dht_node_search_t *node,
 		  int suc)
 {
+  /* 
+   * a search keeps its own copy of the node and uses m_lastseen as the
+   * active flag, which is cleared below
+   * */
   if (suc)
     {
-      DN_SET_GOOD (node->node);
+      DN_SET_GOOD (node->node, 1);
       dsea->m_replied++;
     }
   else
@@ -241,40 +325,43 @@ dsea_node_status (struct dht_search *dsea, struct dht_node_search_t *node,
   dsea_set_node_active (dsea, node, 0);
 }
 
+/* 
+ * drop the candidates past the DSEARCH_MAX_CONTACTS closest, or all of
+ * them when final, that are neither in flight nor among the closest
+ * that replied an announce needs
+ * */
 void
 dsea_trim (struct dht_search *dsea, int final)
 {
   struct dht_node_search_t *dnst;
+  unsigned int i, n, next;
 
   int needclosest = final ? 0 : DSEARCH_MAX_CONTACTS;
   int needgood = dsea->is_anno ? DB_NUM_NODES : 0;
 
-  dsea->m_next = NULL;
+  next = DSEARCH_MAX_CANDIDATES;
 
-  for (dnst = LIST_FIRST (&dsea->dht_node_search_list); dnst != NULL;)
+  for (i = n = 0; i < dsea->dht_node_search_count; i++)
     {
+      dnst = dsea->m_cands[i];
       if ((!DN_IS_ACTIVE (dnst->node)) && needclosest <= 0
 	  && ((!DN_IS_GOOD (dnst->node)) || needgood <= 0))
 	{
-	  struct dht_node_search_t *dnst2 = LIST_NEXT (dnst, entries);
-	  dn_cleanup (dnst->node);
-	  LIST_REMOVE (dnst, entries);
-	  dsea->dht_node_search_count--;
-	  free (dnst);
-	  dnst = dnst2;
+	  dp_free (&dsea->m_pools->m_candidates, dnst);
 	  continue;
 	}
 
       needclosest--;
       needgood -= DN_IS_GOOD (dnst->node);
 
-      if (dsea->m_next == NULL && dsea_uncontacted (dsea, dnst->node))
-	dsea->m_next = dnst;
+      if (next > n && dsea_uncontacted (dsea, dnst->node))
+	next = n;
 
-      dnst = LIST_NEXT (dnst, entries);
+      dsea->m_cands[n++] = dnst;
     }
 
-  dsea->m_restart = 0;
+  dsea->dht_node_search_count = n;
+  dsea->m_next = next < n ? next : n;
 }
 
 void
@@ -287,24 +374,24 @@ dsea_set_node_active (struct dht_search *dsea, struct dht_node_search_t *dnst,
 void
 dsea_cleanup (struct dht_search *dsea)
 {
-  struct dht_node_search_t *n;
+  unsigned int i;
 
-  while ((n = LIST_FIRST (&dsea->dht_node_search_list)) != NULL)
-    {
-      LIST_REMOVE (n, entries);
-      dn_cleanup (n->node);
-      free (n);
-    }
+  for (i = 0; i < dsea->dht_node_search_count; i++)
+    dp_free (&dsea->m_pools->m_candidates, dsea->m_cands[i]);
+
+  dsea->dht_node_search_count = 0;
+  dsea->m_next = 0;
+  hs_cleanup (&dsea->m_seen);
 }
 
 struct dht_search *
-dann_init (const char *key, const char *id,
+dann_init (struct dht_pools *pools, const char *key, const char *id, int af,
 	   struct dht_bucket *bucket, void (*cb) (const char *, const char *,
 						  void *), void *arg)
 {
   struct dht_search *ann;
 
-  ann = dsea_init (id, bucket);
+  ann = dsea_init (pools, id, af, bucket);
   assert (ann);
 
   ann->key = strdup (key);
@@ -340,34 +427,36 @@ dann_cleanup (struct dht_search *dann)
       ttdht_info ("%s\n", fail);
     }
 
+  hs_cleanup (&dann->m_seen);
   free (dann->key);
   free (dann);
 }
 
-struct dht_node_search_t *
+/* 
+ * the number of candidates to announce to, DSEA_CANDIDATE 0 and on
+ * */
+int
 dann_start_announce (struct dht_search *dann)
 {
-  struct dht_node_search_t *n;
+  unsigned int i;
 
   dsea_trim (dann, 1);
 
-  if (LIST_EMPTY (&dann->dht_node_search_list))
-    return NULL;
+  if (dann->dht_node_search_count == 0)
+    return 0;
 
-  if (!DSEA_COMPLETE (dann) || dann->m_next != NULL
+  if (!DSEA_COMPLETE (dann) || dann->m_next < dann->dht_node_search_count
       || dann->dht_node_search_count > DB_NUM_NODES)
-    return NULL;
+    return 0;
 
   dann->m_contacted = dann->m_pending = dann->dht_node_search_count;
   dann->m_replied = 0;
   dann->state = USR_ANNOUNCING;
 
-  LIST_FOREACH (n, &dann->dht_node_search_list, entries)
-  {
-    dsea_set_node_active (dann, n, 1);
-  }
+  for (i = 0; i < dann->dht_node_search_count; i++)
+    dsea_set_node_active (dann, dann->m_cands[i], 1);
 
-  return LIST_FIRST (&dann->dht_node_search_list);
+  return dann->dht_node_search_count;
 }
 
 void
@@ -387,24 +476,25 @@ dann_receive_peers (struct dht_search *dann, struct dht_object *list)
 }
 
 struct dht_trans *
-dtr_init (int quicktimeout, int timeout, const char *id,
-	  struct sockaddr_in *sa)
+dtr_init (struct dht_pools *pools, int quicktimeout, int timeout,
+	  const char *id, const struct dht_addr *sa)
 {
   struct dht_trans *dtr;
-  time_t t;
 
-  dtr = (struct dht_trans *) calloc (1, sizeof (struct dht_trans));
-  assert (dtr);
+  dtr = (struct dht_trans *) dp_alloc (&pools->m_trans);
+  dtr->m_pools = pools;
 
   hashsg_cpy (dtr->m_id, id);
   dtr->m_has_quicktimeout = quicktimeout > 0;
-  memcpy (&dtr->m_sa, sa, sizeof (struct sockaddr_in));
+  memcpy (&dtr->m_sa, sa, sizeof (struct dht_addr));
 
-  time (&t);
-  dtr->m_timeout = t + timeout;
-  dtr->m_quicktimeout = t + quicktimeout;
+  /* 
+   * given in seconds, kept in msec from the time the query is sent
+   * */
+  dtr->m_timeout = timeout * 1000;
+  dtr->m_quicktimeout = quicktimeout * 1000;
 
-  dtr->m_retry = 3;
+  dtr->m_retry = DTR_NUM_RETRY;
 
   return dtr;
 }
@@ -413,19 +503,7 @@ void
 dtr_cleanup (struct dht_trans *dtr)
 {
   string_clear (&dtr->m_token);
-  free (dtr);
-}
-
-int
-dtr_key (struct sockaddr_in *sa, int id)
-{
-  return (int) ((dht_trans_key_type) (sa->sin_addr.s_addr) << 32) + id;
-}
-
-int
-dtr_key_match (dht_trans_key_type key, struct sockaddr_in *sa)
-{
-  return (key >> 32) == sa->sin_addr.s_addr;
+  dp_free (&dtr->m_pools->m_trans, dtr);
 }
 
 struct dht_trans *
@@ -433,9 +511,8 @@ dts_init (int quicktimeout, int timeout, struct dht_node_search_t *node)
 {
   struct dht_trans *dts;
 
-  dts =
-    dtr_init (quicktimeout, timeout, node->node->hashsg,
-	      &node->node->m_sockaddr);
+  dts = dtr_init (node->search->m_pools, quicktimeout, timeout,
+		  node->node->hashsg, &node->node->m_sockaddr);
   assert (dts);
 
   dts->m_node = node;
@@ -496,12 +573,12 @@ dts_cleanup (struct dht_trans *dts)
 }
 
 struct dht_trans *
-dtan_init (const char *id, struct sockaddr_in *sa, char *target,
-	   struct string *token)
+dtan_init (struct dht_pools *pools, const char *id,
+	   const struct dht_addr *sa, char *target, struct string *token)
 {
   struct dht_trans *dtan;
 
-  dtan = dtr_init (-1, 30, id, sa);
+  dtan = dtr_init (pools, -1, 30, id, sa);
   assert (dtan);
 
   hashsg_cpy (dtan->m_info, target);
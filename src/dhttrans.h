@@ -30,17 +30,55 @@
 
 #include "dhtlib.h"
 #include "dhtnode.h"
+#include "dhtpool.h"
 #include "dhttracker.h"
 
 #include <time.h>
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
 
 #define DSEARCH_MAX_CONTACTS    18
 
+/* 
+ * candidates a search holds at once, closest first; the farther ones
+ * not needed any more are trimmed when it fills up
+ * */
+#define DSEARCH_MAX_CANDIDATES  64
+
+/* 
+ * initial slots of the set of addresses and ids a search has seen
+ * */
+#define DSEARCH_SEEN_SLOTS      64
+
+/* 
+ * how many uncontacted candidates in the same distance class
+ * are compared by round trip time before one is queried
+ * */
+#define DSEARCH_RTT_WINDOW      4
+
+/* 
+ * slab pools of a router for the short lived objects of its lookups:
+ * transactions, their index entries and destinations and search
+ * candidates
+ * */
+struct dht_pools
+{
+  struct dht_pool m_trans;
+  struct dht_pool m_transrefs;
+  struct dht_pool m_dests;
+  struct dht_pool m_candidates;
+};
+
+/* 
+ * a candidate of a search with its own copy of the node: id, address,
+ * round trip time, and the state of the query kept in m_lastseen
+ * (in flight), m_active (replied) and m_inactive (failed)
+ * */
 struct dht_node_search_t
 {
-  struct dht_node *node;
+  struct dht_node node[1];
   struct dht_search *search;
-    LIST_ENTRY (dht_node_search_t) entries;
 };
 
 #define DSEA_NUM_CONTACTED(dsea)                   ((dsea)->m_contacted)
@@ -50,26 +88,45 @@ struct dht_node_search_t
 #define DSEA_COMPLETE(dsea)                        ((dsea)->m_started && !(dsea)->m_pending)
 
 #define DSEA_TARGET(dsea)                          ((dsea)->target)
+#define DSEA_NUM_CANDIDATES(dsea)                  ((dsea)->dht_node_search_count)
+#define DSEA_CANDIDATE(dsea, i)                    ((dsea)->m_cands[i])
 
 enum
 { USR_IDLE, USR_SEARCHING, USR_ANNOUNCING } search_type;
 
 struct dht_search
 {
-  LIST_HEAD (dht_node_search_list, dht_node_search_t) dht_node_search_list;
+  /* 
+   * candidates sorted by distance to m_target, m_next is the index of
+   * the closest one not queried yet or dht_node_search_count
+   * */
+  struct dht_node_search_t *m_cands[DSEARCH_MAX_CANDIDATES];
   unsigned int dht_node_search_count;
-  struct dht_node_search_t *m_next;
+  unsigned int m_next;
+
+  /* 
+   * keyed hashes of the address and port and of the id of every
+   * contact added, so none is added twice even after it was trimmed
+   * */
+  struct hset m_seen;
+  unsigned int m_seenkey;
 
   unsigned int m_pending;
   unsigned int m_contacted;
   unsigned int m_replied;
   unsigned int m_concurrency;
 
-  int m_restart;
   int m_started;
 
   char m_target[HASH_STRING_LEN + 1];
 
+  struct dht_pools *m_pools;
+
+  /* 
+   * address family of the routing table the search runs in
+   * */
+  int m_af;
+
   unsigned int state;
   int is_anno;
 
@@ -81,10 +138,13 @@ struct dht_search
   void *arg;
 };
 
-struct dht_search *dsea_init (const char *, struct dht_bucket *);
+struct dht_search *dsea_init (struct dht_pools *, const char *, int,
+			      struct dht_bucket *);
 void dsea_cleanup (struct dht_search *);
 void dsea_claenup (struct dht_search *);
-int dsea_add_contact (struct dht_search *, const char *, struct sockaddr *);
+int dsea_add_contact (struct dht_search *, const char *,
+		      const struct dht_addr *);
+int dsea_add_node (struct dht_search *, struct dht_node *);
 void dsea_add_contacts (struct dht_search *, struct dht_bucket *);
 int dsea_uncontacted (struct dht_search *, struct dht_node *);
 struct dht_node_search_t *dsea_get_contact (struct dht_search *);
@@ -93,11 +153,12 @@ void dsea_trim (struct dht_search *, int);
 void dsea_set_node_active (struct dht_search *, struct dht_node_search_t *,
 			   int);
 
-struct dht_search *dann_init (const char *, const char *, struct dht_bucket *,
+struct dht_search *dann_init (struct dht_pools *, const char *,
+			      const char *, int, struct dht_bucket *,
 			      void (*)(const char *, const char *, void *),
 			      void *);
 void dann_cleanup (struct dht_search *);
-struct dht_node_search_t *dann_start_announce (struct dht_search *);
+int dann_start_announce (struct dht_search *);
 void dann_receive_peers (struct dht_search *, struct dht_object *);
 
 #define DTP_HAS_TRANSACTION(dtp)                (dtp->m_id >= -1)
@@ -109,6 +170,11 @@ void dann_receive_peers (struct dht_search *, struct dht_object *);
 #define DTP_AGE(dtp, t)                         (DTP_HAS_TRANSACTION(dtp)? 0: t + dtp->m_id)
 #define DTP_TRAN(dtp)                           (dtp->m_trans)
 
+/* 
+ * times a query is sent again before it fails
+ * */
+#define DTR_NUM_RETRY                3
+
 typedef enum
 {
   DHT_PING,
@@ -124,22 +190,25 @@ typedef enum
 #define DTRAN_HAS_QUICK_TIMEOUT(dt)  ((dt)->m_has_quicktimeout)
 #define DTRAN_DEC_RETRY(dt)          ((dt)->m_retry--)
 #define DTRAN_RETRY(dt)              ((dt)->m_retry)
+#define DTRAN_RESENT(dt)             ((dt)->m_retry < DTR_NUM_RETRY)
 #define DTRAN_PACKET(dt)             ((dt)->m_packet)
 #define DTRAN_SET_PACKET(dt, p)      do { (dt)->m_packet = p; } while (0)
-#define DTRAN_KEY(dt, id)            dtran_key ((dt), &(dt)->m_sa, id)
-
-typedef unsigned long long dht_trans_key_type;
 
 struct dht_trans
 {
   dht_trans_type type;
-
-  dht_trans_key_type key;
   char m_id[HASH_STRING_LEN + 1];
 
-  struct sockaddr_in m_sa;
-  time_t m_timeout;
-  time_t m_quicktimeout;
+  struct dht_addr m_sa;
+  struct timeval m_sent;
+  int m_timeout;
+  int m_quicktimeout;
+
+  /* 
+   * msec to wait for the reply before the query is sent again, doubled
+   * for every retry
+   * */
+  int m_rto;
   int m_retry;
 
   int m_has_quicktimeout;
@@ -149,19 +218,21 @@ struct dht_trans
 
   char m_info[HASH_STRING_LEN + 1];
   struct string m_token;
+
+  struct dht_pools *m_pools;
 };
 
-struct dht_trans *dtr_init (int, int, const char *, struct sockaddr_in *);
-int dtr_key (struct sockaddr_in *, int);
+struct dht_trans *dtr_init (struct dht_pools *, int, int, const char *,
+			    const struct dht_addr *);
 void dtr_cleanup (struct dht_trans *);
-int dtr_key_match (dht_trans_key_type, struct sockaddr_in *);
 
 struct dht_trans *dts_init (int, int, struct dht_node_search_t *);
 void dts_set_stalled (struct dht_trans *);
 void dts_complete (struct dht_trans *, int);
 void dts_cleanup (struct dht_trans *);
 
-struct dht_trans *dtan_init (const char *, struct sockaddr_in *, char *,
+struct dht_trans *dtan_init (struct dht_pools *, const char *,
+			     const struct dht_addr *, char *,
 			     struct string *);
 
 #endif
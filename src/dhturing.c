@@ -0,0 +1,447 @@
+/*
+* This file is part of the libttdht package
+* Copyright (C) <2008>  <Alf>
+*
+* Contact: Alf <naihe2010@126.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*
+*/
+/* @CFILE dhturing.c
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_LIBURING
+
+#include "dhturing.h"
+#include "dhtlog.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <poll.h>
+#include <liburing.h>
+
+/* 
+ * the low bits of the user data tell the completions apart, a send
+ * keeps its slot above them
+ * */
+#define DUR_TAG_RECV                1
+#define DUR_TAG_WAKE                2
+#define DUR_TAG_SEND                3
+#define DUR_TAG_BITS                2
+#define DUR_TAG_MASK                ((1 << DUR_TAG_BITS) - 1)
+
+/* 
+ * a datagram owned by the kernel until its completion arrives
+ * */
+struct dur_send
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct sockaddr_in6 mapped;
+  char buf[DR_SIZE_PACKET];
+};
+
+struct dht_uring
+{
+  struct io_uring ring;
+  struct dht_io *dio;
+
+  struct io_uring_buf_ring *br;
+  char *bufs;
+  struct msghdr rmsg;
+
+  /* 
+   * the multishot recvmsg and the eventfd poll are posted
+   * */
+  int recving;
+  int waking;
+
+  struct dur_send sends[DR_NUM_SENDS];
+  int freesends[DR_NUM_SENDS];
+  int numfree;
+};
+
+/* 
+ * post the receive and the wakeup poll again once the kernel dropped
+ * them, they are submitted with the next io_uring_submit
+ * */
+static void
+dur_arm (struct dht_uring *dur)
+{
+  struct io_uring_sqe *sqe;
+
+  if (!dur->recving && (sqe = io_uring_get_sqe (&dur->ring)) != NULL)
+    {
+      io_uring_prep_recvmsg_multishot (sqe, dur->dio->fd, &dur->rmsg, 0);
+      sqe->flags |= IOSQE_BUFFER_SELECT;
+      sqe->buf_group = DUR_BGID;
+      io_uring_sqe_set_data64 (sqe, DUR_TAG_RECV);
+      dur->recving = 1;
+    }
+
+  if (!dur->waking && dur->dio->wakefd[0] >= 0
+      && (sqe = io_uring_get_sqe (&dur->ring)) != NULL)
+    {
+      io_uring_prep_poll_add (sqe, dur->dio->wakefd[0], POLLIN);
+      io_uring_sqe_set_data64 (sqe, DUR_TAG_WAKE);
+      dur->waking = 1;
+    }
+}
+
+static void
+dur_recycle (struct dht_uring *dur, int bid)
+{
+  io_uring_buf_ring_add (dur->br, dur->bufs + bid * DUR_SIZE_BUF,
+			 DUR_SIZE_BUF, bid,
+			 io_uring_buf_ring_mask (DUR_NUM_BUFS), 0);
+  io_uring_buf_ring_advance (dur->br, 1);
+}
+
+/* 
+ * copy one received datagram out of its provided buffer
+ * return -1 if it is truncated or malformed
+ * */
+static int
+dur_copy (struct dht_uring *dur, struct dht_packet *pkt, char *buf,
+	  int len)
+{
+  struct io_uring_recvmsg_out *out;
+  socklen_t namelen;
+  unsigned int plen;
+
+  out = io_uring_recvmsg_validate (buf, len, &dur->rmsg);
+  if (out == NULL || (out->flags & MSG_TRUNC))
+    return -1;
+
+  plen = io_uring_recvmsg_payload_length (out, len, &dur->rmsg);
+  if (plen > pkt->size)
+    return -1;
+
+  namelen = out->namelen;
+  if (namelen > dur->rmsg.msg_namelen)
+    namelen = dur->rmsg.msg_namelen;
+
+  memset (&pkt->addr, 0, sizeof (struct dht_addr));
+  memcpy (&pkt->addr, io_uring_recvmsg_name (out), namelen);
+  pkt->addrlen = namelen;
+
+  memcpy (pkt->buf, io_uring_recvmsg_payload (out, &dur->rmsg), plen);
+  pkt->len = plen;
+
+  return 0;
+}
+
+/* 
+ * consume completions until num packets are filled
+ * return the number of packets
+ * */
+static int
+dur_reap (struct dht_uring *dur, struct dht_packet *pkts, int num)
+{
+  struct io_uring_cqe *cqe;
+  unsigned long long data;
+  char drain[8];
+  int count, bid;
+  ssize_t ret;
+
+  count = 0;
+  while (io_uring_peek_cqe (&dur->ring, &cqe) == 0)
+    {
+      data = io_uring_cqe_get_data64 (cqe);
+
+      switch (data & DUR_TAG_MASK)
+	{
+	case DUR_TAG_RECV:
+	  if (count == num)
+	    return count;
+
+	  if (!(cqe->flags & IORING_CQE_F_MORE))
+	    dur->recving = 0;
+
+	  if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+	    {
+	      bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	      if (dur_copy (dur, &pkts[count], dur->bufs + bid * DUR_SIZE_BUF,
+			    cqe->res) == 0)
+		count++;
+	      dur_recycle (dur, bid);
+	    }
+	  else if (cqe->res < 0 && cqe->res != -ENOBUFS)
+	    {
+	      ttdht_debug ("uring recv error: %s\n", strerror (-cqe->res));
+	    }
+	  break;
+
+	case DUR_TAG_WAKE:
+	  dur->waking = 0;
+	  ret = read (dur->dio->wakefd[0], drain, sizeof drain);
+	  (void) ret;
+	  break;
+
+	case DUR_TAG_SEND:
+	  dur->freesends[dur->numfree++] = (int) (data >> DUR_TAG_BITS);
+	  if (cqe->res < 0)
+	    {
+	      ttdht_debug ("uring send error: %s\n", strerror (-cqe->res));
+	    }
+	  break;
+	}
+
+      io_uring_cqe_seen (&dur->ring, cqe);
+    }
+
+  return count;
+}
+
+static int
+dur_read_batch (void *p, struct dht_packet *pkts, int num, int msec)
+{
+  struct dht_uring *dur;
+  struct io_uring_cqe *cqe;
+  struct __kernel_timespec ts;
+  int count;
+
+  dur = ((struct dht_io *) p)->uring;
+
+  /* 
+   * the wait is one io_uring_enter that also submits what was queued
+   * since the last call
+   * */
+  dur_arm (dur);
+  count = dur_reap (dur, pkts, num);
+  if (count == 0 && msec != 0)
+    {
+      ts.tv_sec = msec / 1000;
+      ts.tv_nsec = (msec % 1000) * 1000000L;
+      io_uring_submit_and_wait_timeout (&dur->ring, &cqe, 1,
+					msec < 0 ? NULL : &ts, NULL);
+      count = dur_reap (dur, pkts, num);
+    }
+
+  dur_arm (dur);
+  io_uring_submit (&dur->ring);
+
+  if (count == 0)
+    {
+      errno = EAGAIN;
+      return -1;
+    }
+
+  return count;
+}
+
+static ssize_t
+dur_read (void *p, char *buf, size_t size, struct sockaddr *sa,
+	  socklen_t *salen, int msec)
+{
+  struct dht_packet pkt[1];
+
+  pkt->buf = buf;
+  pkt->size = size;
+
+  if (dur_read_batch (p, pkt, 1, msec) < 0)
+    return -1;
+
+  if (*salen > pkt->addrlen)
+    *salen = pkt->addrlen;
+  memcpy (sa, &pkt->addr, *salen);
+
+  return pkt->len;
+}
+
+/* 
+ * hand the packets to the kernel without waiting for them, a send is
+ * held in its slot until its completion is reaped
+ * */
+static int
+dur_write_batch (void *p, struct dht_packet *pkts, int num)
+{
+  struct dht_io *dio;
+  struct dht_uring *dur;
+  struct dur_send *ds;
+  struct io_uring_sqe *sqe;
+  const struct sockaddr *sa;
+  socklen_t salen;
+  int i, slot;
+
+  dio = (struct dht_io *) p;
+  dur = dio->uring;
+
+  for (i = 0; i < num && dur->numfree > 0; i++)
+    {
+      slot = dur->freesends[dur->numfree - 1];
+      ds = &dur->sends[slot];
+
+      salen = pkts[i].addrlen;
+      sa = dio_map (dio, &pkts[i].addr.sa, &salen, &ds->mapped);
+      if (sa == NULL)
+	{
+	  if (i > 0)
+	    break;
+	  errno = EAFNOSUPPORT;
+	  return -1;
+	}
+
+      sqe = io_uring_get_sqe (&dur->ring);
+      if (sqe == NULL)
+	{
+	  io_uring_submit (&dur->ring);
+	  sqe = io_uring_get_sqe (&dur->ring);
+	  if (sqe == NULL)
+	    break;
+	}
+      dur->numfree--;
+
+      memcpy (ds->buf, pkts[i].buf, pkts[i].len);
+      if (sa != (const struct sockaddr *) &ds->mapped)
+	memcpy (&ds->mapped, sa, salen);
+
+      ds->iov.iov_base = ds->buf;
+      ds->iov.iov_len = pkts[i].len;
+      memset (&ds->msg, 0, sizeof (struct msghdr));
+      ds->msg.msg_name = &ds->mapped;
+      ds->msg.msg_namelen = salen;
+      ds->msg.msg_iov = &ds->iov;
+      ds->msg.msg_iovlen = 1;
+
+      io_uring_prep_sendmsg (sqe, dio->fd, &ds->msg, 0);
+      io_uring_sqe_set_data64 (sqe, ((unsigned long long) slot
+				     << DUR_TAG_BITS) | DUR_TAG_SEND);
+    }
+
+  io_uring_submit (&dur->ring);
+
+  if (i == 0)
+    {
+      errno = EAGAIN;
+      return -1;
+    }
+
+  return i;
+}
+
+static ssize_t
+dur_write (void *p, const char *buf, size_t size,
+	   const struct sockaddr *sa, socklen_t salen)
+{
+  struct dht_packet pkt[1];
+
+  if (size > DR_SIZE_PACKET || salen > sizeof (struct dht_addr))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  pkt->buf = (char *) buf;
+  pkt->len = size;
+  memcpy (&pkt->addr, sa, salen);
+  pkt->addrlen = salen;
+
+  if (dur_write_batch (p, pkt, 1) < 0)
+    return -1;
+
+  return size;
+}
+
+/* 
+ * switch the io bound in dio over to io_uring
+ * return -1 if the kernel can not provide it, io is left untouched
+ * */
+int
+dur_open (dhtio_t *io, struct dht_io *dio)
+{
+  struct dht_uring *dur;
+  int i, ret;
+
+  dur = (struct dht_uring *) calloc (1, sizeof (struct dht_uring));
+  assert (dur);
+
+  ret = io_uring_queue_init (DUR_NUM_ENTRIES, &dur->ring, 0);
+  if (ret < 0)
+    {
+      ttdht_debug ("io_uring init: %s\n", strerror (-ret));
+      free (dur);
+      return -1;
+    }
+
+  /* 
+   * provided buffer rings need linux 5.19
+   * */
+  dur->br = io_uring_setup_buf_ring (&dur->ring, DUR_NUM_BUFS, DUR_BGID, 0,
+				     &ret);
+  if (dur->br == NULL)
+    {
+      ttdht_debug ("io_uring buffer ring: %s\n", strerror (-ret));
+      io_uring_queue_exit (&dur->ring);
+      free (dur);
+      return -1;
+    }
+
+  dur->bufs = (char *) malloc (DUR_NUM_BUFS * DUR_SIZE_BUF);
+  assert (dur->bufs);
+  for (i = 0; i < DUR_NUM_BUFS; i++)
+    {
+      io_uring_buf_ring_add (dur->br, dur->bufs + i * DUR_SIZE_BUF,
+			     DUR_SIZE_BUF, i,
+			     io_uring_buf_ring_mask (DUR_NUM_BUFS), i);
+    }
+  io_uring_buf_ring_advance (dur->br, DUR_NUM_BUFS);
+
+  dur->rmsg.msg_namelen = sizeof (struct dht_addr);
+
+  for (i = 0; i < DR_NUM_SENDS; i++)
+    dur->freesends[i] = i;
+  dur->numfree = DR_NUM_SENDS;
+
+  dur->dio = dio;
+  dio->uring = dur;
+
+  dur_arm (dur);
+  io_uring_submit (&dur->ring);
+
+  io->read = dur_read;
+  io->write = dur_write;
+  io->read_batch = dur_read_batch;
+  io->write_batch = dur_write_batch;
+
+  return 0;
+}
+
+void
+dur_close (struct dht_uring *dur)
+{
+  io_uring_free_buf_ring (&dur->ring, dur->br, DUR_NUM_BUFS, DUR_BGID);
+  io_uring_queue_exit (&dur->ring);
+  free (dur->bufs);
+  free (dur);
+}
+
+/* 
+ * the ring descriptor turns readable when completions are waiting
+ * */
+int
+dur_fd (struct dht_uring *dur)
+{
+  return dur->ring.ring_fd;
+}
+
+#endif
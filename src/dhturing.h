@@ -0,0 +1,48 @@
+/*
+* This file is part of the libttdht package
+* Copyright (C) <2008>  <Alf>
+*
+* Contact: Alf <naihe2010@126.com>
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License along
+* with this program; if not, write to the Free Software Foundation, Inc.,
+* 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*
+*/
+/* @CFILE dhturing.h
+*/
+
+#ifndef _DHT_URING_H_
+#define _DHT_URING_H_
+
+#include "dhtio.h"
+
+#define DUR_NUM_ENTRIES             256
+#define DUR_NUM_BUFS                256
+#define DUR_SIZE_BUF                2048
+#define DUR_BGID                    0
+
+/* 
+ * io_uring backend of the built-in io, one multishot recvmsg over a
+ * ring of provided buffers stays posted on the socket, sends are
+ * submitted without waiting, wakeups arrive as a poll on the eventfd
+ * */
+struct dht_uring;
+
+int dur_open (dhtio_t *, struct dht_io *);
+
+void dur_close (struct dht_uring *);
+
+int dur_fd (struct dht_uring *);
+
+#endif